@@ -15,20 +15,359 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stddef.h>
 
 /* Opaque handle */
 typedef struct rave_handle * rave_handle_t;
 
+/* Where rave gets the list of functions from */
+enum rave_metadata {
+	/* Debug info (.debug_info), needs an unstripped binary */
+	RAVE_METADATA_DWARF,
+
+	/* Unwind tables (.eh_frame_hdr/.eh_frame), present in stripped binaries */
+	RAVE_METADATA_EHFRAME,
+
+	/* Sized function symbols (.symtab/.dynsym), no debug info needed */
+	RAVE_METADATA_SYMTAB,
+
+	RAVE_METADATA_MAX,
+};
+
+/* Handle options. These must be set between rave_create and rave_init. */
+enum rave_option {
+	/* Map the code segment copy-on-write from the binary instead of copying
+	 * the whole segment up front. Only pages that get randomized end up being
+	 * copied. (boolean, default off) */
+	RAVE_OPT_COW,
+
+	/* Number of threads used for initialization work (walking the metadata
+	 * and analyzing functions), 0 for one per cpu. (default 1) */
+	RAVE_OPT_WORKERS,
+
+	/* Number of threads rave_randomize uses, 0 for one per cpu. The layout is
+	 * the same no matter how many threads are used. (default 1) */
+	RAVE_OPT_RANDOMIZE_WORKERS,
+
+	/* Metadata backend, one of enum rave_metadata. (default dwarf) */
+	RAVE_OPT_METADATA,
+
+	/* Only pick a seed in rave_randomize, and permute functions as the pages
+	 * they are on get faulted in through rave_handle_fault. The layout is the
+	 * same as the eager one, but code not yet faulted in (e.g. through
+	 * rave_get_text) is still in its old layout. (boolean, default off) */
+	RAVE_OPT_LAZY,
+
+	/* Most pages rave_handle_fault_around hands back for one fault, 0 or 1
+	 * for a single page. How many it actually hands back adapts to the
+	 * faults: the run doubles while faults keep landing right after the last
+	 * one, and halves when they don't. (default 1) */
+	RAVE_OPT_FAULT_AROUND,
+
+	/* Keep the code in a 2 MiB aligned buffer backed by transparent huge
+	 * pages, and have rave_handle_fault_around and rave_get_pages hand out
+	 * whole huge pages, so the target's text can end up huge page backed
+	 * too. Only segments aligned to 2 MiB in the binary get huge pages, and
+	 * only once relocated to a 2 MiB aligned address; the pages at either
+	 * end of the segment, and anything else, are served as usual. Not
+	 * together with RAVE_OPT_COW. (boolean, default off) */
+	RAVE_OPT_HUGEPAGES,
+};
+
+/* A run of pages in the target's address space */
+struct rave_range {
+	uintptr_t address;
+	size_t length;
+};
+
+/* A run of pages in the target's address space, and where rave has them */
+struct rave_page_run {
+	uintptr_t address;
+	void *data;
+	size_t length;
+};
+
+/* A function rave randomizes, in the target's address space */
+struct rave_function {
+	uintptr_t address;
+	size_t length;
+};
+
+/* Why a function listed in the metadata isn't randomized */
+enum rave_reject {
+	/* The metadata puts it (partly) outside of .text */
+	RAVE_REJECT_OUTSIDE_TEXT,
+
+	/* Some of it couldn't be decoded */
+	RAVE_REJECT_DECODE,
+
+	/* The prologue pushes fewer than two registers, or not canonically */
+	RAVE_REJECT_NO_PROLOGUE,
+
+	/* An exit pops the registers in a way that can't be rewritten */
+	RAVE_REJECT_BAD_EPILOGUE,
+
+	/* No exit pops the registers the prologue pushes */
+	RAVE_REJECT_NO_EPILOGUE,
+
+	/* The instructions don't end where the metadata says the function does */
+	RAVE_REJECT_SIZE,
+
+	/* The pushes and pops found don't add up (e.g. a corrupt cache entry) */
+	RAVE_REJECT_INVALID,
+
+	RAVE_REJECT_MAX,
+};
+
+enum rave_phase {
+	/* Opening the binary and mapping the code */
+	RAVE_PHASE_LOAD,
+
+	/* Walking the metadata for functions */
+	RAVE_PHASE_METADATA,
+
+	/* Decoding and analyzing functions (or loading the analysis cache) */
+	RAVE_PHASE_ANALYSIS,
+
+	/* Every permute outside of a fault: rave_randomize (and the async and
+	 * range versions) */
+	RAVE_PHASE_PERMUTE,
+
+	/* Every fault served, including lazy permutes */
+	RAVE_PHASE_FAULT,
+
+	RAVE_PHASE_MAX,
+};
+
+struct rave_stats {
+	/* Functions the metadata listed and what became of them. When the
+	 * analysis came out of the cache, nothing is known about rejections, so
+	 * seen is just the accepted functions. */
+	uint64_t functions_seen;
+	uint64_t functions_accepted;
+	uint64_t functions_rejected;
+	uint64_t rejected[RAVE_REJECT_MAX];
+	int cache_hit;
+
+	/* Push and pop sets in the accepted functions */
+	uint64_t prologues;
+	uint64_t epilogues;
+
+	/* Bytes of code written over the life of the handle, and the code pages
+	 * written so far */
+	uint64_t bytes_modified;
+	uint64_t pages_modified;
+
+	uint64_t randomizations;
+	uint64_t faults;
+
+	/* Pages handed out by faults, more than faults with fault-around.
+	 * rave_handle_faults counts a fault per run it serves. */
+	uint64_t fault_pages;
+
+	/* Nanoseconds spent in each phase. Randomizing and faults add up over
+	 * the life of the handle. */
+	uint64_t phase_ns[RAVE_PHASE_MAX];
+
+	/* Bytes rave has allocated since the process started, across every
+	 * handle */
+	uint64_t bytes_allocated;
+};
+
+/* Memory management hooks. ctx is passed along to every call. */
+struct rave_allocator {
+	void *(*malloc)(size_t size, void *ctx);
+	void *(*realloc)(void *ptr, size_t size, void *ctx);
+	void (*free)(void *ptr, void *ctx);
+	void *ctx;
+};
+
+/* Have rave allocate through the given hooks instead of stdlib (NULL goes back
+ * to stdlib). This is global, and has to be done while there are no handles.
+ * Libraries rave uses underneath (libelf, libdwarf) still use stdlib. */
+int rave_set_allocator(const struct rave_allocator *allocator);
+
+enum rave_log_level {
+	RAVE_LOG_DEBUG,
+	RAVE_LOG_INFO,
+	RAVE_LOG_WARN,
+	RAVE_LOG_ERROR,
+	RAVE_LOG_FATAL,
+
+	/* Nothing at all */
+	RAVE_LOG_NONE,
+};
+
+/* Only log messages at or above level (for the whole process, default
+ * everything). Levels below the one rave was built with are compiled out no
+ * matter what: debug builds have everything, NDEBUG builds start at info. */
+int rave_set_log_level(enum rave_log_level level);
+
 rave_handle_t rave_create(void);
 void rave_destroy(rave_handle_t self);
 
+int rave_set_option(rave_handle_t self, enum rave_option option, long value);
+
+/* Keep the analysis of each binary in this directory, keyed by build-id and
+ * metadata backend, so later inits of the same build can skip the analysis.
+ * Stale or corrupt caches are rebuilt. Pass NULL to disable (the default). */
+int rave_set_cache_dir(rave_handle_t self, const char *dir);
+
 int rave_init(rave_handle_t self, const char *filename);
 int rave_close(rave_handle_t self);
 
+/* Seed the handle's generator. With the same seed and the same binary, every
+ * randomization after this (of any kind, however many workers, lazy or not)
+ * gives the same layouts. Otherwise the generator is seeded from the kernel
+ * when the handle is created. */
+int rave_set_seed(rave_handle_t self, uint64_t seed);
+
 int rave_randomize(rave_handle_t self);
+
+/* Re-randomize just the functions reaching into [lo, hi), or the functions
+ * containing each of the given addresses (in the target's address space). The
+ * chosen functions get a fresh permutation right away, even in lazy mode, and
+ * no other code is touched. rave_get_changed_pages tells what was written. */
+int rave_randomize_range(rave_handle_t self, uintptr_t lo, uintptr_t hi);
+int rave_randomize_functions(rave_handle_t self, const uintptr_t *addresses,
+	size_t nr);
+
+/* Find the function containing address (in the target's address space). Only
+ * functions rave randomizes are found, anything else is RAVE__ENOENT. */
+int rave_find_function(rave_handle_t self, uintptr_t address,
+	struct rave_function *out);
+
+/* Get a snapshot of what the handle has done so far. Safe to call at any
+ * point after rave_init, from any thread. */
+int rave_get_stats(rave_handle_t self, struct rave_stats *stats);
+
+/* Build the next layout in a separate buffer on a background thread, while
+ * faults keep being served from the current one. Nothing changes for the
+ * current layout until rave_publish swaps the new one in, which returns
+ * RAVE__EBUSY until the build is done (rave_randomize_wait blocks until it
+ * is). Other randomizations return RAVE__EBUSY while a layout is pending. Not
+ * available in lazy mode. */
+int rave_randomize_async(rave_handle_t self);
+int rave_randomize_wait(rave_handle_t self);
+int rave_publish(rave_handle_t self);
+
+/* These work on the current layout without pinning it, and rave_publish
+ * frees a layout as soon as nothing is pinned from it. So they must not run
+ * concurrently with rave_publish, and whatever they return is only good
+ * until the next publish. The same goes for rave_handle_fault_around,
+ * rave_handle_faults, rave_get_code and rave_get_text. Faults served while
+ * layouts are being published go through rave_get_page and friends. */
 int rave_relocate(rave_handle_t self, uintptr_t address);
 void *rave_handle_fault(rave_handle_t self, uintptr_t address);
+
+/* Same as rave_handle_fault, but the page stays valid, and keeps its
+ * contents, even if a new layout is published in the meantime. Every page has
+ * to be handed back with rave_put_page. */
+void *rave_get_page(rave_handle_t self, uintptr_t address);
+void rave_put_page(rave_handle_t self, void *page);
+
+/* Same as rave_handle_fault and rave_get_page, but hand back a run of pages
+ * starting at the faulting one (see RAVE_OPT_FAULT_AROUND), or the whole huge
+ * page containing it (see RAVE_OPT_HUGEPAGES). The run is contiguous in both
+ * the target and rave, so it can be installed in one go, and run is set to
+ * where it goes in the target. Pages from rave_get_pages are handed back with
+ * a single rave_put_page. */
+void *rave_handle_fault_around(rave_handle_t self, uintptr_t address,
+	struct rave_range *run);
+void *rave_get_pages(rave_handle_t self, uintptr_t address,
+	struct rave_range *run);
+
+/* Resolve a batch of faults at once. The pages of the addresses are sorted,
+ * duplicates dropped, and neighbours merged into runs, which are written to
+ * runs in address order (there are never more runs than addresses, so nr
+ * entries is always enough). Addresses outside the code get runs with NULL
+ * data. Returns the number of runs. Like rave_handle_fault, nothing is
+ * pinned. rave_get_faults pins like rave_get_pages, and every run with data
+ * has to be handed back with its own rave_put_page. */
+size_t rave_handle_faults(rave_handle_t self, const uintptr_t *addresses,
+	size_t nr, struct rave_page_run *runs);
+size_t rave_get_faults(rave_handle_t self, const uintptr_t *addresses,
+	size_t nr, struct rave_page_run *runs);
 void *rave_get_code(rave_handle_t self, size_t *length);
+
+/* Where the code from rave_get_code is in the target, i.e. wherever it was
+ * last relocated to */
+uintptr_t rave_get_code_address(rave_handle_t self);
+
+/* Serving page faults over userfaultfd. The server resolves every missing
+ * fault in the registered ranges from the handle (UFFDIO_COPY, or
+ * UFFDIO_ZEROPAGE for pages which are all zero, like the tail of the
+ * segment, and for pages past the end of the code), on its own threads, until
+ * it is closed. */
+typedef struct rave_uffd * rave_uffd_t;
+
+#define RAVE_UFFD_LATENCY_BUCKETS 16
+
+struct rave_uffd_stats {
+	uint64_t faults;
+	uint64_t copies;
+	uint64_t zeropages;
+
+	/* Pages put in place, more than copies and zeropages together with
+	 * fault-around */
+	uint64_t pages;
+
+	/* Faults in the code which couldn't be served from the handle, or
+	 * couldn't be resolved at all. Those are left unresolved: the faulting
+	 * thread stays blocked rather than run code which isn't there. */
+	uint64_t errors;
+
+	/* From reading the fault to the page being in place */
+	uint64_t latency_total_ns;
+	uint64_t latency_max_ns;
+
+	/* Bucket i counts faults served in [2^i, 2^(i+1)) microseconds. The first
+	 * bucket also has anything faster, the last anything slower. */
+	uint64_t latency_us[RAVE_UFFD_LATENCY_BUCKETS];
+};
+
+rave_uffd_t rave_uffd_create(void);
+void rave_uffd_destroy(rave_uffd_t self);
+
+/* Start serving faults on uffd with nr_workers threads (0 for one per cpu).
+ * uffd has to have been through the UFFDIO_API handshake already (e.g. one
+ * handed over by the target process), or pass -1 to have rave make one for
+ * this process. The handle has to be relocated to wherever the code segment
+ * is in the target (and stay there while serving). The uffd is switched to non-blocking. */
+int rave_uffd_init(rave_uffd_t self, rave_handle_t handle, int uffd,
+	size_t nr_workers);
+
+/* Stop serving and wait for the workers. A uffd rave made is closed, one
+ * passed in is left alone. */
+int rave_uffd_close(rave_uffd_t self);
+
+/* Register [start, start + length) in the target (page aligned) for missing
+ * faults */
+int rave_uffd_register(rave_uffd_t self, uintptr_t start, size_t length);
+
+int rave_uffd_get_stats(rave_uffd_t self, struct rave_uffd_stats *stats);
+
+/* Get a 64 bit content hash (XXH3, the same in every process) of each code
+ * page, as rave currently has it, starting with the page at *base (in the
+ * target's address space). Pages are only rehashed once they are written, so
+ * asking again after a partial re-randomization is cheap. In lazy mode,
+ * pages not faulted in yet are hashed as they are, before being permuted.
+ * Fills in at most nr_hashes and returns the total number of pages, so
+ * passing 0 hashes just gets the count. */
+size_t rave_get_page_hashes(rave_handle_t self, uint64_t *hashes,
+	size_t nr_hashes, uintptr_t *base);
+
+/* Get the runs of code pages which have been written (i.e. the pages holding
+ * randomized code, though a page can come out with the same bytes). Fills in at most nr_ranges entries and returns the
+ * total number of runs, so passing 0 ranges just gets the count. */
+size_t rave_get_dirty_pages(rave_handle_t self, struct rave_range *ranges,
+	size_t nr_ranges);
+
+/* Same as rave_get_dirty_pages, but only the pages written since the last
+ * rave_randomize (including pages randomized lazily since then) or the last
+ * rave_randomize_range/rave_randomize_functions. */
+size_t rave_get_changed_pages(rave_handle_t self, struct rave_range *ranges,
+	size_t nr_ranges);
 void *rave_get_text(struct rave_handle *self, size_t *length);
 size_t rave_get_text_offset(struct rave_handle *self);
 
@@ -28,11 +28,16 @@
 	X(EMAP_FAILED, "MMAP failure") \
 	X(ESEG_NOT_LOADABLE, "Tried to load an unloadable Elf segment") \
 	X(EDWARF, "Dwarf error - investigate dwarf error codes") \
-	X(ETRANSFORM, "transform error")
+	X(EMETADATA, "Malformed function metadata") \
+	X(ETRANSFORM, "transform error") \
+	X(ECACHE, "Analysis cache missing or invalid") \
+	X(EUFFD, "userfaultfd error")
 
 #define GENERIC_CODES \
 	X(EFATAL, "Something bad happened") \
 	X(EINVAL, "Invalid parameter") \
+	X(EBUSY, "Resource busy") \
+	X(ENOENT, "No such entry") \
 	X(ENOMEM, "No memory left")
 
 typedef enum {
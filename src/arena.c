@@ -0,0 +1,102 @@
+#include <stdint.h>
+
+#include "arena.h"
+#include "memory.h"
+#include "util.h"
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size, used;
+
+	max_align_t data[];
+};
+
+#define ARENA_ALIGN (sizeof(max_align_t))
+
+void arena_init(struct arena *self)
+{
+	if (NULL == self) {
+		return;
+	}
+
+	self->chunks = NULL;
+	self->used = self->size = 0;
+}
+
+void arena_close(struct arena *self)
+{
+	struct arena_chunk *chunk, *next;
+
+	if (NULL == self) {
+		return;
+	}
+
+	for (chunk = self->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		rave_free(chunk);
+	}
+
+	arena_init(self);
+}
+
+void *arena_alloc(struct arena *self, size_t size)
+{
+	struct arena_chunk *chunk = self->chunks;
+	size_t chunk_size;
+	void *ptr;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+	if (NULL == chunk || chunk->size - chunk->used < size) {
+		/* Big allocations get a chunk to themselves */
+		chunk_size = max(size, (size_t)ARENA_CHUNK_SIZE);
+		chunk = rave_malloc(sizeof(*chunk) + chunk_size);
+		if (NULL == chunk) {
+			return NULL;
+		}
+
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		self->size += chunk_size;
+
+		/* A chunk to itself is full straight away, so it goes behind the
+		 * one being bumped out of rather than wasting what is left there */
+		if (chunk_size > ARENA_CHUNK_SIZE && NULL != self->chunks) {
+			chunk->next = self->chunks->next;
+			self->chunks->next = chunk;
+		} else {
+			chunk->next = self->chunks;
+			self->chunks = chunk;
+		}
+	}
+
+	ptr = (char *)chunk->data + chunk->used;
+	chunk->used += size;
+	self->used += size;
+
+	return ptr;
+}
+
+void arena_splice(struct arena *self, struct arena *src)
+{
+	struct arena_chunk *last;
+
+	if (NULL == self || NULL == src || NULL == src->chunks) {
+		return;
+	}
+
+	/* Keep bumping out of our own current chunk, the spliced ones go after */
+	for (last = src->chunks; last->next; last = last->next)
+		;
+
+	if (NULL == self->chunks) {
+		self->chunks = src->chunks;
+	} else {
+		last->next = self->chunks->next;
+		self->chunks->next = src->chunks;
+	}
+
+	self->used += src->used;
+	self->size += src->size;
+	arena_init(src);
+}
@@ -0,0 +1,38 @@
+/**
+ * Arena
+ *
+ * Bump allocator for things which live as long as the handle (e.g. the
+ * analysis). Memory is handed out of big chunks and never freed on its own,
+ * the whole arena goes at once.
+ *
+ * Author: Christopher Blackburn <krizboy@vt.edu>
+ * Date: 1/1/1977
+ */
+
+#ifndef __ARENA_H_
+#define __ARENA_H_
+
+#include <stddef.h>
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+struct arena_chunk;
+
+/* Not thread safe, give each thread its own arena and splice them together */
+struct arena {
+	/* The chunk being bumped out of is first */
+	struct arena_chunk *chunks;
+
+	/* Bytes handed out and bytes held */
+	size_t used, size;
+};
+
+void arena_init(struct arena *self);
+void arena_close(struct arena *self);
+
+void *arena_alloc(struct arena *self, size_t size);
+
+/* Move everything in src over to self. src is left empty. */
+void arena_splice(struct arena *self, struct arena *src);
+
+#endif /* __ARENA_H_ */
@@ -7,6 +7,7 @@
 
 #include "binary.h"
 #include "rave/errno.h"
+#include "util.h"
 #include "log.h"
 
 // TODO: Move to arch specific code
@@ -44,22 +45,21 @@ static int map_file(struct binary *self, const char *filename)
 
 	if ((fstat(fd, &statbuf)) == -1) {
 		FATAL("Could not stat file %s", filename);
+		close(fd);
 		return RAVE__EFILE_STAT;
 	}
 
 	self->file_size = statbuf.st_size;
 
 	self->mapping = mmap(NULL, self->file_size, PROT_READ, MAP_SHARED, fd, 0);
-	if (self->mapping == NULL) {
+	if (self->mapping == MAP_FAILED) {
 		FATAL("Could not mmap file %s", filename);
+		self->mapping = NULL;
+		close(fd);
 		return RAVE__EMAPPING;
 	}
 
-	if (close(fd) == -1) {
-		ERROR("Could not close file %s", filename);
-		return RAVE__EFILE_CLOSE;
-	}
-
+	self->fd = fd;
 	return RAVE__SUCCESS;
 }
 
@@ -68,6 +68,7 @@ int binary_init(struct binary *self, const char *filename)
 	int rc;
 	DEBUG("Initializing binary from file: %s", filename);
 
+	self->fd = -1;
 	self->mapping = NULL;
 	self->file_size = 0;
 	self->elf = NULL;
@@ -139,6 +140,15 @@ int binary_close(struct binary *self)
 		}
 	}
 
+	if (self->fd != -1) {
+		if (close(self->fd) == -1) {
+			ERROR("Could not close file");
+			return RAVE__EFILE_CLOSE;
+		}
+
+		self->fd = -1;
+	}
+
 	DEBUG("Binary unloaded");
 	return RAVE__SUCCESS;
 }
@@ -162,7 +172,7 @@ int binary_find_section(const struct binary *self, const char *target,
 			continue;
 		}
 
-		if (strncmp(target, iter, strlen(target)) == 0) {
+		if (strcmp(target, iter) == 0) {
 			return section_init(section, self->elf, &shdr, iter, scn);
 		}
 	}
@@ -195,6 +205,51 @@ int binary_find_segment(const struct binary *self, uintptr_t address,
 	return RAVE__ENO_SEGMENT;
 }
 
+/* Find the NT_GNU_BUILD_ID note. The id points into the file mapping. */
+int binary_build_id(const struct binary *self, const void **id,
+	size_t *length)
+{
+	GElf_Shdr shdr;
+	GElf_Nhdr nhdr;
+	Elf_Scn *scn = NULL;
+	Elf_Data *data;
+	size_t offset, next, name_offset, desc_offset;
+
+	while ((scn = elf_nextscn(self->elf, scn))) {
+		if (gelf_getshdr(scn, &shdr) != &shdr) {
+			return RAVE__ESECTION_HEADER;
+		}
+
+		if (shdr.sh_type != SHT_NOTE) {
+			continue;
+		}
+
+		data = elf_getdata(scn, NULL);
+		if (NULL == data) {
+			continue;
+		}
+
+		offset = 0;
+		while ((next = gelf_getnote(data, offset, &nhdr, &name_offset,
+			&desc_offset)) > 0)
+		{
+			if (nhdr.n_type == NT_GNU_BUILD_ID &&
+				nhdr.n_namesz == sizeof(ELF_NOTE_GNU) &&
+				memcmp(OFFSET(data->d_buf, name_offset), ELF_NOTE_GNU,
+					sizeof(ELF_NOTE_GNU)) == 0)
+			{
+				*id = OFFSET(data->d_buf, desc_offset);
+				*length = nhdr.n_descsz;
+				return RAVE__SUCCESS;
+			}
+
+			offset = next;
+		}
+	}
+
+	return RAVE__ENO_SECTION;
+}
+
 #define PRINT_FIELD(N) do { \
 	printf("	%-20s 0x%jx\n", #N, (uintmax_t)self->header.e_##N); } while (0)
 void binary_print(const struct binary *self)
@@ -36,7 +36,7 @@ struct section {
 int section_init(struct section *self, Elf *elf, GElf_Shdr *header,
 	const char *name, Elf_Scn *scn);
 
-int section_address(const struct section *self);
+uintptr_t section_address(const struct section *self);
 size_t section_offset(const struct section *self);
 size_t section_size(const struct section *self);
 
@@ -54,6 +54,7 @@ uintptr_t segment_vaddr(const struct segment *self);
 size_t segment_offset(const struct segment *self);
 size_t segment_filesz(const struct segment *self);
 size_t segment_memsz(const struct segment *self);
+size_t segment_align(const struct segment *self);
 int segment_loadable(const struct segment *self);
 
 int segment_contains(const struct segment *self, uintptr_t address);
@@ -65,7 +66,9 @@ struct binary {
     Elf *elf;
     GElf_Ehdr header;
 
-	/* File */
+	/* File. The descriptor is kept open so the code segment can be mapped
+	 * copy-on-write straight from the file. */
+	int fd;
 	void *mapping;
 	int file_size;
 };
@@ -78,6 +81,10 @@ int binary_find_section(const struct binary *self, const char *target,
 int binary_find_segment(const struct binary *self, uintptr_t address,
 	struct segment *segment);
 
+/* Get the build-id of the binary (from the NT_GNU_BUILD_ID note) */
+int binary_build_id(const struct binary *self, const void **id,
+	size_t *length);
+
 void binary_print(const struct binary *self);
 
 #ifdef __cplusplus
@@ -0,0 +1,94 @@
+/**
+ * Bitmap
+ *
+ * Simple bitmaps, loosely modeled after the linux kernel helpers.
+ *
+ * Author: Christopher Blackburn <krizboy@vt.edu>
+ * Date: 1/1/1977
+ */
+
+#ifndef __BITMAP_H_
+#define __BITMAP_H_
+
+#include <stddef.h>
+#include <string.h>
+
+#define BITS_PER_LONG (sizeof(unsigned long) * 8)
+#define BITS_TO_LONGS(nr) (((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define BIT_WORD(nr) ((nr) / BITS_PER_LONG)
+#define BIT_MASK(nr) (1UL << ((nr) % BITS_PER_LONG))
+
+static inline void set_bit(size_t nr, unsigned long *map)
+{
+	map[BIT_WORD(nr)] |= BIT_MASK(nr);
+}
+
+/* For bitmaps shared between threads */
+static inline void set_bit_atomic(size_t nr, unsigned long *map)
+{
+	__atomic_fetch_or(&map[BIT_WORD(nr)], BIT_MASK(nr), __ATOMIC_RELAXED);
+}
+
+static inline void clear_bit(size_t nr, unsigned long *map)
+{
+	map[BIT_WORD(nr)] &= ~BIT_MASK(nr);
+}
+
+static inline void bitmap_zero(unsigned long *map, size_t nbits)
+{
+	memset(map, 0, BITS_TO_LONGS(nbits) * sizeof(unsigned long));
+}
+
+/* Set bits [start, start + len) */
+static inline void bitmap_set(unsigned long *map, size_t start, size_t len)
+{
+	for (size_t i = start; i < start + len; i++) {
+		set_bit(i, map);
+	}
+}
+
+/* Find the next set (or cleared) bit at or after offset. Returns size if there
+ * is none. */
+static inline size_t __find_next(const unsigned long *map, size_t size,
+	size_t offset, unsigned long invert)
+{
+	unsigned long word;
+
+	if (offset >= size) {
+		return size;
+	}
+
+	word = (map[BIT_WORD(offset)] ^ invert) & (~0UL << (offset % BITS_PER_LONG));
+	offset -= offset % BITS_PER_LONG;
+
+	while (!word) {
+		offset += BITS_PER_LONG;
+		if (offset >= size) {
+			return size;
+		}
+
+		word = map[BIT_WORD(offset)] ^ invert;
+	}
+
+	offset += __builtin_ctzl(word);
+	return offset < size ? offset : size;
+}
+
+static inline size_t find_next_bit(const unsigned long *map, size_t size,
+	size_t offset)
+{
+	return __find_next(map, size, offset, 0UL);
+}
+
+static inline size_t find_next_zero_bit(const unsigned long *map, size_t size,
+	size_t offset)
+{
+	return __find_next(map, size, offset, ~0UL);
+}
+
+#define for_each_set_bit(bit, map, size) \
+	for ((bit) = find_next_bit((map), (size), 0); \
+		(bit) < (size); \
+		(bit) = find_next_bit((map), (size), (bit) + 1))
+
+#endif /* __BITMAP_H_ */
@@ -0,0 +1,445 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "rave/errno.h"
+#include "memory.h"
+#include "util.h"
+#include "log.h"
+
+#define CACHE_MAGIC "RAVECACH"
+#define CACHE_VERSION 3
+#define CACHE_MAX_BUILD_ID 64
+#define CACHE_SUFFIX ".rave"
+
+/* On-disk layout. Everything is fixed width and there are no pointers, only
+ * indices into the arrays which follow the header:
+ *
+ * +--------+-----------------+-----------------+
+ * | header | functions[nr_f] | epilogues[nr_e] |
+ * +--------+-----------------+-----------------+
+ *
+ * Which is more or less the in-memory representation of the transformables.
+ * */
+struct cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t build_id_len;
+	uint8_t build_id[CACHE_MAX_BUILD_ID];
+
+	uint64_t text_addr;
+	uint64_t text_size;
+	uint64_t metadata;
+
+	uint64_t nr_functions;
+	uint64_t nr_epilogues;
+
+	/* FNV-1a of everything following the header */
+	uint64_t checksum;
+};
+
+struct cache_function {
+	uint64_t addr;
+	uint64_t len;
+	uint32_t prologue_offset;
+	uint32_t prologue_length;
+	uint32_t first_epilogue;
+	uint32_t nr_epilogues;
+	uint8_t nr_regs;
+	uint8_t regs[TRANSFORM_MAX_REGS];
+	uint8_t pad[7];
+};
+
+struct cache_epilogue {
+	uint32_t offset;
+	uint32_t length;
+};
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t length)
+{
+	const uint8_t *walk = data;
+
+	while (length--) {
+		hash ^= *walk++;
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+char *cache_path(const char *dir, const struct cache_key *key)
+{
+	const uint8_t *id = key->build_id;
+	size_t length;
+	char *path, *walk;
+
+	/* One file per backend, so switching between them doesn't keep
+	 * throwing the other's cache away */
+	length = strlen(dir) + 1 + key->build_id_len * 2 + 1 + 10 +
+		sizeof(CACHE_SUFFIX);
+	path = rave_malloc(length);
+	if (NULL == path) {
+		return NULL;
+	}
+
+	walk = path + sprintf(path, "%s/", dir);
+	for (size_t i = 0; i < key->build_id_len; i++) {
+		walk += sprintf(walk, "%02x", id[i]);
+	}
+	sprintf(walk, "-%u%s", (unsigned int)key->metadata, CACHE_SUFFIX);
+
+	return path;
+}
+
+static int header_matches(const struct cache_header *header,
+	const struct cache_key *key, size_t file_size)
+{
+	size_t expected;
+
+	if (file_size < sizeof(*header)) {
+		return 0;
+	}
+
+	if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+		header->version != CACHE_VERSION)
+	{
+		return 0;
+	}
+
+	/* No cache could have been stored for it (see cache_store) */
+	if (key->build_id_len > CACHE_MAX_BUILD_ID) {
+		return 0;
+	}
+
+	if (header->build_id_len != key->build_id_len ||
+		memcmp(header->build_id, key->build_id, key->build_id_len) != 0)
+	{
+		DEBUG("Cache is for a different build");
+		return 0;
+	}
+
+	if (header->text_addr != key->text_addr ||
+		header->text_size != key->text_size)
+	{
+		return 0;
+	}
+
+	if (header->metadata != (uint64_t)key->metadata) {
+		DEBUG("Cache is from a different metadata backend");
+		return 0;
+	}
+
+	/* Guard against counts that would overflow the size computation */
+	if (header->nr_functions > file_size ||
+		header->nr_epilogues > file_size)
+	{
+		return 0;
+	}
+
+	expected = sizeof(*header) +
+		header->nr_functions * sizeof(struct cache_function) +
+		header->nr_epilogues * sizeof(struct cache_epilogue);
+
+	return expected == file_size;
+}
+
+/* Make sure a record only references things it is allowed to. The sets
+ * themselves are checked when they are added to the transform. */
+static int function_valid(const struct cache_header *header,
+	const struct cache_function *cf)
+{
+	uint64_t text_end = header->text_addr + header->text_size;
+	uint64_t end = cf->addr + cf->len;
+
+	if (cf->addr < header->text_addr || end > text_end || end < cf->addr) {
+		return 0;
+	}
+
+	if ((uint64_t)cf->first_epilogue + cf->nr_epilogues > header->nr_epilogues ||
+		cf->nr_regs > TRANSFORM_MAX_REGS)
+	{
+		return 0;
+	}
+
+	return 1;
+}
+
+static int load_functions(transform_t transform, struct window *text,
+	const struct cache_header *header)
+{
+	const struct cache_function *functions;
+	const struct cache_epilogue *epilogues;
+	struct instr_set prologue, *sets = NULL;
+	struct function record;
+	size_t max_epilogues = 0;
+	int rc = RAVE__SUCCESS;
+
+	functions = (const void *)(header + 1);
+	epilogues = (const void *)(functions + header->nr_functions);
+
+	for (size_t i = 0; i < header->nr_functions; i++) {
+		if (!function_valid(header, &functions[i])) {
+			ERROR("Cache record %zu is invalid", i);
+			return RAVE__ECACHE;
+		}
+
+		max_epilogues = max(max_epilogues, (size_t)functions[i].nr_epilogues);
+	}
+
+	sets = rave_malloc(sizeof(*sets) * max(max_epilogues, (size_t)1));
+	if (NULL == sets) {
+		return RAVE__ENOMEM;
+	}
+
+	for (size_t i = 0; i < header->nr_functions; i++) {
+		const struct cache_function *cf = &functions[i];
+
+		record.addr = cf->addr;
+		record.len = cf->len;
+		prologue.offset = cf->prologue_offset;
+		prologue.length = cf->prologue_length;
+
+		for (size_t j = 0; j < cf->nr_epilogues; j++) {
+			sets[j].offset = epilogues[cf->first_epilogue + j].offset;
+			sets[j].length = epilogues[cf->first_epilogue + j].length;
+		}
+
+		rc = transform_add_analyzed(transform, text, &record, cf->regs,
+			cf->nr_regs, &prologue, sets, cf->nr_epilogues);
+		if (rc != RAVE__SUCCESS) {
+			ERROR("Cache record @ 0x%"PRIx64" does not match the binary",
+				cf->addr);
+			if (rc != RAVE__ENOMEM) {
+				rc = RAVE__ECACHE;
+			}
+			break;
+		}
+	}
+
+	rave_free(sets);
+	return rc;
+}
+
+int cache_load(transform_t transform, struct window *text, const char *path,
+	const struct cache_key *key)
+{
+	const struct cache_header *header;
+	struct stat statbuf;
+	void *mapping;
+	uint64_t checksum;
+	int fd, rc;
+
+	if (NULL == transform || NULL == text || NULL == path || NULL == key) {
+		return RAVE__EINVAL;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		DEBUG("No analysis cache at %s", path);
+		return RAVE__ECACHE;
+	}
+
+	if (fstat(fd, &statbuf) == -1 || statbuf.st_size == 0) {
+		close(fd);
+		return RAVE__ECACHE;
+	}
+
+	mapping = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (MAP_FAILED == mapping) {
+		return RAVE__ECACHE;
+	}
+
+	header = mapping;
+	if (!header_matches(header, key, statbuf.st_size)) {
+		WARN("Stale analysis cache %s", path);
+		rc = RAVE__ECACHE;
+		goto out;
+	}
+
+	checksum = fnv1a(FNV_OFFSET, header + 1,
+		statbuf.st_size - sizeof(*header));
+	if (checksum != header->checksum) {
+		WARN("Corrupt analysis cache %s", path);
+		rc = RAVE__ECACHE;
+		goto out;
+	}
+
+	rc = load_functions(transform, text, header);
+	if (rc == RAVE__SUCCESS) {
+		DEBUG("Loaded %"PRIu64" functions from analysis cache",
+			header->nr_functions);
+	}
+
+out:
+	munmap(mapping, statbuf.st_size);
+	return rc;
+}
+
+/* State for the passes over the transform when writing the cache */
+struct writer {
+	FILE *file;
+	struct cache_header header;
+	uint32_t next_epilogue;
+};
+
+static int write_bytes(struct writer *w, const void *data, size_t length)
+{
+	if (fwrite(data, 1, length, w->file) != length) {
+		return RAVE__ECACHE;
+	}
+
+	w->header.checksum = fnv1a(w->header.checksum, data, length);
+	return RAVE__SUCCESS;
+}
+
+static int count_cb(const struct transformable *tf, void *arg)
+{
+	struct writer *w = arg;
+
+	w->header.nr_functions++;
+	w->header.nr_epilogues += tf->nr_epilogues;
+
+	return RAVE__SUCCESS;
+}
+
+static int function_cb(const struct transformable *tf, void *arg)
+{
+	struct writer *w = arg;
+	struct cache_function cf;
+
+	memset(&cf, 0, sizeof(cf));
+	cf.addr = tf->record.addr;
+	cf.len = tf->record.len;
+	cf.prologue_offset = tf->prologue.offset;
+	cf.prologue_length = tf->prologue.length;
+	cf.first_epilogue = w->next_epilogue;
+	cf.nr_epilogues = tf->nr_epilogues;
+	cf.nr_regs = tf->nr_regs;
+	memcpy(cf.regs, tf->regs, tf->nr_regs);
+
+	w->next_epilogue += cf.nr_epilogues;
+
+	return write_bytes(w, &cf, sizeof(cf));
+}
+
+static int epilogue_cb(const struct transformable *tf, void *arg)
+{
+	struct writer *w = arg;
+	struct cache_epilogue ce;
+	int rc;
+
+	for (size_t i = 0; i < tf->nr_epilogues; i++) {
+		ce.offset = tf->epilogues[i].offset;
+		ce.length = tf->epilogues[i].length;
+
+		rc = write_bytes(w, &ce, sizeof(ce));
+		if (rc != RAVE__SUCCESS) {
+			return rc;
+		}
+	}
+
+	return RAVE__SUCCESS;
+}
+
+int cache_store(transform_t transform, const char *path,
+	const struct cache_key *key)
+{
+	struct writer w;
+	char *tmp;
+	int fd, rc;
+
+	if (NULL == transform || NULL == path || NULL == key) {
+		return RAVE__EINVAL;
+	}
+
+	if (key->build_id_len > CACHE_MAX_BUILD_ID) {
+		return RAVE__EINVAL;
+	}
+
+	memset(&w, 0, sizeof(w));
+	memcpy(w.header.magic, CACHE_MAGIC, sizeof(w.header.magic));
+	w.header.version = CACHE_VERSION;
+	w.header.build_id_len = key->build_id_len;
+	memcpy(w.header.build_id, key->build_id, key->build_id_len);
+	w.header.text_addr = key->text_addr;
+	w.header.text_size = key->text_size;
+	w.header.metadata = key->metadata;
+
+	rc = transform_foreach(transform, count_cb, &w);
+	if (rc != RAVE__SUCCESS) {
+		return rc;
+	}
+
+	if (w.header.nr_epilogues > UINT32_MAX) {
+		return RAVE__ECACHE;
+	}
+
+	/* Write to a temporary file first, then swap it in */
+	tmp = rave_malloc(strlen(path) + sizeof(".XXXXXX"));
+	if (NULL == tmp) {
+		return RAVE__ENOMEM;
+	}
+	sprintf(tmp, "%s.XXXXXX", path);
+
+	fd = mkstemp(tmp);
+	if (fd == -1) {
+		WARN("Could not create analysis cache %s", tmp);
+		rave_free(tmp);
+		return RAVE__ECACHE;
+	}
+
+	w.file = fdopen(fd, "wb");
+	if (NULL == w.file) {
+		close(fd);
+		rc = RAVE__ECACHE;
+		goto err;
+	}
+
+	/* Placeholder header, the checksum is filled in once we have it */
+	w.header.checksum = FNV_OFFSET;
+	if (fwrite(&w.header, sizeof(w.header), 1, w.file) != 1) {
+		rc = RAVE__ECACHE;
+		goto err;
+	}
+
+	rc = transform_foreach(transform, function_cb, &w);
+	rc = rc ? rc : transform_foreach(transform, epilogue_cb, &w);
+	if (rc != RAVE__SUCCESS) {
+		goto err;
+	}
+
+	if (fseek(w.file, 0, SEEK_SET) != 0 ||
+		fwrite(&w.header, sizeof(w.header), 1, w.file) != 1)
+	{
+		rc = RAVE__ECACHE;
+		goto err;
+	}
+
+	rc = fclose(w.file);
+	w.file = NULL;
+	if (rc != 0 || rename(tmp, path) != 0) {
+		rc = RAVE__ECACHE;
+		goto err;
+	}
+
+	DEBUG("Wrote %"PRIu64" functions to analysis cache %s",
+		w.header.nr_functions, path);
+	rave_free(tmp);
+	return RAVE__SUCCESS;
+err:
+	WARN("Could not write analysis cache %s", path);
+	if (w.file) {
+		fclose(w.file);
+	}
+	unlink(tmp);
+	rave_free(tmp);
+	return rc;
+}
@@ -0,0 +1,52 @@
+/**
+ * Cache
+ *
+ * Persistent analysis cache. Walking the metadata and decoding every function
+ * is by far the most expensive part of initialization, and the result only
+ * depends on the binary. So, the analysis is flattened into a pointer-free
+ * file keyed by the binary's build-id which later runs can just mmap.
+ *
+ * Author: Christopher Blackburn <krizboy@vt.edu>
+ * Date: 1/1/1977
+ */
+
+#ifndef __CACHE_H_
+#define __CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "transform.h"
+
+/* What a cache file has to match to be usable */
+struct cache_key {
+	const void *build_id;
+	size_t build_id_len;
+
+	/* Where the text section was when the cache was built */
+	uintptr_t text_addr;
+	size_t text_size;
+
+	/* Which backend found the functions (enum rave_metadata), they don't
+	 * all find the same ones */
+	int metadata;
+};
+
+/* Build the cache file path for a key inside of the given directory. The
+ * returned string must be freed. */
+char *cache_path(const char *dir, const struct cache_key *key);
+
+/* Load a cache file into the (empty) transform. Every cached function is
+ * checked against the code in the (unmodified) text window. Any stale or
+ * corrupt cache, or one that doesn't match the code, is reported with
+ * RAVE__ECACHE, in which case the transform may have been partially filled and
+ * needs to be reset. */
+int cache_load(transform_t transform, struct window *text, const char *path,
+	const struct cache_key *key);
+
+/* Write the analysis out. The file is replaced atomically, so concurrent
+ * loaders only ever see a complete cache. */
+int cache_store(transform_t transform, const char *path,
+	const struct cache_key *key);
+
+#endif /* __CACHE_H_ */
@@ -0,0 +1,41 @@
+/**
+ * Config
+ *
+ * Options for a rave handle. These are set by the user before init and handed
+ * down to whichever parts of rave care about them.
+ *
+ * Author: Christopher Blackburn <krizboy@vt.edu>
+ * Date: 1/1/1977
+ */
+
+#ifndef __CONFIG_H_
+#define __CONFIG_H_
+
+#include <stddef.h>
+
+struct config {
+	/* Map the code segment copy-on-write */
+	int cow;
+	int lazy;
+
+	/* Back the code with transparent huge pages where the segment allows */
+	int hugepages;
+
+	/* Which metadata backend finds functions (enum rave_metadata) */
+	int metadata;
+
+	/* Where analysis caches are kept (NULL to not cache) */
+	char *cache_dir;
+
+	/* Number of threads to spread initialization work across (1 means do
+	 * everything on the calling thread) */
+	size_t nr_workers;
+
+	/* Number of threads rave_randomize spreads functions across */
+	size_t nr_randomize_workers;
+
+	/* Most pages handed out per fault */
+	size_t fault_around;
+};
+
+#endif /* __CONFIG_H_ */
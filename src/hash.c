@@ -0,0 +1,217 @@
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "hash.h"
+#include "util.h"
+
+#define PRIME32_1 0x9E3779B1U
+#define PRIME32_2 0x85EBCA77U
+#define PRIME32_3 0xC2B2AE3DU
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define STRIPE 64
+#define LANES (STRIPE / sizeof(uint64_t))
+#define SECRET_SIZE 192
+#define STRIPES_PER_BLOCK ((SECRET_SIZE - STRIPE) / 8)
+#define BLOCK (STRIPE * STRIPES_PER_BLOCK)
+
+/* Where the secret is read from for the last stripe and for merging */
+#define SECRET_LASTACC_START 7
+#define SECRET_MERGEACCS_START 11
+
+/* XXH3's default secret */
+static const uint8_t secret[SECRET_SIZE] __attribute__((aligned(64))) = {
+	0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe,
+	0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+	0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb,
+	0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+	0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78,
+	0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+	0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e,
+	0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+	0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb,
+	0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+	0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e,
+	0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+	0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f,
+	0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+	0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31,
+	0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+	0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3,
+	0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+	0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49,
+	0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+	0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc,
+	0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+	0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28,
+	0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+static inline uint64_t read64(const void *ptr)
+{
+	uint64_t val;
+
+	memcpy(&val, ptr, sizeof(val));
+	return val;
+}
+
+#ifdef __SSE2__
+/* Two lanes per register */
+typedef __m128i acc_t;
+#define ACC_REGS (LANES / 2)
+
+static inline void acc_init(acc_t acc[ACC_REGS])
+{
+	acc[0] = _mm_set_epi64x(PRIME64_1, PRIME32_3);
+	acc[1] = _mm_set_epi64x(PRIME64_3, PRIME64_2);
+	acc[2] = _mm_set_epi64x(PRIME32_2, PRIME64_4);
+	acc[3] = _mm_set_epi64x(PRIME32_1, PRIME64_5);
+}
+
+static inline void accumulate(acc_t acc[ACC_REGS], const uint8_t *input,
+	const uint8_t *key)
+{
+	__m128i data, data_key, product, swapped;
+
+	for (size_t i = 0; i < ACC_REGS; i++) {
+		data = _mm_loadu_si128((const __m128i *)input + i);
+		data_key = _mm_xor_si128(data,
+			_mm_loadu_si128((const __m128i *)key + i));
+
+		/* Low 32 bits of each lane times its high 32 bits */
+		product = _mm_mul_epu32(data_key,
+			_mm_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1)));
+
+		/* Each lane also gets the input of its neighbour */
+		swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+		acc[i] = _mm_add_epi64(product, _mm_add_epi64(acc[i], swapped));
+	}
+}
+
+static inline void scramble(acc_t acc[ACC_REGS], const uint8_t *key)
+{
+	const __m128i prime = _mm_set1_epi32(PRIME32_1);
+	__m128i data, lo, hi;
+
+	for (size_t i = 0; i < ACC_REGS; i++) {
+		data = _mm_xor_si128(acc[i], _mm_srli_epi64(acc[i], 47));
+		data = _mm_xor_si128(data, _mm_loadu_si128((const __m128i *)key + i));
+
+		/* 64 bit multiply by a 32 bit prime, out of two 32x32 ones */
+		lo = _mm_mul_epu32(data, prime);
+		hi = _mm_mul_epu32(_mm_shuffle_epi32(data, _MM_SHUFFLE(0, 3, 0, 1)),
+			prime);
+		acc[i] = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+	}
+}
+
+static inline void acc_store(uint64_t out[LANES], const acc_t acc[ACC_REGS])
+{
+	for (size_t i = 0; i < ACC_REGS; i++) {
+		_mm_storeu_si128((__m128i *)out + i, acc[i]);
+	}
+}
+#else
+typedef uint64_t acc_t;
+#define ACC_REGS LANES
+
+static inline void acc_init(acc_t acc[ACC_REGS])
+{
+	acc[0] = PRIME32_3;
+	acc[1] = PRIME64_1;
+	acc[2] = PRIME64_2;
+	acc[3] = PRIME64_3;
+	acc[4] = PRIME64_4;
+	acc[5] = PRIME32_2;
+	acc[6] = PRIME64_5;
+	acc[7] = PRIME32_1;
+}
+
+static inline void accumulate(acc_t acc[ACC_REGS], const uint8_t *input,
+	const uint8_t *key)
+{
+	uint64_t data, data_key;
+
+	for (size_t i = 0; i < LANES; i++) {
+		data = read64(input + 8 * i);
+		data_key = data ^ read64(key + 8 * i);
+		acc[i ^ 1] += data;
+		acc[i] += (uint32_t)data_key * (data_key >> 32);
+	}
+}
+
+static inline void scramble(acc_t acc[ACC_REGS], const uint8_t *key)
+{
+	for (size_t i = 0; i < LANES; i++) {
+		acc[i] ^= acc[i] >> 47;
+		acc[i] ^= read64(key + 8 * i);
+		acc[i] *= PRIME32_1;
+	}
+}
+
+static inline void acc_store(uint64_t out[LANES], const acc_t acc[ACC_REGS])
+{
+	memcpy(out, acc, STRIPE);
+}
+#endif /* __SSE2__ */
+
+static inline uint64_t mul128_fold64(uint64_t lhs, uint64_t rhs)
+{
+	__uint128_t product = (__uint128_t)lhs * rhs;
+
+	return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static inline uint64_t avalanche(uint64_t h)
+{
+	h ^= h >> 37;
+	h *= 0x165667919E3779F9ULL;
+	return h ^ (h >> 32);
+}
+
+/* XXH3's long input path, with the length fixed to a page so the loops
+ * unroll */
+uint64_t hash_page(const void *page)
+{
+	const uint8_t *input = page;
+	const size_t nr_blocks = (PAGESZ - 1) / BLOCK,
+		nr_stripes = ((PAGESZ - 1) - BLOCK * nr_blocks) / STRIPE;
+	acc_t acc[ACC_REGS];
+	uint64_t lanes[LANES], result;
+
+	acc_init(acc);
+
+	for (size_t n = 0; n < nr_blocks; n++) {
+		for (size_t s = 0; s < STRIPES_PER_BLOCK; s++) {
+			accumulate(acc, input + n * BLOCK + s * STRIPE, secret + s * 8);
+		}
+		scramble(acc, secret + SECRET_SIZE - STRIPE);
+	}
+
+	/* The last (partial) block, and then the last stripe, which overlaps
+	 * with whatever came before it */
+	for (size_t s = 0; s < nr_stripes; s++) {
+		accumulate(acc, input + nr_blocks * BLOCK + s * STRIPE,
+			secret + s * 8);
+	}
+	accumulate(acc, input + PAGESZ - STRIPE,
+		secret + SECRET_SIZE - STRIPE - SECRET_LASTACC_START);
+
+	acc_store(lanes, acc);
+	result = PAGESZ * PRIME64_1;
+	for (size_t i = 0; i < LANES / 2; i++) {
+		result += mul128_fold64(
+			lanes[2 * i] ^ read64(secret + SECRET_MERGEACCS_START + 16 * i),
+			lanes[2 * i + 1] ^
+				read64(secret + SECRET_MERGEACCS_START + 16 * i + 8));
+	}
+
+	return avalanche(result);
+}
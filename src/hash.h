@@ -0,0 +1,20 @@
+/**
+ * Hash
+ *
+ * Content hashes of code pages
+ *
+ * Author: Christopher Blackburn <krizboy@vt.edu>
+ * Date: 1/1/1977
+ */
+
+#ifndef __HASH_H_
+#define __HASH_H_
+
+#include <stdint.h>
+
+/* 64 bit hash of a PAGESZ page. This is XXH3 (64 bit, no seed), so the same
+ * page hashes the same in every process, and tools outside of rave can compute
+ * it with any xxHash library. */
+uint64_t hash_page(const void *page);
+
+#endif /* __HASH_H_ */
@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "log.h"
+#include "rave/errno.h"
+#include "compiler.h"
+#include "util.h"
+
+/* Slots per thread, and the longest message (anything longer is cut) */
+#define LOG_RING_SLOTS 128
+#define LOG_MSG_SIZE 254
+
+/* How long the drain thread sleeps once it runs out of messages */
+#define LOG_DRAIN_INTERVAL_NS 10000000L
+
+static const char *level_names[] = {
+	[RAVE_LOG_DEBUG] = "DEBUG",
+	[RAVE_LOG_INFO] = "INFO ",
+	[RAVE_LOG_WARN] = "WARN ",
+	[RAVE_LOG_ERROR] = "ERROR",
+	[RAVE_LOG_FATAL] = "FATAL",
+};
+
+struct log_entry {
+	uint16_t length;
+	char msg[LOG_MSG_SIZE];
+};
+
+/* Single producer (the thread owning it), single consumer (whoever holds the
+ * drain lock). Positions only ever go up, and wrap onto the slots. */
+struct log_ring {
+	struct log_ring *next;
+
+	/* Whether a live thread is writing to it. Rings are never freed, a
+	 * thread exiting just hands its ring over to the next new thread. */
+	int owned;
+
+	uint64_t head, tail;
+
+	struct log_entry entries[LOG_RING_SLOTS];
+};
+
+int __log_level = RAVE_LOG_DEBUG;
+
+/* Every ring there is */
+static struct log_ring *rings;
+
+/* This thread's ring */
+static __thread struct log_ring *ring;
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+
+/* Held while writing rings out. The drain thread sleeps on drain_cond, so
+ * stopping it doesn't have to wait out the interval. */
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drain_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t drain_thread;
+static int drain_running, drain_stop;
+
+static void drain_ring(struct log_ring *self)
+{
+	uint64_t tail = self->tail,
+		head = __atomic_load_n(&self->head, __ATOMIC_ACQUIRE);
+	struct log_entry *entry;
+
+	for (; tail != head; tail++) {
+		entry = &self->entries[tail % LOG_RING_SLOTS];
+		fwrite(entry->msg, 1, entry->length, stderr);
+	}
+	__atomic_store_n(&self->tail, tail, __ATOMIC_RELEASE);
+}
+
+static void drain_all_locked(void)
+{
+	struct log_ring *self;
+
+	for (self = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); NULL != self;
+		self = self->next)
+	{
+		drain_ring(self);
+	}
+	fflush(stderr);
+}
+
+void log_flush(void)
+{
+	pthread_mutex_lock(&drain_lock);
+	drain_all_locked();
+	pthread_mutex_unlock(&drain_lock);
+}
+
+static void *drain(UNUSED void *arg)
+{
+	struct timespec until;
+
+	pthread_mutex_lock(&drain_lock);
+
+	while (!drain_stop) {
+		drain_all_locked();
+
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += LOG_DRAIN_INTERVAL_NS;
+		if (until.tv_nsec >= 1000000000L) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&drain_cond, &drain_lock, &until);
+	}
+
+	pthread_mutex_unlock(&drain_lock);
+	return NULL;
+}
+
+/* A fork can't be let through while the lock is held, the child would never
+ * get it back. The drain thread doesn't make it into the child, so the child
+ * writes its messages out right away instead. */
+static void fork_prepare(void)
+{
+	pthread_mutex_lock(&drain_lock);
+}
+
+static void fork_parent(void)
+{
+	pthread_mutex_unlock(&drain_lock);
+}
+
+static void fork_child(void)
+{
+	struct log_ring *self;
+
+	/* Whatever is buffered is the parent's to write out, and the rings of
+	 * threads which didn't make it across are free to be adopted */
+	for (self = rings; NULL != self; self = self->next) {
+		self->tail = self->head;
+		if (self != ring) {
+			self->owned = 0;
+		}
+	}
+
+	__atomic_store_n(&drain_running, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&drain_lock);
+}
+
+/* Runs at exit, and when the library is unloaded, neither of which the drain
+ * thread can outlive */
+__attribute__((destructor)) static void teardown(void)
+{
+	int running;
+
+	pthread_mutex_lock(&drain_lock);
+	running = drain_running;
+	__atomic_store_n(&drain_running, 0, __ATOMIC_RELAXED);
+	drain_stop = 1;
+	pthread_cond_signal(&drain_cond);
+	pthread_mutex_unlock(&drain_lock);
+
+	if (running) {
+		pthread_join(drain_thread, NULL);
+	}
+
+	/* Anything logged from here on goes straight out */
+	log_flush();
+}
+
+/* The thread is going away, let someone else have its ring */
+static void release_ring(void *arg)
+{
+	struct log_ring *self = arg;
+
+	__atomic_store_n(&self->owned, 0, __ATOMIC_RELEASE);
+}
+
+/* Done on the first message, so nothing runs until something is logged */
+static void setup(void)
+{
+	pthread_key_create(&ring_key, release_ring);
+	pthread_atfork(fork_prepare, fork_parent, fork_child);
+
+	/* Without a drain thread, every message is written out right away */
+	pthread_mutex_lock(&drain_lock);
+	if (!drain_stop && 0 == pthread_create(&drain_thread, NULL, drain, NULL)) {
+		__atomic_store_n(&drain_running, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&drain_lock);
+}
+
+/* Logging is process wide infrastructure, so rings come straight from libc
+ * rather than the user's allocator, and are never given back */
+static struct log_ring *get_ring(void)
+{
+	struct log_ring *self;
+	int expected;
+
+	if (NULL != ring) {
+		return ring;
+	}
+
+	pthread_once(&once, setup);
+
+	/* Adopt the ring of a thread which is gone */
+	for (self = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); NULL != self;
+		self = self->next)
+	{
+		expected = 0;
+		if (__atomic_compare_exchange_n(&self->owned, &expected, 1, 0,
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		{
+			goto out;
+		}
+	}
+
+	self = calloc(1, sizeof(*self));
+	if (NULL == self) {
+		return NULL;
+	}
+	self->owned = 1;
+
+	self->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&rings, &self->next, self, 0,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	{
+	}
+
+out:
+	pthread_setspecific(ring_key, self);
+	ring = self;
+	return self;
+}
+
+/* Whether a rate limited message can go out. The first message of a new
+ * interval picks up how many were suppressed in the last one. */
+static int ratelimit(struct log_ratelimit *rl, uint64_t *suppressed)
+{
+	uint64_t now = now_ns() / LOG_RATELIMIT_INTERVAL_NS,
+		window = __atomic_load_n(&rl->window, __ATOMIC_RELAXED);
+
+	*suppressed = 0;
+	if (window != now &&
+		__atomic_compare_exchange_n(&rl->window, &window, now, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	{
+		__atomic_store_n(&rl->count, 0, __ATOMIC_RELAXED);
+		*suppressed = __atomic_exchange_n(&rl->suppressed, 0,
+			__ATOMIC_RELAXED);
+	}
+
+	if (__atomic_fetch_add(&rl->count, 1, __ATOMIC_RELAXED) <
+		LOG_RATELIMIT_BURST)
+	{
+		return 1;
+	}
+
+	__atomic_fetch_add(&rl->suppressed, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+void __log(int level, struct log_ratelimit *rl, const char *func, int line,
+	const char *fmt, ...)
+{
+	struct log_ring *self;
+	struct log_entry *entry;
+	uint64_t head, suppressed = 0;
+	va_list ap;
+	int length, n;
+
+	if (NULL != rl && !ratelimit(rl, &suppressed)) {
+		return;
+	}
+
+	self = get_ring();
+	if (NULL == self) {
+		return;
+	}
+
+	/* Only when messages come in faster than they are drained does the
+	 * thread have to wait, on the drain lock and then on stderr. Messages
+	 * are never dropped. */
+	head = self->head;
+	if (head - __atomic_load_n(&self->tail, __ATOMIC_ACQUIRE) ==
+		LOG_RING_SLOTS)
+	{
+		log_flush();
+	}
+
+	entry = &self->entries[head % LOG_RING_SLOTS];
+	length = snprintf(entry->msg, sizeof(entry->msg), "[rave] %s (%s:%d) ",
+		level_names[level], func, line);
+
+	if (length < (int)sizeof(entry->msg)) {
+		va_start(ap, fmt);
+		n = vsnprintf(entry->msg + length, sizeof(entry->msg) - length, fmt,
+			ap);
+		va_end(ap);
+		length += n > 0 ? n : 0;
+	}
+
+	if (suppressed && length < (int)sizeof(entry->msg)) {
+		n = snprintf(entry->msg + length, sizeof(entry->msg) - length,
+			" (%"PRIu64" similar messages suppressed)", suppressed);
+		length += n > 0 ? n : 0;
+	}
+
+	/* Cut off, but always end the line */
+	length = min(length, (int)sizeof(entry->msg) - 1);
+	entry->msg[length++] = '\n';
+	entry->length = length;
+
+	__atomic_store_n(&self->head, head + 1, __ATOMIC_RELEASE);
+
+	if (!__atomic_load_n(&drain_running, __ATOMIC_RELAXED) ||
+		level >= RAVE_LOG_FATAL)
+	{
+		log_flush();
+	}
+}
+
+int rave_set_log_level(enum rave_log_level level)
+{
+	if (level < RAVE_LOG_DEBUG || level > RAVE_LOG_NONE) {
+		return RAVE__EINVAL;
+	}
+
+	__atomic_store_n(&__log_level, level, __ATOMIC_RELAXED);
+	return RAVE__SUCCESS;
+}
@@ -1,7 +1,14 @@
 /**
  * Logging
  *
- * Basic logging
+ * Messages are formatted into a per-thread ring buffer and written out to
+ * stderr by a background thread, so logging from hot paths takes no locks and
+ * doesn't wait on stderr. That only holds while the drain keeps up: a thread
+ * whose ring is full writes every ring out itself, under the drain lock,
+ * rather than drop messages. FATAL messages are also written out right away.
+ * Levels below RAVE_LOG_MIN_LEVEL are compiled out, and the rest can be
+ * filtered at runtime with rave_set_log_level. Warnings are rate limited per
+ * call site.
  *
  * Author: Christopher Blackburn <krizboy@vt.edu>
  * Date: 1/7/2021
@@ -15,20 +22,65 @@ extern "C" {
 #endif
 
 #include <stdio.h>
+#include <stdint.h>
 
-#define LOG(lvl, fmt, ...) \
-    fprintf(stderr, "[rave] %s (%s:%d) " fmt "\n", lvl, __func__, __LINE__, ##__VA_ARGS__);
+#include "rave.h"
 
+/* Anything below this level is compiled out */
+#ifndef RAVE_LOG_MIN_LEVEL
 #ifndef NDEBUG
-#define DEBUG(msg, ...) LOG("DEBUG", msg, ##__VA_ARGS__);
-#define DEBUG_BLOCK(...) do { __VA_ARGS__; } while (0);
+#define RAVE_LOG_MIN_LEVEL RAVE_LOG_DEBUG
 #else
-#define DEBUG(msg, ...)
+#define RAVE_LOG_MIN_LEVEL RAVE_LOG_INFO
 #endif /* NDEBUG */
-#define INFO(msg, ...)  LOG("INFO ", msg, ##__VA_ARGS__);
-#define WARN(msg, ...)  LOG("WARN ", msg, ##__VA_ARGS__);
-#define ERROR(msg, ...) LOG("ERROR", msg, ##__VA_ARGS__);
-#define FATAL(msg, ...) LOG("FATAL", msg, ##__VA_ARGS__);
+#endif /* RAVE_LOG_MIN_LEVEL */
+
+/* Messages per call site per interval before the rest get dropped */
+#define LOG_RATELIMIT_BURST 10
+#define LOG_RATELIMIT_INTERVAL_NS 1000000000ULL
+
+struct log_ratelimit {
+	uint64_t window;
+	uint32_t count;
+	uint64_t suppressed;
+};
+
+/* Runtime level, see rave_set_log_level */
+extern int __log_level;
+
+void __log(int level, struct log_ratelimit *rl, const char *func, int line,
+	const char *fmt, ...) __attribute__((format(printf, 5, 6)));
+
+/* Write out everything logged so far */
+void log_flush(void);
+
+#define log_enabled(lvl) \
+	((lvl) >= RAVE_LOG_MIN_LEVEL && \
+	 (lvl) >= __atomic_load_n(&__log_level, __ATOMIC_RELAXED))
+
+#define __LOG(lvl, rl, fmt, ...) do { \
+	if (log_enabled(lvl)) { \
+		__log(lvl, rl, __func__, __LINE__, fmt, ##__VA_ARGS__); \
+	} \
+} while (0)
+
+#define LOG(lvl, fmt, ...) __LOG(lvl, NULL, fmt, ##__VA_ARGS__)
+
+#define LOG_RATELIMITED(lvl, fmt, ...) do { \
+	static struct log_ratelimit __rl; \
+	__LOG(lvl, &__rl, fmt, ##__VA_ARGS__); \
+} while (0)
+
+#define DEBUG(msg, ...) LOG(RAVE_LOG_DEBUG, msg, ##__VA_ARGS__)
+#define DEBUG_BLOCK(...) do { \
+	if (log_enabled(RAVE_LOG_DEBUG)) { \
+		__VA_ARGS__; \
+	} \
+} while (0)
+#define INFO(msg, ...)  LOG(RAVE_LOG_INFO, msg, ##__VA_ARGS__)
+#define WARN(msg, ...)  LOG_RATELIMITED(RAVE_LOG_WARN, msg, ##__VA_ARGS__)
+#define ERROR(msg, ...) LOG(RAVE_LOG_ERROR, msg, ##__VA_ARGS__)
+#define FATAL(msg, ...) LOG(RAVE_LOG_FATAL, msg, ##__VA_ARGS__)
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,94 @@
+#include <string.h>
+
+#include "rave.h"
+#include "rave/errno.h"
+#include "memory.h"
+#include "compiler.h"
+
+static void *std_malloc(size_t size, UNUSED void *ctx)
+{
+	return malloc(size);
+}
+
+static void *std_realloc(void *ptr, size_t size, UNUSED void *ctx)
+{
+	return realloc(ptr, size);
+}
+
+static void std_free(void *ptr, UNUSED void *ctx)
+{
+	free(ptr);
+}
+
+static const struct rave_allocator std_allocator = {
+	.malloc = std_malloc,
+	.realloc = std_realloc,
+	.free = std_free,
+	.ctx = NULL,
+};
+
+static struct rave_allocator allocator = std_allocator;
+
+/* Only ever goes up, it's for statistics and not for tracking what is live */
+static uint64_t allocated;
+
+static inline void count(size_t size)
+{
+	__atomic_fetch_add(&allocated, size, __ATOMIC_RELAXED);
+}
+
+uint64_t rave_bytes_allocated(void)
+{
+	return __atomic_load_n(&allocated, __ATOMIC_RELAXED);
+}
+
+int rave_set_allocator(const struct rave_allocator *hooks)
+{
+	if (NULL == hooks) {
+		allocator = std_allocator;
+		return RAVE__SUCCESS;
+	}
+
+	if (NULL == hooks->malloc || NULL == hooks->realloc ||
+		NULL == hooks->free)
+	{
+		return RAVE__EINVAL;
+	}
+
+	allocator = *hooks;
+	return RAVE__SUCCESS;
+}
+
+void *__rave_malloc(size_t size)
+{
+	count(size);
+	return allocator.malloc(size, allocator.ctx);
+}
+
+void *__rave_calloc(size_t nmemb, size_t size)
+{
+	void *ptr;
+
+	if (size && nmemb > (size_t)-1 / size) {
+		return NULL;
+	}
+
+	count(nmemb * size);
+	ptr = allocator.malloc(nmemb * size, allocator.ctx);
+	if (NULL != ptr) {
+		memset(ptr, 0, nmemb * size);
+	}
+
+	return ptr;
+}
+
+void *__rave_realloc(void *ptr, size_t size)
+{
+	count(size);
+	return allocator.realloc(ptr, size, allocator.ctx);
+}
+
+void __rave_free(void *ptr)
+{
+	allocator.free(ptr, allocator.ctx);
+}
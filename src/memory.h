@@ -1,8 +1,9 @@
 /**
  * Memory
  *
- * Memory management. The intent is to allow the user to load in their own
- * memory management instead of using stdlib, so we abstract.
+ * Memory management. Users can load in their own memory management (see
+ * rave_set_allocator) instead of using stdlib, so everything in rave goes
+ * through these.
  *
  * Author: Christopher Blackburn <krizboy@vt.edu>
  * Date: 1/1/1977
@@ -12,11 +13,19 @@
 #define __MEMORY_H_
 
 #include <stdlib.h>
+#include <stdint.h>
 
-// TODO: don't just use macros - allow user to swap in their own mm functions
-#define rave_malloc(x) malloc(x)
-#define rave_calloc(...) calloc(__VA_ARGS__)
-#define rave_free(x) ({if (x) free(x);})
+void *__rave_malloc(size_t size);
+void *__rave_calloc(size_t nmemb, size_t size);
+void *__rave_realloc(void *ptr, size_t size);
+void __rave_free(void *ptr);
 
-#endif /* __MEMORY_H_ */
+/* Bytes requested through the allocator so far (process wide) */
+uint64_t rave_bytes_allocated(void);
+
+#define rave_malloc(x) __rave_malloc(x)
+#define rave_calloc(...) __rave_calloc(__VA_ARGS__)
+#define rave_realloc(...) __rave_realloc(__VA_ARGS__)
+#define rave_free(x) ({if (x) __rave_free(x);})
 
+#endif /* __MEMORY_H_ */
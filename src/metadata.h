@@ -3,9 +3,10 @@
  *
  * Metadata can give us a head start in binary analysis/transformation. In order
  * to be more flexible in future design, I created a class which abstracts the
- * source of the metadata. Currently, I'm using dwarf, but in we ever wanted to
- * use a different source, I didn't want rave to be too tightly coupled to dwarf
- * debug info.
+ * source of the metadata. Dwarf debug info gives us the most, but production
+ * binaries are usually stripped of it, so functions can also be found through
+ * the unwind tables (.eh_frame), which every x86-64 binary has, or the symbol
+ * tables.
  *
  * Author: Christopher Blackburn <krizboy@vt.edu>
  * Date: 1/1/1977
@@ -15,6 +16,7 @@
 #define __METADATA_H_
 
 #include "binary.h"
+#include "config.h"
 #include "function.h"
 
 typedef int (*foreach_function_cb)(const struct function *, void *);
@@ -24,15 +26,20 @@ struct metadata_op {
 	metadata_t (*create)(void);
 	void (*destroy)(metadata_t self);
 
-	int (*init)(metadata_t self, struct binary *binary);
+	int (*init)(metadata_t self, struct binary *binary,
+		const struct config *config);
 	int (*close)(metadata_t self);
 
 	/* Loop through all functions, once metadata is retrieved, the callback is
-	 * called. */
+	 * called. The callback is always called from the calling thread, and the
+	 * order functions are reported in doesn't depend on the number of
+	 * workers. */
 	int (*foreach_function)(metadata_t self, foreach_function_cb cb, void *arg);
 };
 
 extern struct metadata_op metadata_dwarf;
+extern struct metadata_op metadata_ehframe;
+extern struct metadata_op metadata_symtab;
 
 #endif /* __METADATA_H_ */
 
@@ -1,22 +1,27 @@
+#include <string.h>
+
 #include <libdwarf/dwarf.h>
 #include <libdwarf/libdwarf.h>
 
 #include "metadata.h"
+#include "workers.h"
+#include "compiler.h"
 #include "memory.h"
+#include "util.h"
 #include "rave/errno.h"
 #include "log.h"
 
 
 struct metadata {
 	struct binary *binary;
+	size_t nr_workers;
 
 	Dwarf_Debug dbg;
 };
 
-static int get_function_hilo(struct metadata *self, Dwarf_Die die,
+static int get_function_hilo(Dwarf_Debug dbg, Dwarf_Die die,
 	foreach_function_cb cb, void *arg)
 {
-	Dwarf_Debug dbg = self->dbg;
 	Dwarf_Addr lo, hi;
 	Dwarf_Half form = 0;
 	enum Dwarf_Form_Class formclass = 0;
@@ -107,10 +112,9 @@ dwarf_err:
 }
 #endif
 
-static int process_die_and_siblings(struct metadata *self, Dwarf_Die cu_die,
+static int process_die_and_siblings(Dwarf_Debug dbg, Dwarf_Die cu_die,
 	Dwarf_Bool is_info, foreach_function_cb cb, void *arg)
 {
-	Dwarf_Debug dbg = self->dbg;
 	Dwarf_Die next_die = 0;
 	Dwarf_Die cur_die = 0;
 	Dwarf_Half tag;
@@ -134,7 +138,7 @@ static int process_die_and_siblings(struct metadata *self, Dwarf_Die cu_die,
 
 		/* Get relevant info */
 		if (tag == DW_TAG_subprogram) {
-			rc = get_function_hilo(self, cur_die, cb, arg);
+			rc = get_function_hilo(dbg, cur_die, cb, arg);
 			if (rc != RAVE__SUCCESS) {
 				dwarf_dealloc(dbg, cur_die, DW_DLA_DIE);
 				return rc;
@@ -153,10 +157,13 @@ dwarf_err:
 	return RAVE__EDWARF;
 }
 
-static int foreach_function(struct metadata *self, foreach_function_cb cb,
-	void *arg)
+/* Walk the CU headers, either handing each CU die to the callback or just
+ * recording the CU header offsets (when cu_cb is NULL) */
+static int foreach_cu(struct metadata *self, foreach_function_cb cb, void *arg,
+	int (*cu_cb)(Dwarf_Unsigned offset, void *arg))
 {
 	Dwarf_Debug dbg = self->dbg;
+	Dwarf_Unsigned cu_offset = 0;
 	Dwarf_Unsigned cu_header_length = 0;
 	Dwarf_Unsigned abbrev_offset = 0;
 	Dwarf_Half address_size = 0;
@@ -196,6 +203,17 @@ static int foreach_function(struct metadata *self, foreach_function_cb cb,
 			break;
 		}
 
+		/* Only collecting the CUs to process them elsewhere */
+		if (NULL != cu_cb) {
+			rc = cu_cb(cu_offset, arg);
+			cu_offset = next_cu_header_offset;
+			if (rc != RAVE__SUCCESS) {
+				return rc;
+			}
+
+			continue;
+		}
+
 		/* The header cu will have one sibling which is the cu die */
 		rc = dwarf_siblingof_b(dbg, 0, is_info, &cu_die, &err);
 		if (rc == DW_DLV_ERROR) {
@@ -206,7 +224,7 @@ static int foreach_function(struct metadata *self, foreach_function_cb cb,
 		}
 
 		/* Process this cu to find any functions and grab relevant metadata */
-		rc = process_die_and_siblings(self, cu_die, is_info, cb, arg);
+		rc = process_die_and_siblings(dbg, cu_die, is_info, cb, arg);
 		dwarf_dealloc(dbg, cu_die, DW_DLA_DIE);
 		if (rc != RAVE__SUCCESS) {
 			return rc;
@@ -220,7 +238,199 @@ dwarf_err:
 	return RAVE__EDWARF;
 }
 
-static int init(struct metadata *self, struct binary *binary)
+/* In parallel mode, every CU gets its own list of functions, filled in by
+ * whichever worker picks it up. The lists are reported in CU order afterwards
+ * so the result is the same as the serial walk. */
+struct cu_functions {
+	Dwarf_Unsigned offset;
+	struct function *functions;
+	size_t nr, cap;
+};
+
+struct parallel_walk {
+	struct metadata *self;
+
+	struct cu_functions *cus;
+	size_t nr_cus, cap;
+
+	/* Next CU to hand out, and the first error any worker hit */
+	size_t next;
+	int rc;
+};
+
+static int add_cu(Dwarf_Unsigned offset, void *arg)
+{
+	struct parallel_walk *walk = arg;
+	struct cu_functions *cus;
+	size_t cap;
+
+	if (walk->nr_cus == walk->cap) {
+		cap = walk->cap ? walk->cap * 2 : 64;
+		cus = rave_realloc(walk->cus, cap * sizeof(*cus));
+		if (NULL == cus) {
+			return RAVE__ENOMEM;
+		}
+
+		walk->cus = cus;
+		walk->cap = cap;
+	}
+
+	memset(&walk->cus[walk->nr_cus], 0, sizeof(*walk->cus));
+	walk->cus[walk->nr_cus++].offset = offset;
+	return RAVE__SUCCESS;
+}
+
+static int collect_function(const struct function *function, void *arg)
+{
+	struct cu_functions *cu = arg;
+	struct function *functions;
+	size_t cap;
+
+	if (cu->nr == cu->cap) {
+		cap = cu->cap ? cu->cap * 2 : 16;
+		functions = rave_realloc(cu->functions, cap * sizeof(*functions));
+		if (NULL == functions) {
+			return RAVE__ENOMEM;
+		}
+
+		cu->functions = functions;
+		cu->cap = cap;
+	}
+
+	cu->functions[cu->nr++] = *function;
+	return RAVE__SUCCESS;
+}
+
+static int process_cu_at(Dwarf_Debug dbg, struct cu_functions *cu)
+{
+	Dwarf_Off die_offset = 0;
+	Dwarf_Die cu_die = 0;
+	Dwarf_Bool is_info = 1;
+	Dwarf_Error err = 0;
+	int rc;
+
+	rc = dwarf_get_cu_die_offset_given_cu_header_offset_b(dbg, cu->offset,
+		is_info, &die_offset, &err);
+	if (rc == DW_DLV_OK) {
+		rc = dwarf_offdie_b(dbg, die_offset, is_info, &cu_die, &err);
+	}
+
+	if (rc == DW_DLV_ERROR) {
+		ERROR("dwarf: %s", dwarf_errmsg(err));
+		dwarf_dealloc(dbg, err, DW_DLA_ERROR);
+		return RAVE__EDWARF;
+	} else if (rc == DW_DLV_NO_ENTRY) {
+		WARN("dwarf: missing cu die...");
+		return RAVE__SUCCESS;
+	}
+
+	rc = process_die_and_siblings(dbg, cu_die, is_info, collect_function, cu);
+	dwarf_dealloc(dbg, cu_die, DW_DLA_DIE);
+	return rc;
+}
+
+/* libdwarf handles can't be shared between threads, so each worker opens its
+ * own view of the (already mapped) binary */
+static void cu_worker(void *arg, UNUSED size_t id)
+{
+	struct parallel_walk *walk = arg;
+	struct binary *binary = walk->self->binary;
+	Dwarf_Debug dbg = 0;
+	Dwarf_Error err = 0;
+	Elf *elf;
+	size_t i;
+	int rc = RAVE__SUCCESS;
+
+	elf = elf_memory((char *)binary->mapping, binary->file_size);
+	if (NULL == elf) {
+		rc = RAVE__EELF_MEMORY;
+		goto out;
+	}
+
+	if (dwarf_elf_init(elf, DW_DLC_READ, 0, 0, &dbg, &err) != DW_DLV_OK) {
+		ERROR("Failed to init dwarf");
+		dwarf_dealloc(dbg, err, DW_DLA_ERROR);
+		elf_end(elf);
+		rc = RAVE__EDWARF;
+		goto out;
+	}
+
+	while (RAVE__SUCCESS == __atomic_load_n(&walk->rc, __ATOMIC_RELAXED)) {
+		i = __atomic_fetch_add(&walk->next, 1, __ATOMIC_RELAXED);
+		if (i >= walk->nr_cus) {
+			break;
+		}
+
+		rc = process_cu_at(dbg, &walk->cus[i]);
+		if (rc != RAVE__SUCCESS) {
+			break;
+		}
+	}
+
+	dwarf_finish(dbg, &err);
+	elf_end(elf);
+out:
+	if (rc != RAVE__SUCCESS) {
+		int expected = RAVE__SUCCESS;
+		__atomic_compare_exchange_n(&walk->rc, &expected, rc, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+}
+
+static int foreach_function_parallel(struct metadata *self,
+	foreach_function_cb cb, void *arg)
+{
+	struct parallel_walk walk;
+	int rc;
+
+	memset(&walk, 0, sizeof(walk));
+	walk.self = self;
+
+	/* Reading the CU headers is cheap, it's the DIE trees that cost us */
+	rc = foreach_cu(self, NULL, &walk, add_cu);
+	if (rc != RAVE__SUCCESS) {
+		goto out;
+	}
+
+	DEBUG("dwarf searching %zu CUs with %zu workers", walk.nr_cus,
+		self->nr_workers);
+
+	rc = workers_run(min(self->nr_workers, walk.nr_cus), cu_worker, &walk);
+	if (rc == RAVE__SUCCESS) {
+		rc = walk.rc;
+	}
+
+	/* Report everything in CU order */
+	for (size_t i = 0; rc == RAVE__SUCCESS && i < walk.nr_cus; i++) {
+		for (size_t j = 0; rc == RAVE__SUCCESS && j < walk.cus[i].nr; j++) {
+			rc = cb(&walk.cus[i].functions[j], arg);
+		}
+	}
+
+out:
+	for (size_t i = 0; i < walk.nr_cus; i++) {
+		rave_free(walk.cus[i].functions);
+	}
+	rave_free(walk.cus);
+	return rc;
+}
+
+static int foreach_function(struct metadata *self, foreach_function_cb cb,
+	void *arg)
+{
+	if (NULL == self || NULL == cb) {
+		return RAVE__EINVAL;
+	}
+
+	if (self->nr_workers > 1) {
+		return foreach_function_parallel(self, cb, arg);
+	}
+
+	return foreach_cu(self, cb, arg, NULL);
+}
+
+static int init(struct metadata *self, struct binary *binary,
+	const struct config *config)
 {
 	Dwarf_Debug dbg = 0;
 	Dwarf_Error err = 0;
@@ -240,6 +450,7 @@ static int init(struct metadata *self, struct binary *binary)
 	DEBUG("Dwarf metadata initialized");
 	self->dbg = dbg;
 	self->binary = binary;
+	self->nr_workers = config->nr_workers;
 
 	return RAVE__SUCCESS;
 }
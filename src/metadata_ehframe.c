@@ -0,0 +1,593 @@
+#include <string.h>
+#include <inttypes.h>
+
+#include "metadata.h"
+#include "compiler.h"
+#include "memory.h"
+#include "util.h"
+#include "rave/errno.h"
+#include "log.h"
+
+/* Pointer encodings (see the LSB's description of .eh_frame) */
+#define DW_EH_PE_absptr   0x00
+#define DW_EH_PE_uleb128  0x01
+#define DW_EH_PE_udata2   0x02
+#define DW_EH_PE_udata4   0x03
+#define DW_EH_PE_udata8   0x04
+#define DW_EH_PE_sleb128  0x09
+#define DW_EH_PE_sdata2   0x0a
+#define DW_EH_PE_sdata4   0x0b
+#define DW_EH_PE_sdata8   0x0c
+
+#define DW_EH_PE_pcrel    0x10
+#define DW_EH_PE_datarel  0x30
+#define DW_EH_PE_indirect 0x80
+#define DW_EH_PE_omit     0xff
+
+#define DW_EH_PE_FORMAT(enc) ((enc) & 0x0f)
+#define DW_EH_PE_APPL(enc) ((enc) & 0x70)
+
+/* A view of a loaded section, so we know the address of every byte we read */
+struct region {
+	const uint8_t *data;
+	uintptr_t vaddr;
+	size_t size;
+};
+
+struct metadata {
+	struct binary *binary;
+
+	struct region eh_frame;
+	struct region eh_frame_hdr;
+	int has_hdr;
+};
+
+/* Reads move a cursor forward through a region and fail on overrun */
+struct cursor {
+	const struct region *region;
+	size_t pos;
+	size_t end;
+};
+
+static void cursor_init(struct cursor *c, const struct region *region,
+	size_t pos, size_t end)
+{
+	c->region = region;
+	c->pos = pos;
+	c->end = min(end, region->size);
+}
+
+static uintptr_t cursor_vaddr(const struct cursor *c)
+{
+	return c->region->vaddr + c->pos;
+}
+
+static int read_bytes(struct cursor *c, void *out, size_t length)
+{
+	if (c->pos > c->end || c->end - c->pos < length) {
+		return RAVE__EMETADATA;
+	}
+
+	memcpy(out, c->region->data + c->pos, length);
+	c->pos += length;
+	return RAVE__SUCCESS;
+}
+
+static int read_leb(struct cursor *c, uint64_t *value, int is_signed)
+{
+	uint64_t result = 0;
+	unsigned shift = 0;
+	uint8_t byte;
+	int rc;
+
+	do {
+		rc = read_bytes(c, &byte, 1);
+		if (rc != RAVE__SUCCESS) {
+			return rc;
+		}
+
+		if (shift < 64) {
+			result |= (uint64_t)(byte & 0x7f) << shift;
+		}
+		shift += 7;
+	} while (byte & 0x80);
+
+	if (is_signed && shift < 64 && (byte & 0x40)) {
+		result |= ~0ULL << shift;
+	}
+
+	*value = result;
+	return RAVE__SUCCESS;
+}
+
+/* Read a pointer with the given encoding. datarel is only used by the
+ * .eh_frame_hdr table. */
+static int read_encoded(struct cursor *c, uint8_t enc, uintptr_t datarel,
+	uintptr_t *value)
+{
+	uintptr_t base = 0, at = cursor_vaddr(c);
+	uint64_t result;
+	uint16_t u16;
+	uint32_t u32;
+	int rc;
+
+	if (enc == DW_EH_PE_omit) {
+		*value = 0;
+		return RAVE__SUCCESS;
+	}
+
+	switch (DW_EH_PE_FORMAT(enc)) {
+	case DW_EH_PE_absptr:
+	case DW_EH_PE_udata8:
+	case DW_EH_PE_sdata8:
+		rc = read_bytes(c, &result, sizeof(result));
+		break;
+	case DW_EH_PE_uleb128:
+		rc = read_leb(c, &result, 0);
+		break;
+	case DW_EH_PE_sleb128:
+		rc = read_leb(c, &result, 1);
+		break;
+	case DW_EH_PE_udata2:
+		rc = read_bytes(c, &u16, sizeof(u16));
+		result = u16;
+		break;
+	case DW_EH_PE_sdata2:
+		rc = read_bytes(c, &u16, sizeof(u16));
+		result = (int64_t)(int16_t)u16;
+		break;
+	case DW_EH_PE_udata4:
+		rc = read_bytes(c, &u32, sizeof(u32));
+		result = u32;
+		break;
+	case DW_EH_PE_sdata4:
+		rc = read_bytes(c, &u32, sizeof(u32));
+		result = (int64_t)(int32_t)u32;
+		break;
+	default:
+		return RAVE__EMETADATA;
+	}
+
+	if (rc != RAVE__SUCCESS) {
+		return rc;
+	}
+
+	switch (DW_EH_PE_APPL(enc)) {
+	case 0:
+		break;
+	case DW_EH_PE_pcrel:
+		base = at;
+		break;
+	case DW_EH_PE_datarel:
+		base = datarel;
+		break;
+	default:
+		/* textrel/funcrel/aligned don't show up on x86-64 */
+		return RAVE__EMETADATA;
+	}
+
+	/* We can't follow indirect pointers in a file, but function addresses
+	 * are never indirect anyways */
+	if (enc & DW_EH_PE_indirect) {
+		return RAVE__EMETADATA;
+	}
+
+	*value = base + result;
+	return RAVE__SUCCESS;
+}
+
+/* Read the length and id of a CIE or FDE. The cursor is left after the id, and
+ * end is set to the end of the record. */
+static int read_record_header(struct cursor *c, size_t *end, uint32_t *id,
+	size_t *id_pos)
+{
+	uint32_t length32;
+	uint64_t length;
+	int rc;
+
+	rc = read_bytes(c, &length32, sizeof(length32));
+	if (rc != RAVE__SUCCESS) {
+		return rc;
+	}
+
+	length = length32;
+	if (length32 == 0xffffffff) {
+		rc = read_bytes(c, &length, sizeof(length));
+		if (rc != RAVE__SUCCESS) {
+			return rc;
+		}
+	}
+
+	/* Zero length terminates the section */
+	if (length == 0) {
+		*end = c->end;
+		*id = 0;
+		return RAVE__ENOENT;
+	}
+
+	if (length > c->end - c->pos) {
+		return RAVE__EMETADATA;
+	}
+
+	*end = c->pos + length;
+	*id_pos = c->pos;
+
+	/* 64-bit records still use a 4 byte CIE pointer in .eh_frame */
+	return read_bytes(c, id, sizeof(*id));
+}
+
+/* We only need the pointer encoding of FDEs from the CIE ('R' augmentation) */
+static int cie_fde_encoding(const struct metadata *self, size_t offset,
+	uint8_t *enc)
+{
+	struct cursor c;
+	const char *aug;
+	size_t end, id_pos, aug_len;
+	uint64_t skip;
+	uint32_t id;
+	uint8_t version, byte;
+	uintptr_t ignored;
+	int rc;
+
+	cursor_init(&c, &self->eh_frame, offset, self->eh_frame.size);
+	rc = read_record_header(&c, &end, &id, &id_pos);
+	if (rc != RAVE__SUCCESS || id != 0) {
+		return RAVE__EMETADATA;
+	}
+	c.end = end;
+
+	rc = read_bytes(&c, &version, 1);
+	if (rc != RAVE__SUCCESS) {
+		return rc;
+	}
+
+	aug = (const char *)self->eh_frame.data + c.pos;
+	aug_len = strnlen(aug, c.end - c.pos);
+	if (aug_len == c.end - c.pos) {
+		return RAVE__EMETADATA;
+	}
+	c.pos += aug_len + 1;
+
+	/* Ancient gcc eh data pointer */
+	if (strstr(aug, "eh")) {
+		c.pos += sizeof(uintptr_t);
+	}
+
+	/* code alignment, data alignment, return address register */
+	rc = read_leb(&c, &skip, 0);
+	rc = rc ? rc : read_leb(&c, &skip, 1);
+	if (version == 1) {
+		rc = rc ? rc : read_bytes(&c, &byte, 1);
+	} else {
+		rc = rc ? rc : read_leb(&c, &skip, 0);
+	}
+	if (rc != RAVE__SUCCESS) {
+		return rc;
+	}
+
+	*enc = DW_EH_PE_absptr;
+	if (aug[0] != 'z') {
+		return RAVE__SUCCESS;
+	}
+
+	rc = read_leb(&c, &skip, 0);
+	if (rc != RAVE__SUCCESS) {
+		return rc;
+	}
+
+	for (const char *walk = aug + 1; *walk; walk++) {
+		switch (*walk) {
+		case 'R':
+			return read_bytes(&c, enc, 1);
+		case 'P':
+			rc = read_bytes(&c, &byte, 1);
+			rc = rc ? rc : read_encoded(&c, byte & ~DW_EH_PE_indirect, 0,
+				&ignored);
+			break;
+		case 'L':
+			rc = read_bytes(&c, &byte, 1);
+			break;
+		case 'S':
+		case 'B':
+			break;
+		default:
+			/* Can't know how to skip what we don't understand */
+			return RAVE__EMETADATA;
+		}
+
+		if (rc != RAVE__SUCCESS) {
+			return rc;
+		}
+	}
+
+	return RAVE__SUCCESS;
+}
+
+/* Parse the FDE at the given offset into .eh_frame. Returns RAVE__ENOENT for
+ * CIEs and the terminator, and sets next to the following record. */
+static int parse_fde(const struct metadata *self, size_t offset,
+	struct function *function, size_t *next)
+{
+	struct cursor c;
+	size_t end = self->eh_frame.size, id_pos;
+	uint32_t id;
+	uint8_t enc;
+	uintptr_t begin, range;
+	int rc;
+
+	cursor_init(&c, &self->eh_frame, offset, self->eh_frame.size);
+	rc = read_record_header(&c, &end, &id, &id_pos);
+	*next = end;
+	if (rc != RAVE__SUCCESS) {
+		return rc;
+	}
+	c.end = end;
+
+	/* CIE */
+	if (id == 0) {
+		return RAVE__ENOENT;
+	}
+
+	/* The id of an FDE is the distance back to its CIE */
+	if (id > id_pos) {
+		return RAVE__EMETADATA;
+	}
+
+	rc = cie_fde_encoding(self, id_pos - id, &enc);
+	if (rc != RAVE__SUCCESS) {
+		return rc;
+	}
+
+	rc = read_encoded(&c, enc, 0, &begin);
+	if (rc != RAVE__SUCCESS) {
+		return rc;
+	}
+
+	/* The range is just a size, so only the format applies */
+	rc = read_encoded(&c, DW_EH_PE_FORMAT(enc), 0, &range);
+	if (rc != RAVE__SUCCESS) {
+		return rc;
+	}
+
+	function->addr = begin;
+	function->len = range;
+	return RAVE__SUCCESS;
+}
+
+/* .eh_frame_hdr has a binary search table of every FDE, already sorted by
+ * address, so we just walk the table */
+static int foreach_hdr(struct metadata *self, foreach_function_cb cb,
+	void *arg)
+{
+	struct cursor c;
+	struct function function;
+	uint8_t version, frame_enc, count_enc, table_enc;
+	uintptr_t datarel = self->eh_frame_hdr.vaddr;
+	uintptr_t frame_ptr, count, loc, fde;
+	size_t next;
+	int rc;
+
+	cursor_init(&c, &self->eh_frame_hdr, 0, self->eh_frame_hdr.size);
+	rc = read_bytes(&c, &version, 1);
+	rc = rc ? rc : read_bytes(&c, &frame_enc, 1);
+	rc = rc ? rc : read_bytes(&c, &count_enc, 1);
+	rc = rc ? rc : read_bytes(&c, &table_enc, 1);
+	if (rc != RAVE__SUCCESS || version != 1) {
+		return RAVE__EMETADATA;
+	}
+
+	rc = read_encoded(&c, frame_enc, datarel, &frame_ptr);
+	rc = rc ? rc : read_encoded(&c, count_enc, datarel, &count);
+	if (rc != RAVE__SUCCESS) {
+		return rc;
+	}
+
+	if (table_enc == DW_EH_PE_omit || count_enc == DW_EH_PE_omit) {
+		return RAVE__ENOENT;
+	}
+
+	DEBUG("eh_frame_hdr has %zu FDEs", (size_t)count);
+
+	for (uintptr_t i = 0; i < count; i++) {
+		rc = read_encoded(&c, table_enc, datarel, &loc);
+		rc = rc ? rc : read_encoded(&c, table_enc, datarel, &fde);
+		if (rc != RAVE__SUCCESS) {
+			return rc;
+		}
+
+		if (!CONTAINS(fde, self->eh_frame.vaddr,
+			self->eh_frame.vaddr + self->eh_frame.size))
+		{
+			return RAVE__EMETADATA;
+		}
+
+		rc = parse_fde(self, fde - self->eh_frame.vaddr, &function, &next);
+		if (rc != RAVE__SUCCESS) {
+			return rc == RAVE__ENOENT ? RAVE__EMETADATA : rc;
+		}
+
+		if (function.addr != loc) {
+			WARN("eh_frame_hdr entry doesn't match its FDE @ 0x%"PRIxPTR, loc);
+		}
+
+		if (function.len == 0) {
+			continue;
+		}
+
+		rc = cb(&function, arg);
+		if (rc != RAVE__SUCCESS) {
+			return rc;
+		}
+	}
+
+	return RAVE__SUCCESS;
+}
+
+static int compare_functions(const void *a, const void *b)
+{
+	const struct function *fa = a, *fb = b;
+
+	if (fa->addr != fb->addr) {
+		return fa->addr < fb->addr ? -1 : 1;
+	}
+
+	return 0;
+}
+
+/* Without the header, scan every record in .eh_frame and sort the FDEs */
+static int foreach_scan(struct metadata *self, foreach_function_cb cb,
+	void *arg)
+{
+	struct function *functions = NULL, *tmp, function;
+	size_t nr = 0, cap = 0, offset = 0, next;
+	int rc = RAVE__SUCCESS;
+
+	while (offset < self->eh_frame.size) {
+		rc = parse_fde(self, offset, &function, &next);
+		offset = next;
+
+		/* A CIE or the terminator */
+		if (rc == RAVE__ENOENT) {
+			rc = RAVE__SUCCESS;
+			continue;
+		} else if (rc != RAVE__SUCCESS) {
+			goto out;
+		}
+
+		if (function.len == 0) {
+			continue;
+		}
+
+		if (nr == cap) {
+			cap = cap ? cap * 2 : 1024;
+			tmp = rave_realloc(functions, cap * sizeof(*functions));
+			if (NULL == tmp) {
+				rc = RAVE__ENOMEM;
+				goto out;
+			}
+			functions = tmp;
+		}
+
+		functions[nr++] = function;
+	}
+
+	qsort(functions, nr, sizeof(*functions), compare_functions);
+
+	for (size_t i = 0; i < nr; i++) {
+		/* Skip duplicate FDEs for the same function */
+		if (i > 0 && functions[i].addr == functions[i - 1].addr) {
+			continue;
+		}
+
+		rc = cb(&functions[i], arg);
+		if (rc != RAVE__SUCCESS) {
+			goto out;
+		}
+	}
+
+out:
+	rave_free(functions);
+	return rc;
+}
+
+static int foreach_function(struct metadata *self, foreach_function_cb cb,
+	void *arg)
+{
+	int rc;
+
+	if (NULL == self || NULL == cb) {
+		return RAVE__EINVAL;
+	}
+
+	DEBUG("eh_frame searching for functions");
+
+	/* The header may not have a search table, in which case we scan */
+	if (self->has_hdr) {
+		rc = foreach_hdr(self, cb, arg);
+		if (rc != RAVE__ENOENT) {
+			return rc;
+		}
+	}
+
+	return foreach_scan(self, cb, arg);
+}
+
+static int region_init(struct metadata *self, const char *name,
+	struct region *region)
+{
+	struct section section;
+	int rc;
+
+	rc = binary_find_section(self->binary, name, &section);
+	if (rc != RAVE__SUCCESS) {
+		return rc;
+	}
+
+	if (section_offset(&section) + section_size(&section) >
+		(size_t)self->binary->file_size)
+	{
+		return RAVE__EMETADATA;
+	}
+
+	region->data = OFFSET((const uint8_t *)self->binary->mapping,
+		section_offset(&section));
+	region->vaddr = section_address(&section);
+	region->size = section_size(&section);
+
+	return RAVE__SUCCESS;
+}
+
+static int init(struct metadata *self, struct binary *binary,
+	UNUSED const struct config *config)
+{
+	int rc;
+
+	if (NULL == self) {
+		return RAVE__EINVAL;
+	}
+
+	self->binary = binary;
+
+	rc = region_init(self, ".eh_frame", &self->eh_frame);
+	if (rc != RAVE__SUCCESS) {
+		ERROR("Binary has no .eh_frame");
+		return rc;
+	}
+
+	self->has_hdr = (region_init(self, ".eh_frame_hdr",
+		&self->eh_frame_hdr) == RAVE__SUCCESS);
+
+	DEBUG("eh_frame metadata initialized (%s header)",
+		self->has_hdr ? "with" : "without");
+
+	return RAVE__SUCCESS;
+}
+
+static int close(struct metadata *self)
+{
+	if (NULL == self) {
+		return RAVE__EINVAL;
+	}
+
+	return RAVE__SUCCESS;
+}
+
+static struct metadata *create()
+{
+	return rave_calloc(1, sizeof(struct metadata));
+}
+
+static void destroy(struct metadata *self)
+{
+	if (NULL != self) {
+		rave_free(self);
+	}
+}
+
+struct metadata_op metadata_ehframe = {
+	.create = create,
+	.destroy = destroy,
+	.init = init,
+	.close = close,
+	.foreach_function = foreach_function,
+};
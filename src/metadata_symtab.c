@@ -0,0 +1,206 @@
+#include <string.h>
+#include <elf.h>
+
+#include "metadata.h"
+#include "compiler.h"
+#include "memory.h"
+#include "util.h"
+#include "rave/errno.h"
+#include "log.h"
+
+/* Functions straight out of the symbol tables. Everything is read from the
+ * file mapping, no libelf (or any other parser) involved. */
+struct metadata {
+	struct binary *binary;
+
+	/* Every sized function symbol, sorted by address with aliases removed */
+	struct function *functions;
+	size_t nr_functions;
+};
+
+/* Bounds check a range of the file */
+static int in_file(const struct binary *binary, uint64_t offset, uint64_t size)
+{
+	uint64_t file_size = binary->file_size;
+
+	return offset <= file_size && size <= file_size - offset;
+}
+
+static int add_symbols(struct metadata *self, const Elf64_Shdr *shdr,
+	size_t *cap)
+{
+	const Elf64_Sym *syms;
+	struct function *functions;
+	size_t nr_syms;
+
+	if (shdr->sh_entsize != sizeof(Elf64_Sym) ||
+		!in_file(self->binary, shdr->sh_offset, shdr->sh_size))
+	{
+		return RAVE__EMETADATA;
+	}
+
+	syms = OFFSET((const Elf64_Sym *)self->binary->mapping, shdr->sh_offset);
+	nr_syms = shdr->sh_size / sizeof(Elf64_Sym);
+
+	for (size_t i = 0; i < nr_syms; i++) {
+		/* Only defined functions we know the size of */
+		if (ELF64_ST_TYPE(syms[i].st_info) != STT_FUNC ||
+			syms[i].st_shndx == SHN_UNDEF ||
+			syms[i].st_size == 0)
+		{
+			continue;
+		}
+
+		if (self->nr_functions == *cap) {
+			*cap = *cap ? *cap * 2 : 1024;
+			functions = rave_realloc(self->functions,
+				*cap * sizeof(*functions));
+			if (NULL == functions) {
+				return RAVE__ENOMEM;
+			}
+			self->functions = functions;
+		}
+
+		self->functions[self->nr_functions].addr = syms[i].st_value;
+		self->functions[self->nr_functions].len = syms[i].st_size;
+		self->nr_functions++;
+	}
+
+	return RAVE__SUCCESS;
+}
+
+/* By address, and the largest size first so it survives deduping */
+static int compare_functions(const void *a, const void *b)
+{
+	const struct function *fa = a, *fb = b;
+
+	if (fa->addr != fb->addr) {
+		return fa->addr < fb->addr ? -1 : 1;
+	}
+
+	if (fa->len != fb->len) {
+		return fa->len > fb->len ? -1 : 1;
+	}
+
+	return 0;
+}
+
+static int foreach_function(struct metadata *self, foreach_function_cb cb,
+	void *arg)
+{
+	int rc;
+
+	if (NULL == self || NULL == cb) {
+		return RAVE__EINVAL;
+	}
+
+	for (size_t i = 0; i < self->nr_functions; i++) {
+		rc = cb(&self->functions[i], arg);
+		if (rc != RAVE__SUCCESS) {
+			return rc;
+		}
+	}
+
+	return RAVE__SUCCESS;
+}
+
+static int close(struct metadata *self);
+
+static int init(struct metadata *self, struct binary *binary,
+	UNUSED const struct config *config)
+{
+	const Elf64_Ehdr *ehdr;
+	const Elf64_Shdr *shdrs;
+	size_t cap = 0, nr = 0;
+	int rc;
+
+	if (NULL == self) {
+		return RAVE__EINVAL;
+	}
+
+	self->binary = binary;
+	self->functions = NULL;
+	self->nr_functions = 0;
+
+	ehdr = binary->mapping;
+	if (!in_file(binary, 0, sizeof(*ehdr)) ||
+		ehdr->e_shentsize != sizeof(Elf64_Shdr) ||
+		!in_file(binary, ehdr->e_shoff,
+			(uint64_t)ehdr->e_shnum * sizeof(Elf64_Shdr)))
+	{
+		ERROR("Bad section headers");
+		return RAVE__ESECTION_HEADER;
+	}
+
+	shdrs = OFFSET((const Elf64_Shdr *)binary->mapping, ehdr->e_shoff);
+
+	/* .symtab has everything, but stripped binaries may only have .dynsym, so
+	 * take both and let the dedupe sort it out */
+	for (size_t i = 0; i < ehdr->e_shnum; i++) {
+		if (shdrs[i].sh_type != SHT_SYMTAB && shdrs[i].sh_type != SHT_DYNSYM) {
+			continue;
+		}
+
+		rc = add_symbols(self, &shdrs[i], &cap);
+		if (rc != RAVE__SUCCESS) {
+			close(self);
+			return rc;
+		}
+	}
+
+	if (0 == self->nr_functions) {
+		ERROR("Binary has no sized function symbols");
+		close(self);
+		return RAVE__ENO_SECTION;
+	}
+
+	qsort(self->functions, self->nr_functions, sizeof(*self->functions),
+		compare_functions);
+
+	/* Aliases share an address, keep the first (largest) of each */
+	for (size_t i = 0; i < self->nr_functions; i++) {
+		if (nr > 0 && self->functions[i].addr == self->functions[nr - 1].addr) {
+			continue;
+		}
+
+		self->functions[nr++] = self->functions[i];
+	}
+	self->nr_functions = nr;
+
+	DEBUG("symtab metadata initialized (%zu functions)", self->nr_functions);
+
+	return RAVE__SUCCESS;
+}
+
+static int close(struct metadata *self)
+{
+	if (NULL == self) {
+		return RAVE__EINVAL;
+	}
+
+	rave_free(self->functions);
+	self->functions = NULL;
+	self->nr_functions = 0;
+
+	return RAVE__SUCCESS;
+}
+
+static struct metadata *create()
+{
+	return rave_calloc(1, sizeof(struct metadata));
+}
+
+static void destroy(struct metadata *self)
+{
+	if (NULL != self) {
+		rave_free(self);
+	}
+}
+
+struct metadata_op metadata_symtab = {
+	.create = create,
+	.destroy = destroy,
+	.init = init,
+	.close = close,
+	.foreach_function = foreach_function,
+};
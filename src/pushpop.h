@@ -0,0 +1,66 @@
+/**
+ * Push/Pop
+ *
+ * The only instructions rave rewrites are push r64 and pop r64, which have
+ * exactly one canonical encoding each: the opcode plus the register number,
+ * with a REX.B prefix for r8-r15. So instead of going through a general
+ * purpose encoder, every encoding is precomputed.
+ *
+ * Registers use the hardware numbering (0 = rax ... 15 = r15).
+ *
+ * Author: Christopher Blackburn <krizboy@vt.edu>
+ * Date: 1/1/1977
+ */
+
+#ifndef __PUSHPOP_H_
+#define __PUSHPOP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PUSHPOP_NR_REGS 16
+#define PUSHPOP_MAX_LENGTH 2
+
+#define OP_PUSH_R64 0x50
+#define OP_POP_R64 0x58
+#define REX_B 0x41
+
+struct pushpop_template {
+	uint8_t length;
+	uint8_t bytes[PUSHPOP_MAX_LENGTH];
+};
+
+#define __PP_LO(op, r) { 1, { (op) + (r) } }
+#define __PP_HI(op, r) { 2, { REX_B, (op) + (r) - 8 } }
+#define __PP_TEMPLATES(op) { \
+	__PP_LO(op, 0), __PP_LO(op, 1), __PP_LO(op, 2), __PP_LO(op, 3), \
+	__PP_LO(op, 4), __PP_LO(op, 5), __PP_LO(op, 6), __PP_LO(op, 7), \
+	__PP_HI(op, 8), __PP_HI(op, 9), __PP_HI(op, 10), __PP_HI(op, 11), \
+	__PP_HI(op, 12), __PP_HI(op, 13), __PP_HI(op, 14), __PP_HI(op, 15), \
+}
+
+/* Indexed by [pop][reg] */
+static const struct pushpop_template pushpop_templates[2][PUSHPOP_NR_REGS] = {
+	__PP_TEMPLATES(OP_PUSH_R64),
+	__PP_TEMPLATES(OP_POP_R64),
+};
+
+static inline size_t pushpop_length(uint8_t reg)
+{
+	return reg < 8 ? 1 : 2;
+}
+
+/* Write a push (or pop) of reg to target. Returns the byte after it. */
+static inline uint8_t *pushpop_encode(uint8_t *target, uint8_t reg, int pop)
+{
+	const struct pushpop_template *t = &pushpop_templates[!!pop][reg];
+
+	target[0] = t->bytes[0];
+	if (t->length == 2) {
+		target[1] = t->bytes[1];
+	}
+
+	return target + t->length;
+}
+
+#endif /* __PUSHPOP_H_ */
@@ -1,6 +1,168 @@
-#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/random.h>
 
 #include "random.h"
+#include "rave/errno.h"
+#include "log.h"
+
+/* "expand 32-byte k" */
+static const uint32_t sigma[4] = {
+	0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+};
+
+/* splitmix64 finalizer */
+static inline uint64_t mix(uint64_t z)
+{
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static inline uint32_t rotl(uint32_t x, int n)
+{
+	return (x << n) | (x >> (32 - n));
+}
+
+#define QUARTERROUND(x, a, b, c, d) do { \
+	x[a] += x[b]; x[d] = rotl(x[d] ^ x[a], 16); \
+	x[c] += x[d]; x[b] = rotl(x[b] ^ x[c], 12); \
+	x[a] += x[b]; x[d] = rotl(x[d] ^ x[a], 8); \
+	x[c] += x[d]; x[b] = rotl(x[b] ^ x[c], 7); \
+} while (0)
+
+/* Generate the next block into the buffer */
+static void refill(struct rng *self)
+{
+	uint32_t *x = self->buffer;
+
+	memcpy(x, self->state, sizeof(self->buffer));
+
+	for (int i = 0; i < RNG_ROUNDS; i += 2) {
+		QUARTERROUND(x, 0, 4, 8, 12);
+		QUARTERROUND(x, 1, 5, 9, 13);
+		QUARTERROUND(x, 2, 6, 10, 14);
+		QUARTERROUND(x, 3, 7, 11, 15);
+
+		QUARTERROUND(x, 0, 5, 10, 15);
+		QUARTERROUND(x, 1, 6, 11, 12);
+		QUARTERROUND(x, 2, 7, 8, 13);
+		QUARTERROUND(x, 3, 4, 9, 14);
+	}
+
+	for (int i = 0; i < RNG_BLOCK; i++) {
+		x[i] += self->state[i];
+	}
+
+	/* 64 bit block counter */
+	if (++self->state[12] == 0) {
+		self->state[13]++;
+	}
+
+	self->next = 0;
+}
+
+static void rng_setup(struct rng *self, const uint32_t key[8], uint64_t stream)
+{
+	memcpy(&self->state[0], sigma, sizeof(sigma));
+	memcpy(&self->state[4], key, 8 * sizeof(uint32_t));
+	self->state[12] = 0;
+	self->state[13] = 0;
+	self->state[14] = (uint32_t)stream;
+	self->state[15] = (uint32_t)(stream >> 32);
+
+	/* Nothing is generated until it is asked for */
+	self->next = RNG_BLOCK;
+}
+
+void rng_init(struct rng *self, uint64_t seed, uint64_t stream)
+{
+	uint32_t key[8];
+	uint64_t z;
+
+	/* Spread the seed over the whole key */
+	for (int i = 0; i < 4; i++) {
+		z = mix(seed + 0x9e3779b97f4a7c15ULL * (i + 1));
+		key[2 * i] = (uint32_t)z;
+		key[2 * i + 1] = (uint32_t)(z >> 32);
+	}
+
+	rng_setup(self, key, stream);
+}
+
+void rng_init_key(struct rng *self, const uint8_t key[RNG_KEY_SIZE],
+	uint64_t stream)
+{
+	uint32_t words[8];
+
+	/* Little endian, like the rest of ChaCha */
+	for (int i = 0; i < 8; i++) {
+		words[i] = (uint32_t)key[4 * i] |
+			(uint32_t)key[4 * i + 1] << 8 |
+			(uint32_t)key[4 * i + 2] << 16 |
+			(uint32_t)key[4 * i + 3] << 24;
+	}
+
+	rng_setup(self, words, stream);
+}
+
+int rng_init_random(struct rng *self)
+{
+	uint8_t key[RNG_KEY_SIZE];
+	size_t done = 0;
+	ssize_t rc;
+
+	while (done < sizeof(key)) {
+		rc = getrandom(key + done, sizeof(key) - done, 0);
+		if (rc < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			ERROR("Could not get a random seed (%s)", strerror(errno));
+			return RAVE__EFATAL;
+		}
+
+		done += rc;
+	}
+
+	rng_init_key(self, key, 0);
+	memset(key, 0, sizeof(key));
+	return RAVE__SUCCESS;
+}
+
+uint32_t rng_next32(struct rng *self)
+{
+	if (self->next == RNG_BLOCK) {
+		refill(self);
+	}
+
+	return self->buffer[self->next++];
+}
+
+uint64_t rng_next(struct rng *self)
+{
+	uint64_t lo = rng_next32(self);
+
+	return lo | (uint64_t)rng_next32(self) << 32;
+}
+
+/* Lemire's multiply and shift, only retrying in the (rare) biased case */
+uint32_t rng_bounded(struct rng *self, uint32_t range)
+{
+	uint64_t m = (uint64_t)rng_next32(self) * range;
+	uint32_t low = (uint32_t)m, threshold;
+
+	if (low < range) {
+		threshold = -range % range;
+		while (low < threshold) {
+			m = (uint64_t)rng_next32(self) * range;
+			low = (uint32_t)m;
+		}
+	}
+
+	return m >> 32;
+}
 
 static inline void swap(int *a, int *b)
 {
@@ -11,12 +173,12 @@ static inline void swap(int *a, int *b)
 	*b = tmp;
 }
 
-void shuffle(int *arr, size_t nmemb)
+void shuffle(int *arr, size_t nmemb, struct rng *rng)
 {
-	int rnd;
+	size_t rnd;
 
-	for (size_t i = 0; i < nmemb - 1; i++) {
-		rnd = i + (rand() % (nmemb - i));
+	for (size_t i = 0; i + 1 < nmemb; i++) {
+		rnd = i + rng_bounded(rng, nmemb - i);
 		swap(&arr[i], &arr[rnd]);
 	}
 }
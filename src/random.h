@@ -10,7 +10,44 @@
 #ifndef __RANDOM_H_
 #define __RANDOM_H_
 
-void shuffle(int *arr, size_t nmemb);
+#include <stddef.h>
+#include <stdint.h>
 
-#endif /* __RANDOM_H_ */
+/* ChaCha rounds. 8 is still far beyond any known attack and is more than twice
+ * as fast as the usual 20. */
+#define RNG_ROUNDS 8
+
+#define RNG_KEY_SIZE 32
+
+/* Words in a ChaCha block */
+#define RNG_BLOCK 16
+
+/* A counter-based generator (ChaCha). Every (key, stream) pair gives an
+ * independent sequence, so work can be split up without sharing any state and
+ * still produce the same numbers as doing it all in order. Output is made a
+ * whole block at a time and handed out a word at a time. */
+struct rng {
+	/* Constants, key, block counter and stream */
+	uint32_t state[RNG_BLOCK];
+
+	uint32_t buffer[RNG_BLOCK];
+	unsigned int next;
+};
+
+/* Key the generator off of a 64 bit seed */
+void rng_init(struct rng *self, uint64_t seed, uint64_t stream);
+void rng_init_key(struct rng *self, const uint8_t key[RNG_KEY_SIZE],
+	uint64_t stream);
 
+/* Key the generator from the kernel (getrandom) */
+int rng_init_random(struct rng *self);
+
+uint32_t rng_next32(struct rng *self);
+uint64_t rng_next(struct rng *self);
+
+/* Uniform in [0, range), without any modulo bias */
+uint32_t rng_bounded(struct rng *self, uint32_t range);
+
+void shuffle(int *arr, size_t nmemb, struct rng *rng);
+
+#endif /* __RANDOM_H_ */
@@ -1,7 +1,10 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/mman.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include "rave.h"
 #include "rave/errno.h"
@@ -10,98 +13,407 @@
 #include "function.h"
 #include "metadata.h"
 #include "transform.h"
+#include "cache.h"
+#include "config.h"
+#include "workers.h"
+#include "random.h"
+#include "bitmap.h"
+#include "list.h"
 #include "memory.h"
 #include "util.h"
 #include "log.h"
 
-/* Use dwarf metadata */
-static struct metadata_op *mop = &metadata_dwarf;
+/* Metadata backends, indexed by enum rave_metadata */
+static struct metadata_op *metadata_ops[] = {
+	[RAVE_METADATA_DWARF] = &metadata_dwarf,
+	[RAVE_METADATA_EHFRAME] = &metadata_ehframe,
+	[RAVE_METADATA_SYMTAB] = &metadata_symtab,
+};
+
+/* One copy of the code segment. Normally there is just the one, but the next
+ * layout gets its own while it is built in the background, and an old layout
+ * sticks around until every page pinned from it has been put back. */
+struct layout {
+	struct list_head l;
+
+	/* The local memory backing the segment. When the segment is mapped
+	 * copy-on-write, the file offset of the segment may not be page
+	 * aligned, so the segment can start part way into this mapping. */
+	void *mapping;
+	size_t length;
+	int cow;
+
+	/* Backed by transparent huge pages, the segment sits at the same offset
+	 * into a huge page as it does in the target */
+	int huge;
+
+	/* The entire loadable code segment. I load the whole segment (and not
+	 * just the text section) because it's just easier to serve page faults
+	 * when I don't have fragmented regions of memory. */
+	struct window segment;
+
+	/* A convenience window for looking specifically at the text section.
+	 * This is backed by the same memory used for the segment:
+	 *
+	 * +---------+------+-----+----------------+
+	 * |   seg   | text | seg |      zero      |
+	 * +---------+------+-----+----------------+
+	 *
+	 * */
+	struct window text;
+
+	/* One for being the current layout, plus one per pinned page */
+	size_t refs;
+};
 
 struct rave_handle {
 	struct binary binary;
 
+	struct metadata_op *mop;
 	metadata_t metadata;
+	int metadata_loaded;
 	transform_t transform;
 
-	/* The memory mapping containing code pages */
+	/* Options set by the user before init */
+	struct config opts;
+
+	/* The text section and the segment containing it, so new layouts can be
+	 * mapped after init */
+	struct section text;
+	struct segment segment;
+
+	/* The layout faults are served from, and how many times it has been
+	 * swapped for another */
+	struct layout *code;
+	uint64_t generation;
+
+	/* Layouts which were replaced while pages were still pinned */
+	struct list_head retired;
+
+	/* Protects code, retired and the layout refcounts */
+	pthread_mutex_t lock;
+
+	/* The next layout, while it is built in the background */
 	struct {
-		/* The entire loadable code segment. I load the whole segment (and not
-		 * just the text section) because it's just easier to serve page faults
-		 * when I don't have fragmented regions of memory. */
-		struct window segment;
-
-		/* A convenience window for looking specifically at the text section.
-		 * This is backed by the same memory used for the segment:
-		 *
-		 * +---------+------+-----+----------------+
-		 * |   seg   | text | seg |      zero      |
-		 * +---------+------+-----+----------------+
-		 *
-		 * */
-		struct window text;
-	} code;
+		struct layout *next;
+		uint64_t seed;
+		pthread_t thread;
+
+		/* pending until published, running until the thread is joined */
+		int pending, running;
+		int done, rc;
+	} async;
 
 	/* The executable segment could have been loaded somewhere else in memory,
 	 * so we need an offset to reflect that */
 	size_t reloc_offset;
+
+	/* Seed for the current layout */
+	uint64_t seed;
+
+	/* Where layout seeds come from. Keyed from the kernel, unless the user
+	 * gave a seed to make the layouts reproducible. */
+	struct rng rng;
+
+	/* Whatever rave_get_stats reports that the transform doesn't keep track
+	 * of. Faults can come in from anywhere, so the counters which can change
+	 * after init are only touched atomically. */
+	struct {
+		uint64_t seen, outside_text;
+		int cache_hit;
+
+		uint64_t randomizations, faults, fault_pages;
+		uint64_t phase_ns[RAVE_PHASE_MAX];
+	} stats;
+
+	/* Where the last fault-around run ended (relocated), and how many pages
+	 * the next one gets. Only a heuristic, so racing faults don't have to
+	 * agree on it. */
+	struct {
+		uintptr_t next;
+		size_t window;
+	} around;
+};
+
+/* Charge the time since start to a phase */
+static void add_time(struct rave_handle *self, enum rave_phase phase,
+	uint64_t start)
+{
+	__atomic_fetch_add(&self->stats.phase_ns[phase], now_ns() - start,
+		__ATOMIC_RELAXED);
+}
+
+/* Functions pulled out of the metadata, waiting to be analyzed */
+struct function_records {
+	struct rave_handle *self;
+
+	struct function *records;
+	size_t nr, cap;
 };
 
 /* Callback used when iterating through function metadata. Returns success
  * unless there is a fatal error (e.g. nomem) */
 static int process_function(const struct function *function, void *arg)
 {
-	struct rave_handle *self = (struct rave_handle *)arg;
-	void *bytes;
+	struct function_records *fr = arg;
+	struct rave_handle *self = fr->self;
+	struct function *records;
+	size_t cap;
 	int rc;
 
 	DEBUG("Processing function @ 0x%"PRIxPTR", size = %zu", function->addr,
 		function->len);
+	self->stats.seen++;
 
 	/* We have to make sure the function addresses are virtually contained by
 	 * the text section */
 	rc = 0;
-	rc |= !window_contains(&self->code.text, function->addr);
-	rc |= !window_contains(&self->code.text, function->addr + function->len);
+	rc |= !window_contains(&self->code->text, function->addr);
+	rc |= !window_contains(&self->code->text, function->addr + function->len);
 	if (rc) {
 		WARN("Can't modify function - not in text section");
+		self->stats.outside_text++;
 		return RAVE__SUCCESS;
 	}
 
-	/* Get a pointer to the locally-loaded target function */
-	bytes = window_view(&self->code.text, function->addr, NULL);
+	/* The transformer verifies the functions once we have all of them */
+	if (fr->nr == fr->cap) {
+		cap = fr->cap ? fr->cap * 2 : 1024;
+		records = rave_realloc(fr->records, cap * sizeof(*records));
+		if (NULL == records) {
+			return RAVE__ENOMEM;
+		}
 
-	/* Let the transformer verify the function */
-	rc = transform_add_function(self->transform, function, bytes);
-	if (rc != RAVE__SUCCESS) {
-		WARN("non-randomizable function @ 0x%"PRIxPTR, function->addr);
-		return RAVE__SUCCESS;
+		fr->records = records;
+		fr->cap = cap;
 	}
 
+	fr->records[fr->nr++] = *function;
 	return RAVE__SUCCESS;
 }
 
 struct rave_handle * rave_create(void)
 {
-	return rave_malloc(sizeof(struct rave_handle));
+	struct rave_handle *self;
+
+	self = rave_calloc(1, sizeof(struct rave_handle));
+	if (NULL != self) {
+		self->binary.fd = -1;
+		self->opts.nr_workers = 1;
+		self->opts.nr_randomize_workers = 1;
+		self->opts.fault_around = 1;
+		self->around.window = 1;
+		INIT_LIST_HEAD(&self->retired);
+
+		if (rng_init_random(&self->rng) != RAVE__SUCCESS) {
+			rave_free(self);
+			return NULL;
+		}
+
+		pthread_mutex_init(&self->lock, NULL);
+	}
+
+	return self;
 }
 
 void rave_destroy(struct rave_handle *self)
 {
 	if (NULL != self) {
+		pthread_mutex_destroy(&self->lock);
+		rave_free(self->opts.cache_dir);
 		rave_free(self);
 	}
 }
 
+int rave_set_option(struct rave_handle *self, enum rave_option option,
+	long value)
+{
+	if (NULL == self) {
+		return RAVE__EINVAL;
+	}
+
+	switch (option) {
+	case RAVE_OPT_COW:
+		self->opts.cow = !!value;
+		break;
+	case RAVE_OPT_LAZY:
+		self->opts.lazy = !!value;
+		break;
+	case RAVE_OPT_HUGEPAGES:
+		self->opts.hugepages = !!value;
+		break;
+	case RAVE_OPT_WORKERS:
+		if (value < 0) {
+			return RAVE__EINVAL;
+		}
+		self->opts.nr_workers = value ? (size_t)value : workers_default();
+		break;
+	case RAVE_OPT_METADATA:
+		if (value < 0 || value >= RAVE_METADATA_MAX) {
+			return RAVE__EINVAL;
+		}
+		self->opts.metadata = value;
+		break;
+	case RAVE_OPT_RANDOMIZE_WORKERS:
+		if (value < 0) {
+			return RAVE__EINVAL;
+		}
+		self->opts.nr_randomize_workers = value ? (size_t)value :
+			workers_default();
+		break;
+	case RAVE_OPT_FAULT_AROUND:
+		if (value < 0) {
+			return RAVE__EINVAL;
+		}
+		self->opts.fault_around = value ? (size_t)value : 1;
+		break;
+	default:
+		return RAVE__EINVAL;
+	}
+
+	return RAVE__SUCCESS;
+}
+
+int rave_set_cache_dir(struct rave_handle *self, const char *dir)
+{
+	char *copy = NULL;
+
+	if (NULL == self) {
+		return RAVE__EINVAL;
+	}
+
+	if (NULL != dir) {
+		copy = rave_malloc(strlen(dir) + 1);
+		if (NULL == copy) {
+			return RAVE__ENOMEM;
+		}
+		strcpy(copy, dir);
+	}
+
+	rave_free(self->opts.cache_dir);
+	self->opts.cache_dir = copy;
+
+	return RAVE__SUCCESS;
+}
+
+/* Map the segment privately from the binary file. Nothing is copied until the
+ * transform writes to a page. The whole region is reserved as anonymous memory
+ * first so the zero tail (memsz > filesz) is also backed lazily. */
+static void *map_segment_cow(struct rave_handle *self, struct segment *segment,
+	size_t length, size_t *delta)
+{
+	void *mapping, *file_pages, *tail;
+	size_t file_offset, file_length, filesz;
+
+	/* mmap needs a page aligned file offset */
+	file_offset = PAGE_DOWN(segment_offset(segment));
+	*delta = segment_offset(segment) - file_offset;
+	filesz = segment_filesz(segment);
+
+	mapping = mmap(NULL, length, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == mapping) {
+		return NULL;
+	}
+
+	/* Don't map past the end of the file, touching those pages would fault */
+	file_length = min(PAGE_UP(*delta + filesz),
+		PAGE_UP(self->binary.file_size - file_offset));
+
+	file_pages = mmap(mapping, file_length, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_FIXED, self->binary.fd, file_offset);
+	if (MAP_FAILED == file_pages) {
+		munmap(mapping, length);
+		return NULL;
+	}
+
+	/* Whatever follows the segment in the last file page has to read as zero,
+	 * same as the copied mapping. This costs at most one private page. */
+	tail = OFFSET(mapping, *delta + filesz);
+	if (PAGE_UP(*delta + filesz) != *delta + filesz) {
+		memset(tail, 0, PAGE_UP(*delta + filesz) - (*delta + filesz));
+	}
+
+	return mapping;
+}
+
+/* A copy of the segment in memory aligned so the segment's huge pages line up
+ * with the target's, advised to be backed by transparent huge pages. length
+ * is the whole (huge page aligned) mapping. */
+static void *map_segment_huge(struct rave_handle *self,
+	struct segment *segment, size_t *length, size_t *delta)
+{
+	void *raw, *mapping;
+	size_t lead;
+
+	lead = segment_vaddr(segment) % HPAGESZ;
+	*length = HPAGE_UP(lead + segment_memsz(segment));
+	*delta = lead;
+
+	/* Over-allocate by a huge page and trim down to the aligned part */
+	raw = mmap(NULL, *length + HPAGESZ, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == raw) {
+		return NULL;
+	}
+
+	mapping = PTR(HPAGE_UP((uintptr_t)raw));
+	if (mapping != raw) {
+		munmap(raw, (uintptr_t)mapping - (uintptr_t)raw);
+	}
+	munmap(OFFSET(mapping, *length),
+		(uintptr_t)raw + HPAGESZ - (uintptr_t)mapping);
+
+	/* Without THP this is just slower to fault in, which isn't worth
+	 * failing over */
+	if (madvise(mapping, *length, MADV_HUGEPAGE) != 0) {
+		WARN("Could not advise huge pages for the code (%s)",
+			strerror(errno));
+	}
+
+	memcpy(OFFSET(mapping, lead),
+		OFFSET(self->binary.mapping, segment_offset(segment)),
+		segment_filesz(segment));
+
+	return mapping;
+}
+
+/* Whether the segment can line up with huge pages in the target at all */
+static int want_huge(struct rave_handle *self, struct segment *segment)
+{
+	if (!self->opts.hugepages) {
+		return 0;
+	}
+
+	if (self->opts.cow) {
+		WARN("Huge pages don't go with copy-on-write, using small pages");
+		return 0;
+	}
+
+	/* The loader keeps the segment's offset into a huge page only if it
+	 * has to keep it aligned to one */
+	if (segment_align(segment) < HPAGESZ ||
+		segment_memsz(segment) < HPAGESZ)
+	{
+		INFO("Segment isn't huge page aligned (or big enough), using small "
+			"pages");
+		return 0;
+	}
+
+	return 1;
+}
+
 /* In order to accurately map code pages, we need the segment containing the
  * text section. In an elf segment, the on disk size can be smaller than the in
  * memory size. */
-static int map_code_pages(struct rave_handle *self, struct section *text,
-	struct segment *segment)
+static int map_code_pages(struct rave_handle *self, struct layout *layout)
 {
+	struct section *text = &self->text;
+	struct segment *segment = &self->segment;
 	void *copy_src, *copy_dst;
 	size_t copy_size;
-	void *mapping;
-	size_t length;
+	void *mapping, *data;
+	size_t length, delta = 0;
 
 	/* It's probably the wrong segment if it's not loadable... */
 	if (!segment_loadable(segment)) {
@@ -111,42 +423,224 @@ static int map_code_pages(struct rave_handle *self, struct section *text,
 
 	length = PAGE_UP(segment_memsz(segment));
 
-	/* Map a mock region for the executable segment which we can modify */
-	mapping = rave_calloc(1, length);
-	if (NULL == mapping) {
-		FATAL("Could not map code segment");
-		return RAVE__ENOMEM;
+	if (want_huge(self, segment)) {
+		mapping = map_segment_huge(self, segment, &layout->length, &delta);
+		if (NULL == mapping) {
+			FATAL("Could not map code segment");
+			return RAVE__EMAP_FAILED;
+		}
+		layout->huge = 1;
+	} else if (self->opts.cow) {
+		/* Leave room for the segment's offset into its first file page */
+		layout->length = PAGE_UP(segment_offset(segment) -
+			PAGE_DOWN(segment_offset(segment)) + length);
+		mapping = map_segment_cow(self, segment, layout->length, &delta);
+		if (NULL == mapping) {
+			FATAL("Could not map code segment");
+			return RAVE__EMAP_FAILED;
+		}
+	} else {
+		/* Map a mock region for the executable segment which we can modify */
+		layout->length = length;
+		mapping = rave_calloc(1, length);
+		if (NULL == mapping) {
+			FATAL("Could not map code segment");
+			return RAVE__ENOMEM;
+		}
+
+		/* Copy the segment from the binary file */
+		copy_dst = mapping;
+		copy_src = OFFSET(self->binary.mapping, segment_offset(segment));
+		copy_size = segment_filesz(segment);
+		memcpy(copy_dst, copy_src, copy_size);
 	}
 
-	/* Copy the segment from the binary file */
-	copy_dst = mapping;
-	copy_src = OFFSET(self->binary.mapping, segment_offset(segment));
-	copy_size = segment_filesz(segment);
-	memcpy(copy_dst, copy_src, copy_size);
+	layout->mapping = mapping;
+	layout->cow = self->opts.cow;
+	data = OFFSET(mapping, delta);
 
 	/* The full segment window */
-	window_init(&self->code.segment,
+	window_init(&layout->segment,
 		segment_vaddr(segment),
-		mapping,
+		data,
 		length);
 
 	/* Convenience window to access text section directly */
-	window_init(&self->code.text,
+	window_init(&layout->text,
 		section_address(text),
-		OFFSET(mapping, section_offset(text) - segment_offset(segment)),
+		OFFSET(data, section_offset(text) - segment_offset(segment)),
 		section_size(text));
 
-	DEBUG("Locally loaded segment intended for: 0x%"PRIxPTR" (%zu pages)",
-		segment_vaddr(segment), length / PAGESZ);
+	DEBUG("Locally loaded segment intended for: 0x%"PRIxPTR" (%zu pages%s)",
+		segment_vaddr(segment), length / PAGESZ,
+		layout->cow ? ", copy-on-write" :
+		layout->huge ? ", huge pages" : "");
+
+	return RAVE__SUCCESS;
+}
+
+static void layout_destroy(struct layout *layout)
+{
+	if (NULL == layout) {
+		return;
+	}
+
+	if (layout->mapping) {
+		if (layout->cow || layout->huge) {
+			munmap(layout->mapping, layout->length);
+		} else {
+			rave_free(layout->mapping);
+		}
+	}
+
+	rave_free(layout);
+}
+
+/* A fresh copy of the code segment, straight from the binary */
+static int layout_create(struct rave_handle *self, struct layout **out)
+{
+	struct layout *layout;
+	int rc;
+
+	layout = rave_calloc(1, sizeof(*layout));
+	if (NULL == layout) {
+		return RAVE__ENOMEM;
+	}
+
+	rc = map_code_pages(self, layout);
+	if (rc != RAVE__SUCCESS) {
+		layout_destroy(layout);
+		return rc;
+	}
+
+	INIT_LIST_HEAD(&layout->l);
+	layout->refs = 1;
 
+	*out = layout;
 	return RAVE__SUCCESS;
 }
 
+/* The layout faults are served from right now. rave_publish swaps it under
+ * the handle lock, so anyone not holding the lock (or a reference) must not
+ * be running alongside a publish. */
+static struct layout *current_layout(struct rave_handle *self)
+{
+	return __atomic_load_n(&self->code, __ATOMIC_ACQUIRE);
+}
+
+/* Drop a reference to a layout. Must hold the handle lock. A layout which
+ * drops to nothing can't be current anymore, so it is retired. */
+static void layout_put_locked(struct layout *layout)
+{
+	if (--layout->refs == 0) {
+		list_del(&layout->l);
+		layout_destroy(layout);
+	}
+}
+
+/* Wait for the background thread, if it is still around */
+static void async_join(struct rave_handle *self)
+{
+	if (self->async.running) {
+		pthread_join(self->async.thread, NULL);
+		self->async.running = 0;
+	}
+}
+
+/* The analysis only depends on the build of the binary and where its text is */
+static int cache_key_init(struct rave_handle *self, struct cache_key *key)
+{
+	int rc;
+
+	rc = binary_build_id(&self->binary, &key->build_id, &key->build_id_len);
+	if (rc != RAVE__SUCCESS) {
+		WARN("Binary has no build-id, not caching analysis");
+		return rc;
+	}
+
+	key->text_addr = window_orig(&self->code->text);
+	window_get(&self->code->text, &key->text_size);
+	key->metadata = self->opts.metadata;
+
+	return RAVE__SUCCESS;
+}
+
+/* Find every function we can transform. If there is a valid analysis cache for
+ * this binary, that is used instead of walking the metadata and decoding. */
+static int analyze_binary(struct rave_handle *self)
+{
+	struct function_records fr = { .self = self };
+	struct cache_key key;
+	char *path = NULL;
+	uint64_t start = now_ns();
+	int rc;
+
+	if (NULL != self->opts.cache_dir &&
+		cache_key_init(self, &key) == RAVE__SUCCESS)
+	{
+		path = cache_path(self->opts.cache_dir, &key);
+		if (NULL == path) {
+			return RAVE__ENOMEM;
+		}
+
+		rc = cache_load(self->transform, &self->code->text, path, &key);
+		if (rc == RAVE__SUCCESS) {
+			self->stats.cache_hit = 1;
+			add_time(self, RAVE_PHASE_ANALYSIS, start);
+			rave_free(path);
+			return RAVE__SUCCESS;
+		}
+
+		/* Drop whatever a bad cache left behind and rebuild it */
+		transform_close(self->transform);
+		rc = transform_init(self->transform, &self->code->segment);
+		if (rc != RAVE__SUCCESS) {
+			rave_free(path);
+			return rc;
+		}
+	}
+
+	start = now_ns();
+	rc = self->mop->init(self->metadata, &self->binary, &self->opts);
+	if (rc != RAVE__SUCCESS) {
+		FATAL("Could not initialize binary metadata");
+		goto out;
+	}
+	self->metadata_loaded = 1;
+
+	/* With both the code and metadata loaded, we can now analyze the binary to
+	 * get, prune, and transform functions */
+	rc = self->mop->foreach_function(self->metadata, process_function, &fr);
+	if (rc != RAVE__SUCCESS) {
+		FATAL("An error occured while processing metadata");
+		goto out;
+	}
+	add_time(self, RAVE_PHASE_METADATA, start);
+
+	start = now_ns();
+	rc = transform_add_functions(self->transform, &self->code->text,
+		fr.records, fr.nr, self->opts.nr_workers);
+	if (rc != RAVE__SUCCESS) {
+		FATAL("An error occured while analyzing functions");
+		goto out;
+	}
+	add_time(self, RAVE_PHASE_ANALYSIS, start);
+
+	/* Not being able to cache isn't fatal, we'll just analyze again next time */
+	if (NULL != path) {
+		cache_store(self->transform, path, &key);
+	}
+
+out:
+	rave_free(fr.records);
+	rave_free(path);
+	return rc;
+}
+
 int rave_init(struct rave_handle *self, const char *filename)
 {
+	uint64_t start;
 	int rc;
-	struct section text;
-	struct segment segment;
 
 	DEBUG("Intializing rave with binary: %s", filename);
 
@@ -154,7 +648,8 @@ int rave_init(struct rave_handle *self, const char *filename)
 		return 0;
 	}
 
-	self->metadata = mop->create();
+	self->mop = metadata_ops[self->opts.metadata];
+	self->metadata = self->mop->create();
 	if (NULL == self->metadata) {
 		FATAL("No memory for metadata");
 		return RAVE__ENOMEM;
@@ -166,51 +661,55 @@ int rave_init(struct rave_handle *self, const char *filename)
 		return RAVE__ENOMEM;
 	}
 
+	memset(&self->stats, 0, sizeof(self->stats));
+	start = now_ns();
+
 	rc = binary_init(&self->binary, filename);
 	if (rc != RAVE__SUCCESS) {
 		goto err;
 	}
 
 	/* let's find the segment containing the code and map it */
-	rc = binary_find_section(&self->binary, ".text", &text);
+	rc = binary_find_section(&self->binary, ".text", &self->text);
 	if (rc != RAVE__SUCCESS) {
 		FATAL("Couldn't load the text section");
 		goto err;
 	}
 
-	rc = binary_find_segment(&self->binary, section_address(&text),
-		&segment);
+	rc = binary_find_segment(&self->binary, section_address(&self->text),
+		&self->segment);
 	if (rc != RAVE__SUCCESS) {
 		FATAL("Couldn't load the segment containing the text section");
 		return rc;
 	}
 
-	rc = mop->init(self->metadata, &self->binary);
+	/* Now that we've loaded both the text section and it's containing segment,
+	 * we can map the pages. */
+	rc = layout_create(self, &self->code);
 	if (rc != RAVE__SUCCESS) {
-		FATAL("Could not initialize binary metadata");
+		FATAL("Could not map code pages");
 		return rc;
 	}
+	self->generation = 0;
 
-	rc = transform_init(self->transform);
+	rc = transform_init(self->transform, &self->code->segment);
 	if (rc != RAVE__SUCCESS) {
 		goto err;
 	}
+	add_time(self, RAVE_PHASE_LOAD, start);
 
-	/* Now that we've loaded both the text section and it's containing segment,
-	 * we can map the pages. */
-	rc = map_code_pages(self, &text, &segment);
+	rc = analyze_binary(self);
 	if (rc != RAVE__SUCCESS) {
-		FATAL("Could not map code pages");
 		return rc;
 	}
 
-	/* With both the code and metadata loaded, we can now analyze the binary to
-	 * get, prune, and transform functions */
-	rc = mop->foreach_function(self->metadata, process_function, self);
+	/* Randomizing shouldn't have to allocate anything */
+	start = now_ns();
+	rc = transform_prepare(self->transform, self->opts.nr_randomize_workers);
 	if (rc != RAVE__SUCCESS) {
-		FATAL("An error occured while processing metadata");
 		return rc;
 	}
+	add_time(self, RAVE_PHASE_ANALYSIS, start);
 
 	return RAVE__SUCCESS;
 err:
@@ -222,7 +721,7 @@ err:
 
 int rave_close(struct rave_handle *self)
 {
-	void *code_mapping;
+	struct layout *layout, *n;
 	int rc = 0;
 
 	if (NULL == self) {
@@ -231,32 +730,365 @@ int rave_close(struct rave_handle *self)
 
 	DEBUG("Closing rave handle...");
 
-	code_mapping = window_get(&self->code.segment, NULL);
-	if (code_mapping) {
-		rave_free(code_mapping);
+	/* Whatever was being built can't be published anymore */
+	async_join(self);
+	layout_destroy(self->async.next);
+	self->async.next = NULL;
+	self->async.pending = 0;
+
+	layout_destroy(self->code);
+	self->code = NULL;
+
+	/* Any pages still pinned are gone now */
+	list_for_each_entry_safe(layout, n, &self->retired, l) {
+		WARN("Closing with pages still pinned");
+		list_del(&layout->l);
+		layout_destroy(layout);
 	}
 
-	rc |= mop->close(self->metadata);
-	mop->destroy(self->metadata);
+	if (NULL != self->mop) {
+		if (self->metadata_loaded) {
+			rc |= self->mop->close(self->metadata);
+			self->metadata_loaded = 0;
+		}
+		self->mop->destroy(self->metadata);
+		self->metadata = NULL;
+	}
 	rc |= binary_close(&self->binary);
 	rc |= transform_close(self->transform);
 	transform_destroy(self->transform);
 	return rc;
 }
 
+/* Each layout gets its own seed, and every function gets its own stream off
+ * of that, so a layout is the same however (and whenever) it is built */
+static uint64_t next_seed(struct rave_handle *self)
+{
+	return rng_next(&self->rng);
+}
+
+int rave_set_seed(rave_handle_t self, uint64_t seed)
+{
+	if (NULL == self) {
+		return RAVE__EINVAL;
+	}
+
+	rng_init(&self->rng, seed, 0);
+	return RAVE__SUCCESS;
+}
+
 /* trigger a randomization */
 int rave_randomize(rave_handle_t self)
 {
+	uint64_t start = now_ns();
 	int rc;
 
 	if (NULL == self) {
 		return RAVE__EINVAL;
 	}
 
-	rc = transform_permute_all(self->transform, &self->code.text);
+	/* The pending layout would just replace whatever we do here */
+	if (self->async.pending) {
+		return RAVE__EBUSY;
+	}
+
+	self->seed = next_seed(self);
+	__atomic_fetch_add(&self->stats.randomizations, 1, __ATOMIC_RELAXED);
+
+	/* Pages get randomized as they are faulted in */
+	if (self->opts.lazy) {
+		return transform_set_seed(self->transform, self->seed);
+	}
+
+	rc = transform_permute_all(self->transform, &self->code->text, self->seed,
+		self->opts.nr_randomize_workers);
+	add_time(self, RAVE_PHASE_PERMUTE, start);
+	return rc;
+}
+
+int rave_randomize_range(rave_handle_t self, uintptr_t lo, uintptr_t hi)
+{
+	struct transform_range range;
+	uint64_t start = now_ns();
+	int rc;
+
+	if (NULL == self || lo > hi) {
+		return RAVE__EINVAL;
+	}
+
+	if (self->async.pending) {
+		return RAVE__EBUSY;
+	}
+
+	range.start = lo + self->reloc_offset;
+	range.end = hi + self->reloc_offset;
+
+	rc = transform_permute_ranges(self->transform, &self->code->text, &range,
+		1, next_seed(self));
+	__atomic_fetch_add(&self->stats.randomizations, 1, __ATOMIC_RELAXED);
+	add_time(self, RAVE_PHASE_PERMUTE, start);
+	return rc;
+}
+
+int rave_randomize_functions(rave_handle_t self, const uintptr_t *addresses,
+	size_t nr)
+{
+	struct transform_range *ranges;
+	uint64_t start = now_ns();
+	int rc;
+
+	if (NULL == self || (NULL == addresses && nr)) {
+		return RAVE__EINVAL;
+	}
+
+	if (self->async.pending) {
+		return RAVE__EBUSY;
+	}
+
+	ranges = rave_malloc(sizeof(*ranges) * max(nr, (size_t)1));
+	if (NULL == ranges) {
+		return RAVE__ENOMEM;
+	}
+
+	/* Any address inside of a function picks it */
+	for (size_t i = 0; i < nr; i++) {
+		ranges[i].start = addresses[i] + self->reloc_offset;
+		ranges[i].end = ranges[i].start + 1;
+	}
+
+	rc = transform_permute_ranges(self->transform, &self->code->text, ranges,
+		nr, next_seed(self));
+	rave_free(ranges);
+	__atomic_fetch_add(&self->stats.randomizations, 1, __ATOMIC_RELAXED);
+	add_time(self, RAVE_PHASE_PERMUTE, start);
 	return rc;
 }
 
+int rave_find_function(rave_handle_t self, uintptr_t address,
+	struct rave_function *out)
+{
+	struct function record;
+	int rc;
+
+	if (NULL == self || NULL == out) {
+		return RAVE__EINVAL;
+	}
+
+	rc = transform_find(self->transform, address + self->reloc_offset,
+		&record);
+	if (rc != RAVE__SUCCESS) {
+		return rc;
+	}
+
+	out->address = record.addr - self->reloc_offset;
+	out->length = record.len;
+	return RAVE__SUCCESS;
+}
+
+int rave_get_stats(rave_handle_t self, struct rave_stats *stats)
+{
+	struct transform_stats ts;
+	int rc;
+
+	if (NULL == self || NULL == stats) {
+		return RAVE__EINVAL;
+	}
+
+	rc = transform_get_stats(self->transform, &ts);
+	if (rc != RAVE__SUCCESS) {
+		return rc;
+	}
+
+	memset(stats, 0, sizeof(*stats));
+	memcpy(stats->rejected, ts.rejected, sizeof(stats->rejected));
+	stats->rejected[RAVE_REJECT_OUTSIDE_TEXT] = self->stats.outside_text;
+	stats->cache_hit = self->stats.cache_hit;
+
+	stats->functions_accepted = ts.accepted;
+	for (int i = 0; i < RAVE_REJECT_MAX; i++) {
+		stats->functions_rejected += stats->rejected[i];
+	}
+	stats->functions_seen = self->stats.cache_hit ? ts.accepted :
+		self->stats.seen;
+
+	stats->prologues = ts.accepted;
+	stats->epilogues = ts.epilogues;
+	stats->bytes_modified = ts.bytes_modified;
+	stats->pages_modified = ts.pages_modified;
+
+	stats->randomizations = __atomic_load_n(&self->stats.randomizations,
+		__ATOMIC_RELAXED);
+	stats->faults = __atomic_load_n(&self->stats.faults, __ATOMIC_RELAXED);
+	stats->fault_pages = __atomic_load_n(&self->stats.fault_pages,
+		__ATOMIC_RELAXED);
+	for (int i = 0; i < RAVE_PHASE_MAX; i++) {
+		stats->phase_ns[i] = __atomic_load_n(&self->stats.phase_ns[i],
+			__ATOMIC_RELAXED);
+	}
+
+	stats->bytes_allocated = rave_bytes_allocated();
+	return RAVE__SUCCESS;
+}
+
+/* Background thread building the next layout. Faults keep being served from
+ * the current layout the whole time. */
+static void *build_layout(void *arg)
+{
+	struct rave_handle *self = arg;
+	struct layout *next;
+	uint64_t start = now_ns();
+	int rc;
+
+	rc = layout_create(self, &next);
+	if (rc == RAVE__SUCCESS) {
+		self->async.next = next;
+		rc = transform_permute_all(self->transform, &next->text,
+			self->async.seed, self->opts.nr_randomize_workers);
+	}
+
+	__atomic_fetch_add(&self->stats.randomizations, 1, __ATOMIC_RELAXED);
+	add_time(self, RAVE_PHASE_PERMUTE, start);
+
+	self->async.rc = rc;
+	__atomic_store_n(&self->async.done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+int rave_randomize_async(rave_handle_t self)
+{
+	if (NULL == self) {
+		return RAVE__EINVAL;
+	}
+
+	/* Lazy layouts are filled in by faults on the current layout, there is
+	 * nothing to build ahead of time */
+	if (self->opts.lazy) {
+		return RAVE__EINVAL;
+	}
+
+	if (self->async.pending) {
+		return RAVE__EBUSY;
+	}
+
+	/* Picked here so the seed sequence doesn't depend on thread timing */
+	self->async.seed = next_seed(self);
+	self->async.next = NULL;
+	self->async.done = 0;
+	self->async.rc = RAVE__SUCCESS;
+
+	if (pthread_create(&self->async.thread, NULL, build_layout, self) != 0) {
+		ERROR("Could not start randomization thread");
+		return RAVE__EFATAL;
+	}
+
+	self->async.pending = self->async.running = 1;
+	return RAVE__SUCCESS;
+}
+
+int rave_randomize_wait(rave_handle_t self)
+{
+	if (NULL == self) {
+		return RAVE__EINVAL;
+	}
+
+	if (!self->async.pending) {
+		return RAVE__ENOENT;
+	}
+
+	async_join(self);
+	return self->async.rc;
+}
+
+int rave_publish(rave_handle_t self)
+{
+	struct layout *old;
+	int rc;
+
+	if (NULL == self) {
+		return RAVE__EINVAL;
+	}
+
+	if (!self->async.pending) {
+		return RAVE__ENOENT;
+	}
+
+	if (!__atomic_load_n(&self->async.done, __ATOMIC_ACQUIRE)) {
+		return RAVE__EBUSY;
+	}
+
+	/* The thread is done, so this doesn't block */
+	async_join(self);
+	self->async.pending = 0;
+
+	rc = self->async.rc;
+	if (rc != RAVE__SUCCESS) {
+		ERROR("Background randomization failed");
+		layout_destroy(self->async.next);
+		self->async.next = NULL;
+		return rc;
+	}
+
+	pthread_mutex_lock(&self->lock);
+
+	old = self->code;
+	__atomic_store_n(&self->code, self->async.next, __ATOMIC_RELEASE);
+	self->seed = self->async.seed;
+	self->async.next = NULL;
+	self->generation++;
+
+	/* Pages pinned from the old layout keep it alive */
+	list_add_tail(&old->l, &self->retired);
+	layout_put_locked(old);
+
+	pthread_mutex_unlock(&self->lock);
+
+	/* Hashes of the old layout only hold for pages never written */
+	transform_invalidate_hashes(self->transform, self->generation);
+
+	DEBUG("Published new layout");
+	return RAVE__SUCCESS;
+}
+
+size_t rave_get_page_hashes(struct rave_handle *self, uint64_t *hashes,
+	size_t nr_hashes, uintptr_t *base)
+{
+	struct layout *layout;
+	uint64_t generation;
+	const unsigned long *dirty;
+	uintptr_t start;
+	size_t nr_pages;
+	int rc;
+
+	if (NULL == self || NULL == base || (NULL == hashes && nr_hashes)) {
+		return 0;
+	}
+
+	dirty = transform_dirty_pages(self->transform, &start, &nr_pages);
+	if (NULL == dirty) {
+		return 0;
+	}
+	*base = start - self->reloc_offset;
+
+	/* A layout published in the meantime has to be picked up instead, its
+	 * hashes are the ones which count */
+	do {
+		pthread_mutex_lock(&self->lock);
+		layout = self->code;
+		layout->refs++;
+		generation = self->generation;
+		pthread_mutex_unlock(&self->lock);
+
+		rc = transform_page_hashes(self->transform, &layout->segment,
+			generation, hashes, nr_hashes);
+
+		pthread_mutex_lock(&self->lock);
+		layout_put_locked(layout);
+		pthread_mutex_unlock(&self->lock);
+	} while (rc == RAVE__EBUSY);
+
+	return rc == RAVE__SUCCESS ? nr_pages : 0;
+}
+
 int rave_relocate(rave_handle_t self, uintptr_t address)
 {
 	if (NULL == self) {
@@ -264,61 +1096,431 @@ int rave_relocate(rave_handle_t self, uintptr_t address)
 	}
 
 	/* Offset from the original address */
-	self->reloc_offset = window_orig(&self->code.segment) - address;
+	self->reloc_offset = window_orig(&current_layout(self)->segment) -
+		address;
 
 	return RAVE__SUCCESS;
 }
 
-void *rave_handle_fault(struct rave_handle *self, uintptr_t address)
+/* How many pages a fault at (relocated) address gets. Like readahead, the
+ * run doubles while the target walks through the code in order, and backs off
+ * when it jumps around, so random faults don't pay for pages they never use. */
+static size_t fault_around(struct rave_handle *self, uintptr_t address)
 {
-	void *page;
-	size_t length;
+	uintptr_t next;
+	size_t window;
 
-	if (NULL == self) {
-		return NULL;
+	if (self->opts.fault_around <= 1) {
+		return 1;
 	}
 
+	next = __atomic_load_n(&self->around.next, __ATOMIC_RELAXED);
+	window = __atomic_load_n(&self->around.window, __ATOMIC_RELAXED);
+
+	/* Landing a little past the last run still counts as going in order */
+	if (address >= next && address - next < window * PAGESZ) {
+		window = min(window * 2, self->opts.fault_around);
+	} else {
+		window = max(window / 2, (size_t)1);
+	}
+
+	__atomic_store_n(&self->around.window, window, __ATOMIC_RELAXED);
+	return window;
+}
+
+/* Whether the whole huge page around (relocated) address can be handed out.
+ * It has to be all segment, and land on a huge page in the target too. */
+static int fault_huge(struct rave_handle *self, struct layout *layout,
+	uintptr_t address)
+{
+	return layout->huge && self->reloc_offset % HPAGESZ == 0 &&
+		window_contains(&layout->segment, HPAGE_DOWN(address)) &&
+		window_contains(&layout->segment,
+			HPAGE_DOWN(address) + HPAGESZ - 1);
+}
+
+/* Find the page in the layout for a (target) address, or with around, the
+ * run of pages fault-around (or the huge page) gives it. Fewer pages are
+ * handed back at the end of the segment. */
+static void *fault_run(struct rave_handle *self, struct layout *layout,
+	uintptr_t address, int around, struct rave_range *run)
+{
+	void *page;
+	size_t length, nr_pages = 1;
+	uint64_t start = now_ns();
+
 	address = PAGE_DOWN(address) + self->reloc_offset;
 
-	if (!window_contains(&self->code.segment, address)) {
+	if (!window_contains(&layout->segment, address)) {
 		return NULL;
 	}
 
+	if (around && fault_huge(self, layout, address)) {
+		address = HPAGE_DOWN(address);
+		nr_pages = HPAGESZ / PAGESZ;
+	} else if (around) {
+		nr_pages = fault_around(self, address);
+	}
+
 	/* If for some reason, the leftover length is less than a page, then we have
 	 * a problem */
-	page = window_view(&self->code.segment, address, &length);
+	page = window_view(&layout->segment, address, &length);
 	if (length < PAGESZ) {
 		ERROR("Not enough memory in code segment for a full page");
 		return NULL;
 	} else if (length % PAGESZ) {
 		WARN("Code segment might be missing data (length mismatch)");
 	}
+	length = min(PAGE_DOWN(length), nr_pages * PAGESZ);
+
+	/* Functions straddling into the run from either side get permuted in
+	 * full, so neighbouring pages stay consistent whenever they come in */
+	if (self->opts.lazy &&
+		transform_permute_range(self->transform, &layout->text, address,
+			address + length) != RAVE__SUCCESS)
+	{
+		ERROR("Could not randomize page @ 0x%"PRIxPTR, address);
+		return NULL;
+	}
+
+	__atomic_store_n(&self->around.next, address + length, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&self->stats.faults, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&self->stats.fault_pages, length / PAGESZ,
+		__ATOMIC_RELAXED);
+	add_time(self, RAVE_PHASE_FAULT, start);
+
+	run->address = address - self->reloc_offset;
+	run->length = length;
+	return page;
+}
+
+static void *fault_page(struct rave_handle *self, struct layout *layout,
+	uintptr_t address)
+{
+	struct rave_range run;
+
+	return fault_run(self, layout, address, 0, &run);
+}
+
+void *rave_handle_fault(struct rave_handle *self, uintptr_t address)
+{
+	if (NULL == self) {
+		return NULL;
+	}
+
+	return fault_page(self, current_layout(self), address);
+}
+
+void *rave_handle_fault_around(struct rave_handle *self, uintptr_t address,
+	struct rave_range *run)
+{
+	if (NULL == self || NULL == run) {
+		return NULL;
+	}
+
+	return fault_run(self, current_layout(self), address, 1, run);
+}
+
+static int compare_runs(const void *a, const void *b)
+{
+	const struct rave_page_run *ra = a, *rb = b;
+
+	return ra->address < rb->address ? -1 : ra->address > rb->address;
+}
+
+/* Where a relocated page is in the layout, or NULL when it isn't there */
+static void *page_data(struct layout *layout, uintptr_t address)
+{
+	void *data;
+	size_t length;
+
+	if (!window_contains(&layout->segment, address)) {
+		return NULL;
+	}
+
+	data = window_view(&layout->segment, address, &length);
+	return length < PAGESZ ? NULL : data;
+}
+
+/* Resolves the batch against layout, and sets served to the number of runs
+ * with data */
+static size_t fault_batch(struct rave_handle *self, struct layout *layout,
+	const uintptr_t *addresses, size_t nr, struct rave_page_run *runs,
+	size_t *served)
+{
+	struct rave_page_run *last = NULL;
+	uintptr_t address;
+	size_t n = 0, pages = 0;
+	void *data;
+	uint64_t start = now_ns();
+
+	/* runs doubles as the space to sort the pages in */
+	for (size_t i = 0; i < nr; i++) {
+		runs[i].address = PAGE_DOWN(addresses[i]);
+	}
+	qsort(runs, nr, sizeof(*runs), compare_runs);
+
+	/* Only ever merges into runs behind the one being read, so it can all
+	 * be done in place */
+	for (size_t i = 0; i < nr; i++) {
+		address = runs[i].address;
+		if (NULL != last && address < last->address + last->length) {
+			continue;
+		}
+
+		data = page_data(layout, address + self->reloc_offset);
+
+		if (NULL != last && address == last->address + last->length &&
+			(NULL == data) == (NULL == last->data))
+		{
+			last->length += PAGESZ;
+			continue;
+		}
+
+		last = &runs[n++];
+		last->address = address;
+		last->data = data;
+		last->length = PAGESZ;
+	}
+
+	/* Same as for a single fault, but functions only have to be permuted
+	 * once per run */
+	for (size_t i = 0; self->opts.lazy && i < n; i++) {
+		address = runs[i].address + self->reloc_offset;
+		if (NULL != runs[i].data &&
+			transform_permute_range(self->transform, &layout->text, address,
+				address + runs[i].length) != RAVE__SUCCESS)
+		{
+			ERROR("Could not randomize pages @ 0x%"PRIxPTR, address);
+			runs[i].data = NULL;
+		}
+	}
+
+	/* Every run is served like a single fault-around fault */
+	*served = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (NULL != runs[i].data) {
+			(*served)++;
+			pages += runs[i].length / PAGESZ;
+		}
+	}
+
+	__atomic_fetch_add(&self->stats.faults, *served, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&self->stats.fault_pages, pages, __ATOMIC_RELAXED);
+	add_time(self, RAVE_PHASE_FAULT, start);
+
+	return n;
+}
+
+size_t rave_handle_faults(struct rave_handle *self, const uintptr_t *addresses,
+	size_t nr, struct rave_page_run *runs)
+{
+	size_t served;
+
+	if (NULL == self || NULL == addresses || NULL == runs) {
+		return 0;
+	}
+
+	return fault_batch(self, current_layout(self), addresses, nr, runs,
+		&served);
+}
+
+/* Same as get_run, but the layout is pinned once for every run handed out */
+size_t rave_get_faults(struct rave_handle *self, const uintptr_t *addresses,
+	size_t nr, struct rave_page_run *runs)
+{
+	struct layout *layout;
+	size_t n, served;
+
+	if (NULL == self || NULL == addresses || NULL == runs) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&self->lock);
+	layout = self->code;
+	layout->refs++;
+	pthread_mutex_unlock(&self->lock);
+
+	n = fault_batch(self, layout, addresses, nr, runs, &served);
+
+	pthread_mutex_lock(&self->lock);
+	layout->refs += served;
+	layout_put_locked(layout);
+	pthread_mutex_unlock(&self->lock);
+
+	return n;
+}
+
+/* Keep the current layout around until the pages are put back */
+static void *get_run(struct rave_handle *self, uintptr_t address,
+	int around, struct rave_range *run)
+{
+	struct layout *layout;
+	void *page;
+
+	pthread_mutex_lock(&self->lock);
+	layout = self->code;
+	layout->refs++;
+	pthread_mutex_unlock(&self->lock);
+
+	page = fault_run(self, layout, address, around, run);
+	if (NULL == page) {
+		pthread_mutex_lock(&self->lock);
+		layout_put_locked(layout);
+		pthread_mutex_unlock(&self->lock);
+	}
 
 	return page;
 }
 
+void *rave_get_page(struct rave_handle *self, uintptr_t address)
+{
+	struct rave_range run;
+
+	if (NULL == self) {
+		return NULL;
+	}
+
+	return get_run(self, address, 0, &run);
+}
+
+void *rave_get_pages(struct rave_handle *self, uintptr_t address,
+	struct rave_range *run)
+{
+	if (NULL == self || NULL == run) {
+		return NULL;
+	}
+
+	return get_run(self, address, 1, run);
+}
+
+static int layout_contains(const struct layout *layout, const void *ptr)
+{
+	return (const char *)ptr >= (const char *)layout->mapping &&
+		(const char *)ptr < (const char *)layout->mapping + layout->length;
+}
+
+void rave_put_page(struct rave_handle *self, void *page)
+{
+	struct layout *layout;
+
+	if (NULL == self || NULL == page) {
+		return;
+	}
+
+	pthread_mutex_lock(&self->lock);
+
+	if (layout_contains(self->code, page)) {
+		layout_put_locked(self->code);
+		goto out;
+	}
+
+	list_for_each_entry(layout, &self->retired, l) {
+		if (layout_contains(layout, page)) {
+			layout_put_locked(layout);
+			goto out;
+		}
+	}
+
+	WARN("Put a page that was never pinned");
+out:
+	pthread_mutex_unlock(&self->lock);
+}
+
+/* Coalesce runs of set bits in a page bitmap. The addresses handed back are
+ * where the target expects the code to be. */
+static size_t page_ranges(struct rave_handle *self, const unsigned long *pages,
+	uintptr_t base, size_t nr_pages, struct rave_range *ranges,
+	size_t nr_ranges)
+{
+	size_t first, last, n = 0;
+
+	first = find_next_bit(pages, nr_pages, 0);
+	while (first < nr_pages) {
+		last = find_next_zero_bit(pages, nr_pages, first);
+
+		if (n < nr_ranges) {
+			ranges[n].address = base + first * PAGESZ - self->reloc_offset;
+			ranges[n].length = (last - first) * PAGESZ;
+		}
+
+		n++;
+		first = find_next_bit(pages, nr_pages, last);
+	}
+
+	return n;
+}
+
+size_t rave_get_dirty_pages(struct rave_handle *self,
+	struct rave_range *ranges, size_t nr_ranges)
+{
+	const unsigned long *dirty;
+	uintptr_t base;
+	size_t nr_pages;
+
+	if (NULL == self) {
+		return 0;
+	}
+
+	dirty = transform_dirty_pages(self->transform, &base, &nr_pages);
+	if (NULL == dirty) {
+		return 0;
+	}
+
+	return page_ranges(self, dirty, base, nr_pages, ranges, nr_ranges);
+}
+
+size_t rave_get_changed_pages(struct rave_handle *self,
+	struct rave_range *ranges, size_t nr_ranges)
+{
+	const unsigned long *changed;
+	uintptr_t base;
+	size_t nr_pages;
+
+	if (NULL == self) {
+		return 0;
+	}
+
+	changed = transform_changed_pages(self->transform, &base, &nr_pages);
+	if (NULL == changed) {
+		return 0;
+	}
+
+	return page_ranges(self, changed, base, nr_pages, ranges, nr_ranges);
+}
+
 void *rave_get_code(struct rave_handle *self, size_t *length)
 {
-	uintptr_t vaddr;
+	struct layout *layout;
 
 	if (NULL == self) {
 		return NULL;
 	}
 
-	vaddr = window_orig(&self->code.segment);
-	return window_view(&self->code.segment, vaddr, length);
+	layout = current_layout(self);
+	return window_view(&layout->segment, window_orig(&layout->segment),
+		length);
+}
+
+uintptr_t rave_get_code_address(struct rave_handle *self)
+{
+	if (NULL == self) {
+		return 0;
+	}
+
+	return window_orig(&current_layout(self)->segment) - self->reloc_offset;
 }
 
 void *rave_get_text(struct rave_handle *self, size_t *length)
 {
-	uintptr_t vaddr;
+	struct layout *layout;
 
 	if (NULL == self) {
 		return NULL;
 	}
 
-	vaddr = window_orig(&self->code.text);
-	return window_view(&self->code.text, vaddr, length);
+	layout = current_layout(self);
+	return window_view(&layout->text, window_orig(&layout->text), length);
 }
 
 size_t rave_get_text_offset(struct rave_handle *self)
@@ -327,5 +1529,5 @@ size_t rave_get_text_offset(struct rave_handle *self)
 		return 0;
 	}
 
-	return window_orig(&self->code.text);
+	return window_orig(&current_layout(self)->text);
 }
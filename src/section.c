@@ -21,7 +21,7 @@ int section_init(struct section *self, Elf *elf, GElf_Shdr *header,
 	return RAVE__SUCCESS;
 }
 
-int section_address(const struct section *self)
+uintptr_t section_address(const struct section *self)
 {
 	return self->header.sh_addr;
 }
@@ -32,6 +32,11 @@ size_t segment_memsz(const struct segment *self)
 	return self->header.p_memsz;
 }
 
+size_t segment_align(const struct segment *self)
+{
+	return self->header.p_align;
+}
+
 int segment_loadable(const struct segment *self)
 {
 	return !!(self->header.p_type & PT_LOAD);
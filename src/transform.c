@@ -1,130 +1,364 @@
 #include <string.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #define X86_64
 #define LINUX
 #include <dr_api.h>
 
 #include "transform.h"
+#include "pushpop.h"
 #include "rave/errno.h"
 #include "memory.h"
 #include "random.h"
+#include "workers.h"
+#include "bitmap.h"
+#include "hash.h"
+#include "arena.h"
+#include "list.h"
 #include "util.h"
 #include "log.h"
 
-#define instr_for_each(cursor, set) \
-	for (cursor = (set)->instrs; cursor; cursor = instr_get_next(cursor))
+/* A run of (address sorted) functions which shares no pages with any other
+ * shard, so shards can be permuted concurrently */
+struct shard {
+	size_t first, last;
+};
+
+/* An analyzed function waiting to be moved into the table */
+struct staged {
+	struct list_head l;
+	struct transformable tf;
+	struct instr_set epilogues[];
+};
+
+/* Every function, sorted by address, as a structure of arrays. Permuting walks
+ * it front to back, which is text order, and lookups only touch the address
+ * arrays. All of the arrays are carved out of the one block. */
+struct function_table {
+	void *block;
+	size_t nr, nr_epilogues;
+
+	uintptr_t *addr;
+
+	/* The furthest any function up to (and including) this one reaches. It
+	 * only ever grows, so it can be binary searched. */
+	uintptr_t *max_end;
+	uint32_t *len;
+
+	struct instr_set *prologue;
+	uint8_t *nr_regs;
+	uint8_t (*regs)[TRANSFORM_MAX_REGS];
+
+	/* Function i's epilogues are [first_epilogue[i], first_epilogue[i + 1]) */
+	uint32_t *first_epilogue;
+	struct instr_set *epilogues;
+
+	/* The layout epoch each function was last permuted into */
+	uint32_t *applied;
+};
 
 /* Main transform handler */
 struct transform {
-	// TODO: turn into a hashlist
-	struct list_head transformables;
+	/* Functions which still have to be moved into the table. They live in
+	 * the staging arena, which goes away all at once when they are. */
+	struct list_head staged;
+	size_t nr_staged, nr_staged_epilogues;
+	struct arena staging;
+
+	struct function_table table;
+
+	/* How the table is split up for parallel permutes */
+	struct shard *shards;
+	size_t nr_shards, shard_workers;
+
+	/* The layout functions are being permuted into, bumped every time there
+	 * is a new seed. A function is only up to date once its applied epoch
+	 * matches. */
+	uint64_t seed;
+	uint32_t epoch;
+
+	/* Serializes permutes, faults can come in from anywhere */
+	pthread_mutex_t lock;
+
+	/* Pages of the code segment which have been written (even if with the
+	 * same bytes). One bit per page, starting at the (page aligned) segment
+	 * address. */
+	uintptr_t base;
+	size_t nr_pages;
+	unsigned long *dirty;
+
+	/* Same, but only the pages written since the last new layout (or partial
+	 * re-randomization) */
+	unsigned long *changed;
+
+	/* Content hash of every page, and the pages written since theirs was
+	 * taken. The hashes are of the segment from generation hash_generation. */
+	uint64_t *hashes;
+	unsigned long *unhashed;
+	uint64_t hash_generation;
+
+	/* Functions the analysis turned down, by reason, and bytes of code
+	 * written. Updated from workers, so only touched atomically. */
+	uint64_t rejected[RAVE_REJECT_MAX];
+	uint64_t bytes_modified;
 };
 
-static struct instr_set * instr_set_create(void)
+static void reject(struct transform *self, enum rave_reject reason)
 {
-	return rave_malloc(sizeof(struct instr_set));
+	__atomic_fetch_add(&self->rejected[reason], 1, __ATOMIC_RELAXED);
 }
 
-static void instr_set_destroy(struct instr_set *self)
+/* Encoded length of pushing (or popping) all of the registers */
+static size_t regs_length(const uint8_t *regs, size_t nr_regs)
 {
-	if (NULL != self) {
-		rave_free(self);
+	size_t length = 0;
+
+	for (size_t i = 0; i < nr_regs; i++) {
+		length += pushpop_length(regs[i]);
 	}
+
+	return length;
 }
 
-static struct transformable * transformable_create(void)
+static int set_valid(const struct function *record,
+	const struct instr_set *set, size_t length)
 {
-	return rave_malloc(sizeof(struct transformable));
+	return set->length == length &&
+		(uint64_t)set->offset + set->length <= record->len;
 }
 
-static void transformable_destroy(struct transformable *self)
+/* Stage a function out of an analysis. Whoever did the analysis, the sets
+ * have to be exactly what pushing and popping the registers encodes to, since
+ * that is what permuting will write. */
+static int stage_function(struct arena *arena, const struct function *record,
+	const uint8_t *regs, size_t nr_regs, const struct instr_set *prologue,
+	const struct instr_set *epilogues, size_t nr_epilogues,
+	struct staged **out)
 {
-	if (NULL != self) {
-		rave_free(self);
+	struct staged *staged;
+	size_t length;
+
+	if (nr_regs < 2 || nr_regs > TRANSFORM_MAX_REGS || nr_epilogues == 0 ||
+		nr_epilogues > UINT32_MAX || record->len > UINT32_MAX)
+	{
+		return RAVE__ETRANSFORM;
 	}
-}
 
-static void instr_set_init(struct instr_set *self, uintptr_t orig)
-{
-	if (NULL == self) {
-		return;
+	for (size_t i = 0; i < nr_regs; i++) {
+		if (regs[i] >= 16 || regs[i] == DR_REG_RBP - DR_REG_RAX) {
+			return RAVE__ETRANSFORM;
+		}
+	}
+
+	length = regs_length(regs, nr_regs);
+	if (!set_valid(record, prologue, length)) {
+		return RAVE__ETRANSFORM;
+	}
+
+	for (size_t i = 0; i < nr_epilogues; i++) {
+		if (!set_valid(record, &epilogues[i], length)) {
+			return RAVE__ETRANSFORM;
+		}
+	}
+
+	staged = arena_alloc(arena, sizeof(*staged) +
+		nr_epilogues * sizeof(*epilogues));
+	if (NULL == staged) {
+		return RAVE__ENOMEM;
 	}
 
-	self->start = self->end = orig;
-	self->nr_instrs = 0;
-	self->instrs = NULL;
+	memset(&staged->tf, 0, sizeof(staged->tf));
+	memcpy(&staged->tf.record, record, sizeof(struct function));
+	staged->tf.prologue = *prologue;
+	staged->tf.nr_regs = nr_regs;
+	memcpy(staged->tf.regs, regs, nr_regs);
+	memcpy(staged->epilogues, epilogues, nr_epilogues * sizeof(*epilogues));
+	staged->tf.epilogues = staged->epilogues;
+	staged->tf.nr_epilogues = nr_epilogues;
+
+	*out = staged;
+	return RAVE__SUCCESS;
 }
 
-static void instr_set_close(struct instr_set *self)
+static void stage(struct transform *self, struct staged *staged)
 {
-	instr_t * instr;
+	list_add_tail(&staged->l, &self->staged);
+	self->nr_staged++;
+	self->nr_staged_epilogues += staged->tf.nr_epilogues;
+}
 
-	if (NULL == self) {
-		return;
-	}
+/* Point the table's arrays into block, or with no block, just work out how
+ * big it has to be. Every array starts 8 byte aligned. */
+static size_t table_carve(struct function_table *self, char *block, size_t nr,
+	size_t nr_epilogues)
+{
+	size_t offset = 0;
+
+#define CARVE(field, count) do { \
+	self->field = block ? (void *)(block + offset) : NULL; \
+	offset += (sizeof(*self->field) * (count) + 7) & ~(size_t)7; \
+} while (0)
+
+	CARVE(addr, nr);
+	CARVE(max_end, nr);
+	CARVE(len, nr);
+	CARVE(prologue, nr);
+	CARVE(nr_regs, nr);
+	CARVE(regs, nr);
+	CARVE(first_epilogue, nr + 1);
+	CARVE(epilogues, nr_epilogues);
+	CARVE(applied, nr);
+
+#undef CARVE
+
+	return offset;
+}
 
-	for (instr = self->instrs;
-		instr;
-		instr = instr_get_next(instr))
-	{
-		instr_destroy(GLOBAL_DCONTEXT, instr);
-	}
+static void table_close(struct function_table *self)
+{
+	rave_free(self->block);
+	memset(self, 0, sizeof(*self));
+}
 
-	self->instrs = NULL;
+/* A view of the i-th function in the table */
+static void table_row(const struct function_table *self, size_t i,
+	struct transformable *tf)
+{
+	tf->record.addr = self->addr[i];
+	tf->record.len = self->len[i];
+	tf->prologue = self->prologue[i];
+	tf->nr_regs = self->nr_regs[i];
+	memcpy(tf->regs, self->regs[i], sizeof(tf->regs));
+	tf->epilogues = &self->epilogues[self->first_epilogue[i]];
+	tf->nr_epilogues = self->first_epilogue[i + 1] - self->first_epilogue[i];
 }
 
-static void transformable_init(struct transformable *self,
-	const struct function *record)
+static int compare_rows(const void *a, const void *b)
 {
-	if (NULL == self) {
-		return;
+	const struct transformable *ta = a, *tb = b;
+
+	if (ta->record.addr != tb->record.addr) {
+		return ta->record.addr < tb->record.addr ? -1 : 1;
 	}
 
-	memcpy(&self->record, record, sizeof(struct function));
-	instr_set_init(&self->prologue, record->addr);
-	INIT_LIST_HEAD(&self->epilogues);
-	self->order = NULL;
+	return 0;
 }
 
-static void transformable_close(struct transformable *self)
+/* Move everything staged into the table. The table is rebuilt from scratch,
+ * so this is meant to happen once, after all the functions have been added. */
+static int build_table(struct transform *self)
 {
-	struct list_head *pos, *n;
-	struct instr_set *set;
+	struct function_table table;
+	struct transformable *rows;
+	struct staged *staged;
+	size_t nr, nr_epilogues, size, i = 0;
+	uint32_t e = 0;
+	uintptr_t end = 0;
+
+	if (0 == self->nr_staged) {
+		return RAVE__SUCCESS;
+	}
 
-	if (NULL == self) {
-		return;
+	nr = self->table.nr + self->nr_staged;
+	nr_epilogues = self->table.nr_epilogues + self->nr_staged_epilogues;
+	if (nr_epilogues > UINT32_MAX) {
+		return RAVE__ETRANSFORM;
 	}
 
-	instr_set_close(&self->prologue);
+	rows = rave_malloc(sizeof(*rows) * nr);
+	if (NULL == rows) {
+		return RAVE__ENOMEM;
+	}
 
-	list_for_each_safe(pos, n, &self->epilogues) {
-		list_del(pos);
-		set = list_entry(pos, struct instr_set, l);
-		instr_set_close(set);
-		instr_set_destroy(set);
+	for (; i < self->table.nr; i++) {
+		table_row(&self->table, i, &rows[i]);
 	}
 
-	if (self->order) {
-		rave_free(self->order);
+	list_for_each_entry(staged, &self->staged, l) {
+		rows[i++] = staged->tf;
 	}
+
+	qsort(rows, nr, sizeof(*rows), compare_rows);
+
+	memset(&table, 0, sizeof(table));
+	size = table_carve(&table, NULL, nr, nr_epilogues);
+	table.block = rave_malloc(size);
+	if (NULL == table.block) {
+		rave_free(rows);
+		return RAVE__ENOMEM;
+	}
+	table_carve(&table, table.block, nr, nr_epilogues);
+	table.nr = nr;
+	table.nr_epilogues = nr_epilogues;
+
+	for (i = 0; i < nr; i++) {
+		end = max(end, rows[i].record.addr + rows[i].record.len);
+
+		table.addr[i] = rows[i].record.addr;
+		table.max_end[i] = end;
+		table.len[i] = rows[i].record.len;
+		table.prologue[i] = rows[i].prologue;
+		table.nr_regs[i] = rows[i].nr_regs;
+		memcpy(table.regs[i], rows[i].regs, sizeof(table.regs[i]));
+		table.first_epilogue[i] = e;
+		memcpy(&table.epilogues[e], rows[i].epilogues,
+			rows[i].nr_epilogues * sizeof(*table.epilogues));
+		e += rows[i].nr_epilogues;
+
+		/* Nothing has been permuted into the current layout */
+		table.applied[i] = 0;
+	}
+	table.first_epilogue[nr] = e;
+
+	rave_free(rows);
+
+	table_close(&self->table);
+	self->table = table;
+
+	arena_close(&self->staging);
+	INIT_LIST_HEAD(&self->staged);
+	self->nr_staged = self->nr_staged_epilogues = 0;
+
+	/* Shards have to be redone for the new table */
+	rave_free(self->shards);
+	self->shards = NULL;
+	self->nr_shards = self->shard_workers = 0;
+
+	DEBUG("Function table has %zu functions in %zu bytes (%zu per function)",
+		nr, size, size / nr);
+
+	return RAVE__SUCCESS;
 }
 
 struct transform * transform_create(void)
 {
-	return rave_malloc(sizeof(struct transform));
+	struct transform *self;
+
+	/* Closing has to be safe even if init never happened */
+	self = rave_calloc(1, sizeof(struct transform));
+	if (NULL != self) {
+		INIT_LIST_HEAD(&self->staged);
+		arena_init(&self->staging);
+		pthread_mutex_init(&self->lock, NULL);
+	}
+
+	return self;
 }
 
 void transform_destroy(struct transform *self)
 {
 	if (NULL != self) {
+		pthread_mutex_destroy(&self->lock);
 		rave_free(self);
 	}
 }
 
-int transform_init(struct transform *self)
+int transform_init(struct transform *self, struct window *segment)
 {
-	if (NULL == self) {
+	size_t length;
+
+	if (NULL == self || NULL == segment) {
 		return RAVE__EINVAL;
 	}
 
@@ -132,26 +366,186 @@ int transform_init(struct transform *self)
 		return RAVE__ETRANSFORM;
 	}
 
-	INIT_LIST_HEAD(&self->transformables);
+	INIT_LIST_HEAD(&self->staged);
+	self->nr_staged = self->nr_staged_epilogues = 0;
+	arena_init(&self->staging);
+	memset(&self->table, 0, sizeof(self->table));
+	self->shards = NULL;
+	self->nr_shards = self->shard_workers = 0;
+	self->seed = 0;
+	self->epoch = 0;
+	memset(self->rejected, 0, sizeof(self->rejected));
+	self->bytes_modified = 0;
+
+	window_get(segment, &length);
+	self->base = PAGE_DOWN(window_orig(segment));
+	self->nr_pages = PAGE_UP(window_orig(segment) + length - self->base) /
+		PAGESZ;
+	self->dirty = rave_calloc(BITS_TO_LONGS(self->nr_pages),
+		sizeof(unsigned long));
+	self->changed = rave_calloc(BITS_TO_LONGS(self->nr_pages),
+		sizeof(unsigned long));
+	self->hashes = rave_calloc(self->nr_pages, sizeof(uint64_t));
+	self->unhashed = rave_calloc(BITS_TO_LONGS(self->nr_pages),
+		sizeof(unsigned long));
+	if (NULL == self->dirty || NULL == self->changed ||
+		NULL == self->hashes || NULL == self->unhashed)
+	{
+		return RAVE__ENOMEM;
+	}
+
+	/* Nothing is hashed until someone asks */
+	bitmap_set(self->unhashed, 0, self->nr_pages);
+	self->hash_generation = 0;
 
 	return RAVE__SUCCESS;
 }
 
 int transform_close(struct transform *self)
 {
-	struct list_head *pos, *n;
-	struct transformable *tf;
+	if (NULL == self) {
+		return RAVE__EINVAL;
+	}
+
+	arena_close(&self->staging);
+	INIT_LIST_HEAD(&self->staged);
+	self->nr_staged = self->nr_staged_epilogues = 0;
+	table_close(&self->table);
+
+	rave_free(self->dirty);
+	self->dirty = NULL;
+	rave_free(self->changed);
+	self->changed = NULL;
+	rave_free(self->hashes);
+	self->hashes = NULL;
+	rave_free(self->unhashed);
+	self->unhashed = NULL;
+	rave_free(self->shards);
+	self->shards = NULL;
+	self->nr_shards = self->shard_workers = 0;
 
+	return RAVE__SUCCESS;
+}
+
+const unsigned long *transform_dirty_pages(struct transform *self,
+	uintptr_t *base, size_t *nr_pages)
+{
 	if (NULL == self) {
+		return NULL;
+	}
+
+	*base = self->base;
+	*nr_pages = self->nr_pages;
+	return self->dirty;
+}
+
+const unsigned long *transform_changed_pages(struct transform *self,
+	uintptr_t *base, size_t *nr_pages)
+{
+	if (NULL == self) {
+		return NULL;
+	}
+
+	*base = self->base;
+	*nr_pages = self->nr_pages;
+	return self->changed;
+}
+
+/* Record that the bytes for [start, end) have been rewritten */
+static void mark_dirty(struct transform *self, uintptr_t start, uintptr_t end)
+{
+	size_t first, last;
+
+	if (start >= end || start < self->base) {
+		return;
+	}
+
+	first = (start - self->base) / PAGESZ;
+	last = (end - 1 - self->base) / PAGESZ;
+	if (last >= self->nr_pages) {
+		return;
+	}
+
+	/* Shards never share a page, but they can share a bitmap word */
+	for (size_t page = first; page <= last; page++) {
+		set_bit_atomic(page, self->dirty);
+		set_bit_atomic(page, self->changed);
+		set_bit_atomic(page, self->unhashed);
+	}
+}
+
+/* The first and last pages can reach outside of the segment, those parts
+ * hash as zeros */
+static uint64_t hash_segment_page(struct window *segment, uintptr_t address)
+{
+	uint8_t bounce[PAGESZ];
+	uintptr_t orig = window_orig(segment), lo, hi;
+	size_t length = 0;
+	void *data;
+
+	data = window_get(segment, &length);
+	if (address >= orig && address + PAGESZ <= orig + length) {
+		return hash_page(OFFSET(data, address - orig));
+	}
+
+	memset(bounce, 0, sizeof(bounce));
+	lo = max(address, orig);
+	hi = min(address + PAGESZ, orig + length);
+	if (lo < hi) {
+		memcpy(bounce + (lo - address), OFFSET(data, lo - orig), hi - lo);
+	}
+
+	return hash_page(bounce);
+}
+
+int transform_page_hashes(struct transform *self, struct window *segment,
+	uint64_t generation, uint64_t *hashes, size_t nr)
+{
+	size_t page;
+	int rc = RAVE__SUCCESS;
+
+	if (NULL == self || NULL == segment || (NULL == hashes && nr)) {
 		return RAVE__EINVAL;
 	}
 
-	list_for_each_safe(pos, n, &self->transformables) {
-		list_del(pos);
-		tf = list_entry(pos, struct transformable, l);
-		transformable_close(tf);
+	/* Nothing gets written while this is held */
+	pthread_mutex_lock(&self->lock);
+
+	if (generation != self->hash_generation) {
+		rc = RAVE__EBUSY;
+		goto out;
 	}
 
+	for_each_set_bit(page, self->unhashed, self->nr_pages) {
+		self->hashes[page] = hash_segment_page(segment,
+			self->base + page * PAGESZ);
+		clear_bit(page, self->unhashed);
+	}
+
+	if (nr) {
+		memcpy(hashes, self->hashes,
+			min(nr, self->nr_pages) * sizeof(*hashes));
+	}
+
+out:
+	pthread_mutex_unlock(&self->lock);
+	return rc;
+}
+
+int transform_invalidate_hashes(struct transform *self, uint64_t generation)
+{
+	if (NULL == self) {
+		return RAVE__EINVAL;
+	}
+
+	pthread_mutex_lock(&self->lock);
+
+	for (size_t i = 0; i < BITS_TO_LONGS(self->nr_pages); i++) {
+		self->unhashed[i] |= self->dirty[i];
+	}
+	self->hash_generation = generation;
+
+	pthread_mutex_unlock(&self->lock);
 	return RAVE__SUCCESS;
 }
 
@@ -161,96 +555,102 @@ int transform_close(struct transform *self)
  * mov %rsp,%rbp
  * push ...
  *
- * I just grab pushes (aside from rbp)
+ * I just grab pushes (aside from rbp). Returns the pushed register, or
+ * DR_REG_NULL if the instruction doesn't belong in the set.
  * */
-static int test_instr_prologue(instr_t *instr)
+static reg_id_t test_instr_prologue(instr_t *instr)
 {
-	int opcode = instr_get_opcode(instr);
+	opnd_t opnd;
 
-	if (opcode != OP_push) {
-		return 0;
+	if (instr_get_opcode(instr) != OP_push) {
+		return DR_REG_NULL;
+	}
+
+	opnd = instr_get_src(instr, 0);
+	if (!opnd_is_reg(opnd)) {
+		return DR_REG_NULL;
 	}
 
 	/* We don't want to mess with rbp */
-	if (opnd_get_reg(instr_get_src(instr, 0)) == DR_REG_RBP) {
-		return 0;
+	if (opnd_get_reg(opnd) == DR_REG_RBP) {
+		return DR_REG_NULL;
 	}
 
-	return 1;
+	return opnd_get_reg(opnd);
 }
 
 /* Test for instructions that could be in the epilogue */
-static int test_instr_epilogue(instr_t *instr)
+static reg_id_t test_instr_epilogue(instr_t *instr)
 {
-	int opcode = instr_get_opcode(instr);
+	opnd_t opnd;
 
-	if (opcode != OP_pop) {
-		return 0;
+	if (instr_get_opcode(instr) != OP_pop) {
+		return DR_REG_NULL;
+	}
+
+	opnd = instr_get_dst(instr, 0);
+	if (!opnd_is_reg(opnd)) {
+		return DR_REG_NULL;
 	}
 
 	/* We don't want to mess with rbp */
-	if (opnd_get_reg(instr_get_dst(instr, 0)) == DR_REG_RBP) {
-		return 0;
+	if (opnd_get_reg(opnd) == DR_REG_RBP) {
+		return DR_REG_NULL;
 	}
 
-	return 1;
+	return opnd_get_reg(opnd);
 }
 
+/* A set of instructions as it is being decoded. Only the registers are kept,
+ * the instructions themselves are thrown away as soon as they are looked at. */
+struct candidate {
+	uintptr_t start, end;
+	size_t nr_instrs;
+	uint8_t regs[TRANSFORM_MAX_REGS];
+
+	/* Set if any instruction can't be reproduced from its register alone
+	 * (e.g. redundant prefixes), or if there are too many of them */
+	int bad;
+};
+
 /* takes a callback to a function which tests an instruction for come condition
- * which determines if it stays in the set or not. */
-static int next_set(byte **walk, byte *max, uintptr_t *orig,
-	struct instr_set *set, int (*test_instr)(instr_t *instr))
+ * which determines if it stays in the set or not. The one instr is reused for
+ * every instruction decoded. */
+static int next_set(instr_t *instr, byte **walk, byte *max, uintptr_t *orig,
+	struct candidate *set, reg_id_t (*test_instr)(instr_t *instr))
 {
-	instr_t *instr = NULL, *pinstr = NULL;
+	reg_id_t reg;
 	int instr_len;
-	int ret;
-
-	/* Alloc & init the instr */
-	instr = instr_create(GLOBAL_DCONTEXT);
-	if (!instr) {
-		return RAVE__ENOMEM;
-	}
 
-	instr_set_init(set, *orig);
+	set->start = set->end = *orig;
+	set->nr_instrs = 0;
+	set->bad = 0;
 
 	while (*walk < max) {
+		instr_reuse(GLOBAL_DCONTEXT, instr);
 		*walk = decode_from_copy(GLOBAL_DCONTEXT, *walk, PTR(*orig), instr);
-		instr_len = instr_length(GLOBAL_DCONTEXT, instr);
-
 		if (NULL == *walk) {
 			ERROR("Invalid instruction");
-			ret = RAVE__ETRANSFORM;
-			goto err;
+			return RAVE__ETRANSFORM;
 		}
 
+		instr_len = instr_length(GLOBAL_DCONTEXT, instr);
 		*orig += instr_len;
 
 		/* Test if we want to keep this instruction in the current set */
-		if (NULL == test_instr || test_instr(instr)) {
-			set->nr_instrs++;
-			set->end = *orig;
-
-			/* dr instructions already have next/prev ptrs so we gonna use
-			 * those. */
-			if (NULL == set->instrs) {
-				set->instrs = instr;
+		reg = test_instr(instr);
+		if (reg != DR_REG_NULL) {
+			if (reg < DR_REG_RAX || reg > DR_REG_R15 ||
+				set->nr_instrs == TRANSFORM_MAX_REGS ||
+				(size_t)instr_len != pushpop_length(reg - DR_REG_RAX))
+			{
+				set->bad = 1;
 			} else {
-				instr_set_prev(instr, pinstr);
-				instr_set_next(pinstr, instr);
-			}
-
-			/* Allocate raw bits separately (so we don't mangle the backing
-			 * store of instruction data) */
-			instr_allocate_raw_bits(GLOBAL_DCONTEXT, instr, instr_len);
-			pinstr = instr;
-
-			/* Allocate new instr */
-			instr = instr_create(GLOBAL_DCONTEXT);
-			if (NULL == instr) {
-				ret = RAVE__ENOMEM;
-				goto err;
+				set->regs[set->nr_instrs] = reg - DR_REG_RAX;
 			}
 
+			set->nr_instrs++;
+			set->end = *orig;
 			continue;
 		}
 
@@ -260,44 +660,20 @@ static int next_set(byte **walk, byte *max, uintptr_t *orig,
 		}
 
 		set->start = set->end = *orig;
-		instr_reuse(GLOBAL_DCONTEXT, instr);
 	}
 
-	instr_destroy(GLOBAL_DCONTEXT, instr);
 	return RAVE__SUCCESS;
-err:
-	if (instr) {
-		instr_destroy(GLOBAL_DCONTEXT, instr);
-	}
-
-	instr_set_close(set);
-	return ret;
 }
 
-static int is_epilogue(const struct instr_set *pro, const struct instr_set *epi)
+/* Does the candidate pop exactly what the prologue pushed, in reverse? */
+static int is_epilogue(const struct candidate *pro, const struct candidate *epi)
 {
-	instr_t *iter;
-	reg_id_t regs[pro->nr_instrs], *reg = regs;
-
 	if (pro->nr_instrs != epi->nr_instrs) {
 		return 0;
 	}
 
-	/* Check the order */
-	for (iter = pro->instrs;
-		iter;
-		iter = instr_get_next(iter), reg++)
-	{
-		*reg = opnd_get_reg(instr_get_src(iter, 0));
-	}
-
-	reg--;
-
-	for (iter = epi->instrs;
-		iter;
-		iter = instr_get_next(iter), reg--)
-	{
-		if (*reg != opnd_get_reg(instr_get_dst(iter, 0))) {
+	for (size_t i = 0; i < pro->nr_instrs; i++) {
+		if (pro->regs[i] != epi->regs[epi->nr_instrs - 1 - i]) {
 			DEBUG("Epilogue doesn't match prologue order");
 			return 0;
 		}
@@ -306,234 +682,488 @@ static int is_epilogue(const struct instr_set *pro, const struct instr_set *epi)
 	return 1;
 }
 
-/* This function populates the fields of the given transformable given a
- * function record and instruction bytes */
-int transform_add_function(transform_t self, const struct function *record,
-	void *bytes)
+UNUSED
+static const char *reg_names[16] = {
+	"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+	"r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+};
+
+static struct instr_set candidate_set(const struct function *record,
+	const struct candidate *set)
+{
+	struct instr_set packed = {
+		.offset = set->start - record->addr,
+		.length = set->end - set->start,
+	};
+
+	return packed;
+}
+
+/* This function stages a new function given a function record and
+ * instruction bytes. Nothing shared is touched, so functions can be analyzed
+ * concurrently. Nothing DynamoRIO allocates outlives the call. */
+static int analyze_function(struct arena *arena, const struct function *record,
+	void *bytes, struct staged **out, enum rave_reject *reason)
 {
 	byte *walk = bytes,
 		 *end = OFFSET(walk, record->len);
 	uintptr_t orig = record->addr;
-	struct transformable *tf;
-	struct instr_set *set = NULL;
+	struct candidate prologue, set;
+	struct instr_set pro, *epilogues = NULL, *tmp;
+	size_t nr_epilogues = 0, cap = 0;
+	instr_t *instr;
 	int rc, ret;
 
-	tf = transformable_create();
-	if (NULL == tf) {
+	instr = instr_create(GLOBAL_DCONTEXT);
+	if (NULL == instr) {
 		return RAVE__ENOMEM;
 	}
-	transformable_init(tf, record);
 
 	/* First, we need to find the prologue (if there is one we can permute) */
-	rc = next_set(&walk, end, &orig, &tf->prologue, test_instr_prologue);
+	rc = next_set(instr, &walk, end, &orig, &prologue, test_instr_prologue);
 	if (rc != RAVE__SUCCESS) {
 		ERROR("error while finding function prologue");
-		return rc;
+		*reason = RAVE_REJECT_DECODE;
+		ret = rc;
+		goto out;
 	}
 
 	/* If there was no prologue (or if it was too small), then we can't
 	 * transform this function */
-	if (tf->prologue.nr_instrs < 2) {
+	if (prologue.nr_instrs < 2 || prologue.bad) {
 		DEBUG("Function has no randomizable prologue");
+		*reason = RAVE_REJECT_NO_PROLOGUE;
 		ret = RAVE__ETRANSFORM;
-		goto err;
-	}
-
-	/* Allocate a table for determining slot order */
-	tf->order = rave_malloc(sizeof(*tf->order) * tf->prologue.nr_instrs);
-	if (NULL == tf->order) {
-		ret = RAVE__ENOMEM;
-		goto err;
-	}
-
-	for (size_t i = 0; i < tf->prologue.nr_instrs; i++) {
-		tf->order[i] = i;
-	}
-
-	/* Allocate instruction set to iterate over remaining sets */
-	set = instr_set_create();
-	if (NULL == set) {
-		ret = RAVE__ENOMEM;
-		goto err;
+		goto out;
 	}
 
 	/* Now, we find any other instruction sets that mirror the prologue (i.e.
 	 * find any epilogues in the function) */
 	while (walk < end) {
-		rc = next_set(&walk, end, &orig, set, test_instr_epilogue);
+		rc = next_set(instr, &walk, end, &orig, &set, test_instr_epilogue);
 		if (rc != RAVE__SUCCESS) {
 			ERROR("error while finding function next instruction set");
+			*reason = RAVE_REJECT_DECODE;
 			ret = rc;
-			goto err;
+			goto out;
 		}
 
-		orig += set->end - set->start;
+		/* An epilogue we can't rewrite would restore registers in the wrong
+		 * order once the prologue is permuted, so give up on the function */
+		if (set.bad && set.nr_instrs == prologue.nr_instrs) {
+			DEBUG("Function has a non-canonical epilogue candidate");
+			*reason = RAVE_REJECT_BAD_EPILOGUE;
+			ret = RAVE__ETRANSFORM;
+			goto out;
+		}
 
 		/* Now, we need to check if this candidate is truly an epilogue */
-		if (is_epilogue(&tf->prologue, set)) {
-			/* Spin off */
-			DEBUG("Found matching epilogue @ 0x%"PRIxPTR, set->start);
-			list_add_tail(&set->l, &tf->epilogues);
-
-			set = instr_set_create();
-			if (NULL == set) {
-				ret = RAVE__ENOMEM;
-				goto err;
+		if (!set.bad && is_epilogue(&prologue, &set)) {
+			DEBUG("Found matching epilogue @ 0x%"PRIxPTR, set.start);
+
+			if (nr_epilogues == cap) {
+				cap = cap ? cap * 2 : 4;
+				tmp = rave_realloc(epilogues, cap * sizeof(*epilogues));
+				if (NULL == tmp) {
+					ret = RAVE__ENOMEM;
+					goto out;
+				}
+				epilogues = tmp;
 			}
 
-			continue;
+			epilogues[nr_epilogues++] = candidate_set(record, &set);
 		}
-
-		instr_set_close(set);
 	}
 
-	instr_set_destroy(set);
-	set = NULL;
-
 	/* There should be no unnacounted for bytes in this function */
 	if (walk != end) {
 		ERROR("Function size not true");
+		*reason = RAVE_REJECT_SIZE;
 		ret = RAVE__ETRANSFORM;
-		goto err;
+		goto out;
 	}
 
-	if (list_empty(&tf->epilogues)) {
+	if (0 == nr_epilogues) {
 		ERROR("Found no matching epilogues");
+		*reason = RAVE_REJECT_NO_EPILOGUE;
 		ret = RAVE__ETRANSFORM;
-		goto err;
+		goto out;
 	}
 
-	DEBUG_BLOCK(
-		instr_t *__instr;
-		struct instr_set *__set;
+	pro = candidate_set(record, &prologue);
+	ret = stage_function(arena, record, prologue.regs, prologue.nr_instrs,
+		&pro, epilogues, nr_epilogues, out);
+	if (ret != RAVE__SUCCESS) {
+		*reason = RAVE_REJECT_INVALID;
+		goto out;
+	}
 
-		DEBUG("");
-		fprintf(stderr, "\tAnalysis of function @ 0x%"PRIxPTR", size = %zu\n",
+	DEBUG_BLOCK(
+		DEBUG("Analysis of function @ 0x%"PRIxPTR", size = %zu",
 			record->addr, record->len);
-		fprintf(stderr, "\tHas prologue 0x%"PRIxPTR" - 0x%"PRIxPTR" (%zu instructions)\n",
-			tf->prologue.start, tf->prologue.end, tf->prologue.nr_instrs);
+		DEBUG("Has prologue 0x%"PRIxPTR" - 0x%"PRIxPTR" (%zu instructions)",
+			prologue.start, prologue.end, prologue.nr_instrs);
 
-		for (__instr = tf->prologue.instrs;
-			__instr;
-			__instr = instr_get_next(__instr))
-		{
-			fprintf(stderr, "\t\t");
-			instr_disassemble(GLOBAL_DCONTEXT, __instr, STDERR);
-			fprintf(stderr, "\n");
+		for (size_t __i = 0; __i < prologue.nr_instrs; __i++) {
+			DEBUG("\tpush %%%s", reg_names[prologue.regs[__i]]);
 		}
 
-		fprintf(stderr, "\tMatching epilogues at:\n");
-		list_for_each_entry(__set, &tf->epilogues, l) {
-			fprintf(stderr, "\t\t0x%"PRIxPTR"\n", __set->start);
+		for (size_t __i = 0; __i < nr_epilogues; __i++) {
+			DEBUG("Matching epilogue at 0x%"PRIxPTR,
+				record->addr + epilogues[__i].offset);
 		}
-	)
+	);
 
-	list_add_tail(&tf->l, &self->transformables);
-	return RAVE__SUCCESS;
-err:
-	instr_set_close(set);
-	instr_set_destroy(set);
-	transformable_close(tf);
-	transformable_destroy(tf);
+out:
+	rave_free(epilogues);
+	instr_destroy(GLOBAL_DCONTEXT, instr);
 	return ret;
 }
 
-UNUSED
-static int instr_set_encode(const struct instr_set *set, byte *target)
+/* Functions are handed out to workers in batches to keep the shared counter
+ * from bouncing around */
+#define ANALYSIS_BATCH 64
+
+struct analysis {
+	struct transform *self;
+	struct window *text;
+	const struct function *records;
+	size_t nr;
+
+	/* One slot per record, so results come out in record order no matter
+	 * which worker analyzed them. Each worker allocates out of its own
+	 * arena. */
+	struct staged **results;
+	struct arena *arenas;
+
+	size_t next;
+	int rc;
+};
+
+static void analysis_worker(void *arg, size_t id)
 {
-	instr_t *instr;
-	uintptr_t orig;
-	byte *walk = target, *prev;
-
-	orig = set->start;
-	instr_for_each(instr, set) {
-		prev = walk;
-		walk = instr_encode_to_copy(GLOBAL_DCONTEXT, instr, walk, PTR(orig));
-		if (NULL == walk) {
-			ERROR("Could not encode instr");
-			return RAVE__ETRANSFORM;
+	struct analysis *job = arg;
+	const struct function *record;
+	enum rave_reject reason;
+	size_t first, last;
+	int rc;
+
+	while (RAVE__SUCCESS == __atomic_load_n(&job->rc, __ATOMIC_RELAXED)) {
+		first = __atomic_fetch_add(&job->next, ANALYSIS_BATCH,
+			__ATOMIC_RELAXED);
+		if (first >= job->nr) {
+			break;
 		}
 
-		orig += walk - prev;
-		if (orig > set->end) {
-			WARN("Expected fewer instructions during encode");
-			return RAVE__ETRANSFORM;
+		last = min(first + ANALYSIS_BATCH, job->nr);
+		for (size_t i = first; i < last; i++) {
+			record = &job->records[i];
+
+			rc = analyze_function(&job->arenas[id], record,
+				window_view(job->text, record->addr, NULL), &job->results[i],
+				&reason);
+			if (rc == RAVE__ENOMEM) {
+				__atomic_store_n(&job->rc, rc, __ATOMIC_RELAXED);
+				return;
+			} else if (rc != RAVE__SUCCESS) {
+				reject(job->self, reason);
+				WARN("non-randomizable function @ 0x%"PRIxPTR, record->addr);
+			}
 		}
 	}
+}
 
-	return RAVE__SUCCESS;
+static int compare_records(const void *a, const void *b)
+{
+	const struct function *fa = a, *fb = b;
+
+	if (fa->addr != fb->addr) {
+		return fa->addr < fb->addr ? -1 : 1;
+	}
+
+	return 0;
 }
 
-static int instr_set_encode_order(const struct instr_set *set, byte *target,
-	const int *order)
+int transform_add_functions(struct transform *self, struct window *text,
+	struct function *records, size_t nr, size_t nr_workers)
 {
-	instr_t *instr;
-	instr_t *instrs[set->nr_instrs];
-	uintptr_t orig;
-	byte *walk = target, *prev;
-	size_t i = 0;
+	struct analysis job;
+	int rc;
+
+	if (NULL == self || NULL == text || (NULL == records && nr)) {
+		return RAVE__EINVAL;
+	}
+
+	if (0 == nr) {
+		return RAVE__SUCCESS;
+	}
+
+	/* Analyze in address order, so the table build has less sorting to do */
+	qsort(records, nr, sizeof(*records), compare_records);
+
+	memset(&job, 0, sizeof(job));
+	job.self = self;
+	job.text = text;
+	job.records = records;
+	job.nr = nr;
+	nr_workers = min(nr_workers, (nr + ANALYSIS_BATCH - 1) / ANALYSIS_BATCH);
+
+	job.results = rave_calloc(nr, sizeof(*job.results));
+	job.arenas = rave_calloc(nr_workers, sizeof(*job.arenas));
+	if (NULL == job.results || NULL == job.arenas) {
+		rave_free(job.results);
+		rave_free(job.arenas);
+		return RAVE__ENOMEM;
+	}
+
+	DEBUG("Analyzing %zu functions with %zu workers", nr, nr_workers);
+
+	rc = workers_run(nr_workers, analysis_worker, &job);
+	if (rc == RAVE__SUCCESS) {
+		rc = job.rc;
+	}
+
+	/* Merge the results (or throw them all away if we ran out of memory) */
+	for (size_t i = 0; rc == RAVE__SUCCESS && i < nr; i++) {
+		if (NULL != job.results[i]) {
+			stage(self, job.results[i]);
+		}
+	}
 
+	for (size_t i = 0; i < nr_workers; i++) {
+		if (rc == RAVE__SUCCESS) {
+			arena_splice(&self->staging, &job.arenas[i]);
+		} else {
+			arena_close(&job.arenas[i]);
+		}
+	}
+
+	rave_free(job.results);
+	rave_free(job.arenas);
+
+	DEBUG("%zu functions staged in %zu bytes", self->nr_staged,
+		self->staging.used);
+
+	return rc;
+}
+
+int transform_foreach(struct transform *self, foreach_transformable_cb cb,
+	void *arg)
+{
+	struct transformable tf;
+	int rc;
+
+	if (NULL == self || NULL == cb) {
+		return RAVE__EINVAL;
+	}
+
+	pthread_mutex_lock(&self->lock);
+	rc = build_table(self);
+	pthread_mutex_unlock(&self->lock);
+	if (rc != RAVE__SUCCESS) {
+		return rc;
+	}
 
-	/* create a new list with the intended order locally */
-	instr_for_each(instr, set) {
-		instrs[order[i]] = instr;
-		i++;
+	/* Once built, the table only changes when more functions are added, which
+	 * doesn't happen concurrently with walking it */
+	for (size_t i = 0; i < self->table.nr; i++) {
+		table_row(&self->table, i, &tf);
+		rc = cb(&tf, arg);
+		if (rc != RAVE__SUCCESS) {
+			return rc;
+		}
 	}
 
-	orig = set->start;
-	for (i = 0, instr = instrs[i]; 
-		i < set->nr_instrs;
-		i++, instr = instrs[i])
+	return RAVE__SUCCESS;
+}
+
+/* Are the bytes of the set in the text exactly the pushes (or the pops, in
+ * reverse) of the registers? */
+static int set_matches(struct window *text, const struct function *record,
+	const uint8_t *regs, size_t nr_regs, const struct instr_set *set, int pop)
+{
+	uint8_t expected[TRANSFORM_MAX_REGS * PUSHPOP_MAX_LENGTH];
+	uint8_t *walk = expected;
+	size_t length;
+	void *bytes;
+
+	for (size_t i = 0; i < nr_regs; i++) {
+		walk = pushpop_encode(walk, pop ? regs[nr_regs - 1 - i] : regs[i], pop);
+	}
+
+	bytes = window_view(text, record->addr + set->offset, &length);
+	return NULL != bytes && length >= (size_t)(walk - expected) &&
+		memcmp(bytes, expected, walk - expected) == 0;
+}
+
+int transform_add_analyzed(struct transform *self, struct window *text,
+	const struct function *record, const uint8_t *regs, size_t nr_regs,
+	const struct instr_set *prologue, const struct instr_set *epilogues,
+	size_t nr_epilogues)
+{
+	struct staged *staged;
+	int rc;
+
+	if (NULL == self || NULL == text || NULL == record || NULL == regs ||
+		NULL == prologue || (NULL == epilogues && nr_epilogues))
 	{
-		prev = walk;
-		walk = instr_encode_to_copy(GLOBAL_DCONTEXT, instr, walk, PTR(orig));
-		if (NULL == walk) {
-			ERROR("Could not encode instr");
-			return RAVE__ETRANSFORM;
+		return RAVE__EINVAL;
+	}
+
+	rc = stage_function(&self->staging, record, regs, nr_regs, prologue,
+		epilogues, nr_epilogues, &staged);
+	if (rc != RAVE__SUCCESS) {
+		goto out;
+	}
+
+	/* Whoever did the analysis could have been looking at other code, and
+	 * permuting overwrites whatever the sets point at. What is left in the
+	 * arena goes along with the rest of it. */
+	if (!set_matches(text, record, regs, nr_regs, prologue, 0)) {
+		rc = RAVE__ETRANSFORM;
+	}
+	for (size_t i = 0; rc == RAVE__SUCCESS && i < nr_epilogues; i++) {
+		if (!set_matches(text, record, regs, nr_regs, &epilogues[i], 1)) {
+			rc = RAVE__ETRANSFORM;
 		}
+	}
 
-		orig += walk - prev;
-		if (orig > set->end) {
-			WARN("Expected fewer instructions during encode");
-			return RAVE__ETRANSFORM;
+out:
+	if (rc == RAVE__ETRANSFORM) {
+		reject(self, RAVE_REJECT_INVALID);
+	}
+	if (rc != RAVE__SUCCESS) {
+		return rc;
+	}
+
+	stage(self, staged);
+	return RAVE__SUCCESS;
+}
+
+int transform_find(struct transform *self, uintptr_t address,
+	struct function *out)
+{
+	const struct function_table *table;
+	size_t lo = 0, hi, mid;
+	int rc;
+
+	if (NULL == self || NULL == out) {
+		return RAVE__EINVAL;
+	}
+
+	pthread_mutex_lock(&self->lock);
+
+	rc = build_table(self);
+	if (rc != RAVE__SUCCESS) {
+		goto out;
+	}
+
+	/* Find the first function starting after the address */
+	table = &self->table;
+	hi = table->nr;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (table->addr[mid] <= address) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
 		}
 	}
 
+	/* Functions don't normally overlap, so the one before it is the only
+	 * candidate, but walk back as long as anything could still reach */
+	rc = RAVE__ENOENT;
+	while (lo-- > 0 && table->max_end[lo] > address) {
+		if (address < table->addr[lo] + table->len[lo]) {
+			out->addr = table->addr[lo];
+			out->len = table->len[lo];
+			rc = RAVE__SUCCESS;
+			break;
+		}
+	}
+
+out:
+	pthread_mutex_unlock(&self->lock);
+	return rc;
+}
+
+/* Encode the registers of a set in the given order: the instruction at slot i
+ * of the original set ends up at slot order[i]. */
+static int instr_set_encode_order(struct transform *self, uintptr_t addr,
+	const uint8_t *fregs, size_t nr_regs, const struct instr_set *set,
+	byte *target, const int *order, int pop)
+{
+	size_t length = 0;
+	uint8_t regs[nr_regs];
+	uintptr_t start = addr + set->offset;
+	byte *walk = target;
+
+	/* Epilogues restore registers in the reverse order */
+	for (size_t i = 0; i < nr_regs; i++) {
+		regs[order[i]] = pop ? fregs[nr_regs - 1 - i] : fregs[i];
+		length += pushpop_length(regs[order[i]]);
+	}
+
+	if (length != set->length) {
+		WARN("Set @ 0x%"PRIxPTR" doesn't fit its registers", start);
+		return RAVE__ETRANSFORM;
+	}
+
+	for (size_t i = 0; i < nr_regs; i++) {
+		walk = pushpop_encode(walk, regs[i], pop);
+	}
+
+	mark_dirty(self, start, start + length);
 	return RAVE__SUCCESS;
 }
 
-static int permute(struct transformable *tf, struct window *fw)
+/* Permute the i-th function of the table. Sets are written in address order,
+ * the prologue then the epilogues, so the text is only walked forward. */
+static int permute(struct transform *self, size_t i, struct window *text,
+	struct rng *rng)
 {
-	struct instr_set *set;
-	size_t nr_slots = tf->prologue.nr_instrs;
-	int eorder[nr_slots];
+	const struct function_table *table = &self->table;
+	const struct instr_set *set;
+	uintptr_t addr = table->addr[i];
+	size_t nr_slots = table->nr_regs[i];
+	int order[nr_slots], eorder[nr_slots];
 	int rc;
 
-	shuffle(tf->order, nr_slots);
+	/* Always shuffle from the original order, so the layout only depends on
+	 * the random stream and not on any earlier permutes */
+	for (size_t j = 0; j < nr_slots; j++) {
+		order[j] = j;
+	}
+
+	shuffle(order, nr_slots, rng);
 
 	/* Do the prologue first */
-	set = &tf->prologue;
-	rc = instr_set_encode_order(set, window_view(fw, set->start, NULL),
-		tf->order);
+	set = &table->prologue[i];
+	rc = instr_set_encode_order(self, addr, table->regs[i], nr_slots, set,
+		window_view(text, addr + set->offset, NULL), order, 0);
 	if (rc != RAVE__SUCCESS) {
 		ERROR("Could not encode prologue @ 0x%"PRIxPTR" size = %d",
-			set->start, (int)(set->end - set->start));
+			addr + set->offset, (int)set->length);
 		return rc;
 	}
 
 	/* We have to transform the order vector to maintian correctness since the
 	 * epilogue mirrors the prologue. */
-	for (size_t i = 0; i < nr_slots; i++) {
-		eorder[i] = (nr_slots - 1) - tf->order[(nr_slots - 1) - i];
+	for (size_t j = 0; j < nr_slots; j++) {
+		eorder[j] = (nr_slots - 1) - order[(nr_slots - 1) - j];
 	}
 
 	/* Encode all the epilogues */
-	list_for_each_entry(set, &tf->epilogues, l) {
-		rc = instr_set_encode_order(set, window_view(fw, set->start, NULL),
-			eorder);
+	for (uint32_t e = table->first_epilogue[i];
+		e < table->first_epilogue[i + 1];
+		e++)
+	{
+		set = &table->epilogues[e];
+		rc = instr_set_encode_order(self, addr, table->regs[i], nr_slots, set,
+			window_view(text, addr + set->offset, NULL), eorder, 1);
 		if (rc != RAVE__SUCCESS) {
 			ERROR("Could not encode instruction set @ 0x%"PRIxPTR" size = %d",
-				set->start, (int)(set->end - set->start));
+				addr + set->offset, (int)set->length);
 			return rc;
 		}
 	}
@@ -541,13 +1171,185 @@ static int permute(struct transformable *tf, struct window *fw)
 	return RAVE__SUCCESS;
 }
 
+/* Bring the i-th function (in address order) up to date with the current
+ * layout. Each function gets its own random stream, keyed by its position, so
+ * it doesn't matter which thread gets to it or when. */
+static int permute_one(struct transform *self, struct window *text, size_t i,
+	uint64_t seed, size_t *written)
+{
+	const struct function_table *table = &self->table;
+	struct rng rng;
+	int rc;
+
+	rng_init(&rng, seed, i);
+	rc = permute(self, i, text, &rng);
+	if (rc == RAVE__SUCCESS) {
+		table->applied[i] = self->epoch;
+
+		/* Every set is the same length */
+		*written += (size_t)table->prologue[i].length *
+			(1 + table->first_epilogue[i + 1] - table->first_epilogue[i]);
+	}
+
+	return rc;
+}
+
+/* Written counts are kept locally and added in once per batch, so workers
+ * don't all fight over the counter */
+static void add_written(struct transform *self, size_t written)
+{
+	__atomic_fetch_add(&self->bytes_modified, written, __ATOMIC_RELAXED);
+}
+
+static size_t first_page(const struct transform *self, size_t i)
+{
+	return (self->table.addr[i] - self->base) / PAGESZ;
+}
+
+static size_t last_page(const struct transform *self, size_t i)
+{
+	return (self->table.addr[i] + max(self->table.len[i], (uint32_t)1) - 1 -
+		self->base) / PAGESZ;
+}
+
+/* Split the sorted table into shards for nr_workers. We want a handful of
+ * shards per worker to balance the load, but a shard can only end where the
+ * next function starts on a page no earlier function has touched. */
+static int build_shards(struct transform *self, size_t nr_workers)
+{
+	struct shard *shards;
+	size_t target, nr = 0, last, nr_table = self->table.nr;
+
+	if (self->shard_workers == nr_workers && NULL != self->shards) {
+		return RAVE__SUCCESS;
+	}
+
+	rave_free(self->shards);
+	self->shards = NULL;
+	self->nr_shards = 0;
+
+	shards = rave_malloc(sizeof(*shards) * max(nr_table, (size_t)1));
+	if (NULL == shards) {
+		return RAVE__ENOMEM;
+	}
+
+	target = max(nr_table / (nr_workers * 8), (size_t)1);
+
+	for (size_t i = 0; i < nr_table; ) {
+		shards[nr].first = i;
+		last = last_page(self, i);
+
+		for (i++; i < nr_table; i++) {
+			if (i - shards[nr].first >= target && first_page(self, i) > last) {
+				break;
+			}
+
+			last = max(last, last_page(self, i));
+		}
+
+		shards[nr++].last = i;
+	}
+
+	self->shards = shards;
+	self->nr_shards = nr;
+	self->shard_workers = nr_workers;
+
+	return RAVE__SUCCESS;
+}
+
+/* Start a new layout. Nothing is permuted into it yet. */
+static void new_layout(struct transform *self, uint64_t seed)
+{
+	self->seed = seed;
+	bitmap_zero(self->changed, self->nr_pages);
+
+	/* 0 means never permuted, so skip it (and forget everything) on wrap */
+	if (++self->epoch == 0) {
+		memset(self->table.applied, 0,
+			sizeof(*self->table.applied) * self->table.nr);
+		self->epoch = 1;
+	}
+}
+
+struct permute_job {
+	struct transform *self;
+	struct window *text;
+
+	size_t next;
+	int rc;
+};
+
+static void permute_worker(void *arg, UNUSED size_t id)
+{
+	struct permute_job *job = arg;
+	struct shard *shard;
+	size_t i, written;
+	int rc, expected;
+
+	while (RAVE__SUCCESS == __atomic_load_n(&job->rc, __ATOMIC_RELAXED)) {
+		i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		if (i >= job->self->nr_shards) {
+			break;
+		}
+
+		shard = &job->self->shards[i];
+		written = 0;
+		for (size_t j = shard->first; j < shard->last; j++) {
+			rc = permute_one(job->self, job->text, j, job->self->seed,
+				&written);
+			if (rc != RAVE__SUCCESS) {
+				expected = RAVE__SUCCESS;
+				__atomic_compare_exchange_n(&job->rc, &expected, rc, 0,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+				add_written(job->self, written);
+				return;
+			}
+		}
+		add_written(job->self, written);
+	}
+}
+
+static int __permute_all(struct transform *self, struct window *text,
+	size_t nr_workers)
+{
+	struct permute_job job;
+	size_t written = 0;
+	int rc = RAVE__SUCCESS;
+
+	if (nr_workers <= 1) {
+		for (size_t i = 0; i < self->table.nr && rc == RAVE__SUCCESS; i++) {
+			rc = permute_one(self, text, i, self->seed, &written);
+		}
+		add_written(self, written);
+
+		DEBUG("done!");
+		return rc;
+	}
+
+	rc = build_shards(self, nr_workers);
+	if (rc != RAVE__SUCCESS) {
+		return rc;
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.self = self;
+	job.text = text;
+
+	rc = workers_run(min(nr_workers, self->nr_shards), permute_worker, &job);
+	if (rc == RAVE__SUCCESS) {
+		rc = job.rc;
+	}
+
+	DEBUG("done! (%zu shards)", self->nr_shards);
+
+	return rc;
+}
+
 /* Permute all prologues and epilogues. new instructions encoded to the target
  * text */
-int transform_permute_all(struct transform *self, struct window *text)
+int transform_permute_all(struct transform *self, struct window *text,
+	uint64_t seed, size_t nr_workers)
 {
-	struct transformable *tf;
-	struct window fw;
-	void *bytes;
 	int rc;
 
 	if (NULL == self || NULL == text) {
@@ -556,17 +1358,205 @@ int transform_permute_all(struct transform *self, struct window *text)
 
 	DEBUG("Permuting all function preservation code");
 
-	list_for_each_entry(tf, &self->transformables, l) {
-		bytes = window_view(text, tf->record.addr, NULL);
-		window_init(&fw, tf->record.addr, bytes, tf->record.len);
+	pthread_mutex_lock(&self->lock);
+
+	rc = build_table(self);
+	if (rc == RAVE__SUCCESS) {
+		new_layout(self, seed);
+		rc = __permute_all(self, text, nr_workers);
+	}
+
+	pthread_mutex_unlock(&self->lock);
+	return rc;
+}
+
+int transform_prepare(struct transform *self, size_t nr_workers)
+{
+	int rc;
+
+	if (NULL == self) {
+		return RAVE__EINVAL;
+	}
+
+	pthread_mutex_lock(&self->lock);
+
+	rc = build_table(self);
+	if (rc == RAVE__SUCCESS && nr_workers > 1) {
+		rc = build_shards(self, nr_workers);
+	}
+
+	pthread_mutex_unlock(&self->lock);
+	return rc;
+}
+
+int transform_set_seed(struct transform *self, uint64_t seed)
+{
+	int rc;
+
+	if (NULL == self) {
+		return RAVE__EINVAL;
+	}
+
+	pthread_mutex_lock(&self->lock);
+
+	rc = build_table(self);
+	if (rc == RAVE__SUCCESS) {
+		new_layout(self, seed);
+	}
+
+	pthread_mutex_unlock(&self->lock);
+	return rc;
+}
+
+/* First table entry which could reach into [start, ...) */
+static size_t first_overlapping(const struct transform *self, uintptr_t start)
+{
+	size_t lo = 0, hi = self->table.nr, mid;
+
+	/* max_end only ever grows, so it can be binary searched */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (self->table.max_end[mid] <= start) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+int transform_permute_range(struct transform *self, struct window *text,
+	uintptr_t start, uintptr_t end)
+{
+	size_t nr = 0, written = 0;
+	int rc = RAVE__SUCCESS;
+
+	if (NULL == self || NULL == text || start > end) {
+		return RAVE__EINVAL;
+	}
+
+	pthread_mutex_lock(&self->lock);
+
+	/* Nothing to do until there is a layout */
+	if (0 == self->epoch) {
+		goto out;
+	}
+
+	rc = build_table(self);
+	if (rc != RAVE__SUCCESS) {
+		goto out;
+	}
+
+	for (size_t i = first_overlapping(self, start); i < self->table.nr; i++) {
+		if (self->table.addr[i] >= end) {
+			break;
+		}
+
+		/* Either already permuted, or an earlier function which doesn't
+		 * actually reach the range */
+		if (self->table.applied[i] == self->epoch ||
+			self->table.addr[i] + self->table.len[i] <= start)
+		{
+			continue;
+		}
 
-		rc = permute(tf, &fw);
+		rc = permute_one(self, text, i, self->seed, &written);
 		if (rc != RAVE__SUCCESS) {
-			return rc;
+			break;
 		}
+		nr++;
 	}
+	add_written(self, written);
 
-	DEBUG("done!");
+	DEBUG("Permuted %zu functions for 0x%"PRIxPTR" - 0x%"PRIxPTR, nr, start,
+		end);
+
+out:
+	pthread_mutex_unlock(&self->lock);
+	return rc;
+}
+
+int transform_permute_ranges(struct transform *self, struct window *text,
+	const struct transform_range *ranges, size_t nr_ranges, uint64_t seed)
+{
+	size_t nr = 0, written = 0;
+	int rc;
+
+	if (NULL == self || NULL == text || (NULL == ranges && nr_ranges)) {
+		return RAVE__EINVAL;
+	}
+
+	pthread_mutex_lock(&self->lock);
+
+	rc = build_table(self);
+	if (rc != RAVE__SUCCESS) {
+		goto out;
+	}
+
+	bitmap_zero(self->changed, self->nr_pages);
+
+	for (size_t r = 0; r < nr_ranges; r++) {
+		for (size_t i = first_overlapping(self, ranges[r].start);
+			i < self->table.nr;
+			i++)
+		{
+			if (self->table.addr[i] >= ranges[r].end) {
+				break;
+			}
+
+			if (self->table.addr[i] + self->table.len[i] <= ranges[r].start) {
+				continue;
+			}
+
+			/* Permuting is idempotent for a given seed, so it doesn't matter
+			 * if the ranges overlap. The function counts as being in the
+			 * current layout from here on, so a lazy fault won't undo it. */
+			rc = permute_one(self, text, i, seed, &written);
+			if (rc != RAVE__SUCCESS) {
+				goto out;
+			}
+			nr++;
+		}
+	}
+
+	DEBUG("Re-randomized %zu functions in %zu ranges", nr, nr_ranges);
+
+out:
+	add_written(self, written);
+	pthread_mutex_unlock(&self->lock);
+	return rc;
+}
+
+int transform_get_stats(struct transform *self, struct transform_stats *stats)
+{
+	size_t pages = 0;
+
+	if (NULL == self || NULL == stats) {
+		return RAVE__EINVAL;
+	}
+
+	for (int i = 0; i < RAVE_REJECT_MAX; i++) {
+		stats->rejected[i] = __atomic_load_n(&self->rejected[i],
+			__ATOMIC_RELAXED);
+	}
+	stats->bytes_modified = __atomic_load_n(&self->bytes_modified,
+		__ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&self->lock);
+	stats->accepted = self->table.nr + self->nr_staged;
+	stats->epilogues = self->table.nr_epilogues + self->nr_staged_epilogues;
+	pthread_mutex_unlock(&self->lock);
+
+	/* Bits only ever get set (atomically), so a racy count is still a count
+	 * of pages which were dirty at some point during the call */
+	for (size_t i = 0; NULL != self->dirty &&
+		i < BITS_TO_LONGS(self->nr_pages); i++)
+	{
+		pages += __builtin_popcountl(__atomic_load_n(&self->dirty[i],
+			__ATOMIC_RELAXED));
+	}
+	stats->pages_modified = pages;
 
 	return RAVE__SUCCESS;
 }
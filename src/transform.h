@@ -11,60 +11,144 @@
 #ifndef __TRANSFORM_H_
 #define __TRANSFORM_H_
 
+#include "rave.h"
 #include "window.h"
 #include "function.h"
-#include "list.h"
 
 typedef struct transform * transform_t;
 
-/* A set of contiguous, related instructions */
-struct instr_set {
-	struct list_head l;
-
-	/* The original start and end addresses of the instructions */
-	uintptr_t start, end;
+/* Most registers a prologue can save. There are only 16 general purpose
+ * registers (and we never touch rbp), so anything past this is bogus. */
+#define TRANSFORM_MAX_REGS 16
 
-	/* Number of instructions and pointer to first instruction (the list is
-	 * maintained per-impl, hence the void ptr) */
-	size_t nr_instrs;
-	void *instrs;
+/* A set of contiguous pushes (or pops). Only the bounds are kept, relative to
+ * the start of the function; the instructions are rebuilt from the registers
+ * whenever the set is encoded. */
+struct instr_set {
+	uint32_t offset;
+	uint32_t length;
 };
 
-/* We need a way to track information about transformed functions. */
+/* Everything known about a transformed function. The transform keeps all of
+ * them in one address sorted table, this is just a view of one of its rows. */
 struct transformable {
-	struct list_head l;
-
 	struct function record;
 
-	/* Instruction sets for prologues and epilogues */
 	struct instr_set prologue;
-	struct list_head epilogues;
 
-	/* Order of preservation slots */
-	int *order;
+	/* Registers saved by the prologue, in push order, using the hardware
+	 * numbering (0 = rax ... 15 = r15). Epilogues pop them in reverse. */
+	uint8_t nr_regs;
+	uint8_t regs[TRANSFORM_MAX_REGS];
+
+	const struct instr_set *epilogues;
+	uint32_t nr_epilogues;
 };
 
 transform_t transform_create(void);
 void transform_destroy(transform_t self);
 
-int transform_init(transform_t self);
+/* The segment window is what dirty pages are tracked against */
+int transform_init(transform_t self, struct window *segment);
 int transform_close(transform_t self);
 
-/* Make sure we can transform the function.
- *
- * TODO: For rave's current state (focusing on just permuting
- * prologue/epilogues), this analysis is very dumb. Originally, I wanted to make
- * it more sophisticated and track the stack delta among other things in the
- * function. However, without referencing additional metadata (e.g. .eh_frame),
- * that analysis is very complicated and storing the additional information
- * about the function doesn't help me much. So, for now, it just records info
- * about prologues and epilogues.
- * */
-int transform_add_function(transform_t self, const struct function *record,
-	void *bytes);
-
-/* Permute push/pop instructions in the prologue and epilogue of a function */
-int transform_permute_all(transform_t self, struct window *text);
+/* Analyze a batch of functions (whose code lives in the text window) across
+ * nr_workers threads. The records are sorted by address in place, and the
+ * accepted functions are added in that order. Functions which can't be
+ * transformed are skipped, only running out of memory is an error. */
+int transform_add_functions(transform_t self, struct window *text,
+	struct function *records, size_t nr, size_t nr_workers);
+
+typedef int (*foreach_transformable_cb)(const struct transformable *, void *);
+
+/* Iterate over every function accepted by the analysis, in address order */
+int transform_foreach(transform_t self, foreach_transformable_cb cb,
+	void *arg);
+
+/* Add a function whose analysis has already been done (e.g. loaded from the
+ * analysis cache). regs uses the same numbering as the transformable. The sets
+ * are still checked against the code in the text window: they have to be
+ * exactly the pushes (pops, in reverse) of regs, or the function is rejected
+ * with RAVE__ETRANSFORM. */
+int transform_add_analyzed(transform_t self, struct window *text,
+	const struct function *record, const uint8_t *regs, size_t nr_regs,
+	const struct instr_set *prologue, const struct instr_set *epilogues,
+	size_t nr_epilogues);
+
+/* Find the function containing address (in the original text). Only
+ * functions which are transformed are found, anything else is RAVE__ENOENT. */
+int transform_find(transform_t self, uintptr_t address, struct function *out);
+
+/* Permute push/pop instructions in the prologue and epilogue of every
+ * function. The layout only depends on the seed: spreading the work across
+ * nr_workers threads (each handling functions which share no pages with other
+ * threads) gives the exact same bytes as doing it serially. */
+int transform_permute_all(transform_t self, struct window *text,
+	uint64_t seed, size_t nr_workers);
+
+/* Build everything permuting needs up front (for nr_workers), so that once
+ * all functions have been added, permuting never allocates */
+int transform_prepare(transform_t self, size_t nr_workers);
+
+/* Start a new layout for the seed without permuting anything. Functions are
+ * brought into it by transform_permute_range, and end up exactly as
+ * transform_permute_all would have left them. */
+int transform_set_seed(transform_t self, uint64_t seed);
+
+/* Permute every function reaching into [start, end) which isn't already in
+ * the current layout. Safe to call from multiple threads. */
+int transform_permute_range(transform_t self, struct window *text,
+	uintptr_t start, uintptr_t end);
+
+/* Addresses [start, end) in the original text */
+struct transform_range {
+	uintptr_t start, end;
+};
+
+/* Give every function reaching into one of the ranges a new permutation drawn
+ * from seed, right away, whether or not it was in the current layout yet.
+ * Only pages holding those functions are written. */
+int transform_permute_ranges(transform_t self, struct window *text,
+	const struct transform_range *ranges, size_t nr_ranges, uint64_t seed);
+
+/* Bitmap of segment pages the transform has written to. A page rewritten with
+ * the same bytes is still in there. Bit 0 is the page at base. */
+const unsigned long *transform_dirty_pages(transform_t self, uintptr_t *base,
+	size_t *nr_pages);
+
+/* Same layout as the dirty pages, but only the pages written since the last
+ * call to transform_permute_all, transform_set_seed or
+ * transform_permute_ranges */
+const unsigned long *transform_changed_pages(transform_t self,
+	uintptr_t *base, size_t *nr_pages);
+
+/* Content hashes of the segment pages (see hash_page), same layout as the
+ * dirty pages. Pages written since they were last hashed are rehashed from
+ * segment, then at most nr hashes are copied out. generation has to be the
+ * one last given to transform_invalidate_hashes (the segment could be on its
+ * way out otherwise), or this is RAVE__EBUSY. */
+int transform_page_hashes(transform_t self, struct window *segment,
+	uint64_t generation, uint64_t *hashes, size_t nr);
+
+/* The segment was swapped for another (a new layout), which differs from the
+ * last one at most where pages were ever written */
+int transform_invalidate_hashes(transform_t self, uint64_t generation);
+
+struct transform_stats {
+	/* Functions in the table (each has one prologue) */
+	uint64_t accepted;
+	uint64_t epilogues;
+
+	/* Functions the analysis turned down, by reason */
+	uint64_t rejected[RAVE_REJECT_MAX];
+
+	/* Bytes written by every permute so far, and segment pages currently
+	 * differing from the binary */
+	uint64_t bytes_modified;
+	uint64_t pages_modified;
+};
+
+int transform_get_stats(transform_t self, struct transform_stats *stats);
 
 #endif /* __TRANSFORM_H_ */
 
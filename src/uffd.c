@@ -0,0 +1,474 @@
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+#include "rave.h"
+#include "rave/errno.h"
+#include "workers.h"
+#include "memory.h"
+#include "util.h"
+#include "log.h"
+
+#define CACHELINE 64
+
+struct uffd_counters {
+	uint64_t faults, copies, zeropages, pages, errors;
+	uint64_t latency_total_ns, latency_max_ns;
+	uint64_t latency_us[RAVE_UFFD_LATENCY_BUCKETS];
+};
+
+/* Each worker keeps its own, so serving faults never shares a cache line. The
+ * array only gets malloc alignment, so there has to be at least a whole line
+ * between one worker's counters and the next. */
+struct uffd_worker_stats {
+	struct uffd_counters c;
+	char pad[CACHELINE +
+		(CACHELINE - sizeof(struct uffd_counters) % CACHELINE) % CACHELINE];
+};
+
+struct rave_uffd {
+	rave_handle_t handle;
+
+	/* Where the handle's code is in the target. Only faults past it get zero
+	 * pages when the handle has nothing for them. */
+	uintptr_t code_start, code_end;
+
+	int uffd;
+	int own_uffd;
+
+	/* Becomes readable (and stays that way) when the workers should stop */
+	int stop;
+
+	/* Runs the workers, so init doesn't have to wait on them */
+	pthread_t server;
+	int running;
+
+	size_t nr_workers;
+	struct uffd_worker_stats *stats;
+};
+
+struct rave_uffd * rave_uffd_create(void)
+{
+	struct rave_uffd *self;
+
+	/* Closing has to be safe even if init never happened */
+	self = rave_calloc(1, sizeof(struct rave_uffd));
+	if (NULL != self) {
+		self->uffd = -1;
+		self->stop = -1;
+	}
+
+	return self;
+}
+
+void rave_uffd_destroy(struct rave_uffd *self)
+{
+	if (NULL != self) {
+		rave_free(self);
+	}
+}
+
+/* A userfaultfd for this process */
+static int uffd_open(void)
+{
+	struct uffdio_api api = { .api = UFFD_API };
+	int fd;
+
+	/* Only handling faults from user space is all we need, and it is allowed
+	 * without privileges, but older kernels don't know the flag */
+	fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+	if (fd < 0 && errno == EINVAL) {
+		fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+	}
+	if (fd < 0) {
+		ERROR("Could not create a userfaultfd (%s)", strerror(errno));
+		return -1;
+	}
+
+	if (ioctl(fd, UFFDIO_API, &api) != 0) {
+		ERROR("userfaultfd API handshake failed (%s)", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int page_is_zero(const void *page)
+{
+	const uint64_t *words = page;
+
+	/* Code bails out on the first word, only real zero pages get scanned */
+	for (size_t i = 0; i < PAGESZ / sizeof(*words); i++) {
+		if (words[i]) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Someone else already resolved the page (e.g. two threads of the target
+ * faulting on it at once), so just make sure the faulting thread wakes up */
+static int wake(struct rave_uffd *self, uintptr_t address)
+{
+	struct uffdio_range range = {
+		.start = address,
+		.len = PAGESZ,
+	};
+
+	return ioctl(self->uffd, UFFDIO_WAKE, &range);
+}
+
+static int zeropage(struct rave_uffd *self, uintptr_t address)
+{
+	struct uffdio_zeropage zero = {
+		.range = {
+			.start = address,
+			.len = PAGESZ,
+		},
+	};
+	int rc;
+
+	do {
+		rc = ioctl(self->uffd, UFFDIO_ZEROPAGE, &zero);
+	} while (rc != 0 && errno == EAGAIN);
+
+	return rc;
+}
+
+static int copy(struct rave_uffd *self, uintptr_t address, const void *page,
+	size_t length)
+{
+	struct uffdio_copy copy = {
+		.dst = address,
+		.src = (uintptr_t)page,
+		.len = length,
+	};
+	int rc;
+
+	/* The target's mappings changing underneath us is worth another try,
+	 * picking up after whatever made it in. copy.copy is -errno when nothing
+	 * did, which is left to the caller. */
+	for (;;) {
+		copy.copy = 0;
+		rc = ioctl(self->uffd, UFFDIO_COPY, &copy);
+		if (rc == 0 || errno != EAGAIN || copy.copy < 0) {
+			break;
+		}
+
+		copy.dst += copy.copy;
+		copy.src += copy.copy;
+		copy.len -= copy.copy;
+	}
+
+	return rc;
+}
+
+/* Resolve one fault, along with whatever pages the handle hands out with it
+ * (fault-around, or the whole huge page). The pages are pinned while they are
+ * copied, so publishing a new layout in the meantime can't pull them out from
+ * under us. */
+static void serve(struct rave_uffd *self, uintptr_t address,
+	struct uffd_counters *stats)
+{
+	struct rave_range run = { .address = PAGE_DOWN(address) };
+	void *page;
+	int rc, err = 0;
+
+	address = PAGE_DOWN(address);
+
+	page = rave_get_pages(self->handle, address, &run);
+
+	/* Zeros in the code would run as instructions (add %al,(%rax)), so the
+	 * target is better off stuck on the fault than carrying on */
+	if (NULL == page && address >= self->code_start &&
+		address < self->code_end)
+	{
+		ERROR("No page for fault @ 0x%"PRIxPTR" in the code", address);
+		stats->errors++;
+		return;
+	}
+
+	if (NULL == page || (run.length == PAGESZ && page_is_zero(page))) {
+		rc = zeropage(self, address);
+		stats->zeropages += rc == 0;
+		stats->pages += rc == 0;
+	} else {
+		rc = copy(self, run.address, page, run.length);
+
+		/* The run can reach past what was registered, or some of it can be
+		 * in place already, so fall back to just the faulting page */
+		if (rc != 0 && run.length > PAGESZ) {
+			rc = copy(self, address,
+				OFFSET(page, address - run.address), PAGESZ);
+			run.length = PAGESZ;
+		}
+
+		stats->copies += rc == 0;
+		stats->pages += rc == 0 ? run.length / PAGESZ : 0;
+	}
+
+	/* Putting the page back can take locks and free memory, both of which
+	 * are free to clobber errno */
+	if (rc != 0) {
+		err = errno;
+	}
+
+	if (NULL != page) {
+		rave_put_page(self->handle, page);
+	}
+
+	/* Either someone else put the page in place, or the target's mappings
+	 * are changing. Either way waking the target is enough, it faults again
+	 * if the page still isn't there. */
+	if (rc != 0 && (err == EEXIST || err == EAGAIN)) {
+		rc = wake(self, address);
+		err = rc != 0 ? errno : 0;
+	}
+
+	if (rc != 0) {
+		ERROR("Could not resolve fault @ 0x%"PRIxPTR" (%s)", address,
+			strerror(err));
+		stats->errors++;
+	}
+}
+
+static void record_latency(struct uffd_counters *stats, uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	size_t bucket = 0;
+
+	stats->faults++;
+	stats->latency_total_ns += ns;
+	stats->latency_max_ns = max(stats->latency_max_ns, ns);
+
+	if (us) {
+		bucket = min((size_t)(63 - __builtin_clzll(us)),
+			(size_t)RAVE_UFFD_LATENCY_BUCKETS - 1);
+	}
+	stats->latency_us[bucket]++;
+}
+
+static void uffd_worker(void *arg, size_t id)
+{
+	struct rave_uffd *self = arg;
+	struct uffd_counters *stats = &self->stats[id].c;
+	struct pollfd fds[2] = {
+		{ .fd = self->uffd, .events = POLLIN },
+		{ .fd = self->stop, .events = POLLIN },
+	};
+	struct uffd_msg msg;
+	struct uffd_counters local;
+	uint64_t start;
+	ssize_t nr;
+
+	for (;;) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			ERROR("Could not poll userfaultfd (%s)", strerror(errno));
+			return;
+		}
+
+		if (fds[1].revents) {
+			return;
+		}
+
+		/* Workers race for every message, the losers get EAGAIN */
+		nr = read(self->uffd, &msg, sizeof(msg));
+		if (nr < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				continue;
+			}
+
+			ERROR("Could not read userfaultfd (%s)", strerror(errno));
+			return;
+		} else if (nr != sizeof(msg)) {
+			continue;
+		}
+
+		/* No other events were asked for */
+		if (msg.event != UFFD_EVENT_PAGEFAULT) {
+			continue;
+		}
+
+		start = now_ns();
+
+		/* Stats are only ever updated by this worker, but read from others,
+		 * so update a copy and store it back in one go */
+		memcpy(&local, stats, sizeof(local));
+		serve(self, msg.arg.pagefault.address, &local);
+		record_latency(&local, now_ns() - start);
+
+		for (size_t i = 0; i < sizeof(local) / sizeof(uint64_t); i++) {
+			__atomic_store_n(&((uint64_t *)stats)[i],
+				((uint64_t *)&local)[i], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static void *server(void *arg)
+{
+	struct rave_uffd *self = arg;
+
+	workers_run(self->nr_workers, uffd_worker, self);
+	return NULL;
+}
+
+int rave_uffd_init(struct rave_uffd *self, rave_handle_t handle, int uffd,
+	size_t nr_workers)
+{
+	size_t length;
+	int flags;
+
+	if (NULL == self || NULL == handle) {
+		return RAVE__EINVAL;
+	}
+
+	if (NULL == rave_get_code(handle, &length)) {
+		return RAVE__EINVAL;
+	}
+
+	self->handle = handle;
+	self->code_start = rave_get_code_address(handle);
+	self->code_end = self->code_start + length;
+	self->nr_workers = nr_workers ? nr_workers : workers_default();
+	self->own_uffd = uffd < 0;
+	self->uffd = self->own_uffd ? uffd_open() : uffd;
+	if (self->uffd < 0) {
+		return RAVE__EUFFD;
+	}
+
+	/* Every worker polls the same uffd, but only one of them gets each
+	 * message, the others can't be left blocking in read */
+	flags = fcntl(self->uffd, F_GETFL);
+	if (flags < 0 || fcntl(self->uffd, F_SETFL, flags | O_NONBLOCK) != 0) {
+		ERROR("Could not make the userfaultfd non-blocking");
+		rave_uffd_close(self);
+		return RAVE__EUFFD;
+	}
+
+	self->stop = eventfd(0, EFD_CLOEXEC);
+	self->stats = rave_calloc(self->nr_workers, sizeof(*self->stats));
+	if (self->stop < 0 || NULL == self->stats) {
+		rave_uffd_close(self);
+		return self->stop < 0 ? RAVE__EUFFD : RAVE__ENOMEM;
+	}
+
+	if (pthread_create(&self->server, NULL, server, self) != 0) {
+		rave_uffd_close(self);
+		return RAVE__EUFFD;
+	}
+	self->running = 1;
+
+	DEBUG("Serving userfaultfd %d with %zu workers", self->uffd,
+		self->nr_workers);
+
+	return RAVE__SUCCESS;
+}
+
+int rave_uffd_close(struct rave_uffd *self)
+{
+	uint64_t one = 1;
+
+	if (NULL == self) {
+		return RAVE__EINVAL;
+	}
+
+	if (self->running) {
+		if (write(self->stop, &one, sizeof(one)) != sizeof(one)) {
+			ERROR("Could not stop the userfaultfd workers");
+			return RAVE__EUFFD;
+		}
+
+		pthread_join(self->server, NULL);
+		self->running = 0;
+	}
+
+	if (self->stop >= 0) {
+		close(self->stop);
+		self->stop = -1;
+	}
+
+	if (self->own_uffd && self->uffd >= 0) {
+		close(self->uffd);
+	}
+	self->uffd = -1;
+	self->own_uffd = 0;
+
+	rave_free(self->stats);
+	self->stats = NULL;
+
+	return RAVE__SUCCESS;
+}
+
+int rave_uffd_register(struct rave_uffd *self, uintptr_t start, size_t length)
+{
+	struct uffdio_register reg = {
+		.range = {
+			.start = start,
+			.len = length,
+		},
+		.mode = UFFDIO_REGISTER_MODE_MISSING,
+	};
+	uint64_t needed = (1ULL << _UFFDIO_COPY) | (1ULL << _UFFDIO_ZEROPAGE) |
+		(1ULL << _UFFDIO_WAKE);
+
+	if (NULL == self || self->uffd < 0 || start % PAGESZ || length % PAGESZ) {
+		return RAVE__EINVAL;
+	}
+
+	if (ioctl(self->uffd, UFFDIO_REGISTER, &reg) != 0) {
+		ERROR("Could not register 0x%"PRIxPTR" - 0x%"PRIxPTR" (%s)", start,
+			start + length, strerror(errno));
+		return RAVE__EUFFD;
+	}
+
+	if ((reg.ioctls & needed) != needed) {
+		ERROR("Range 0x%"PRIxPTR" - 0x%"PRIxPTR" can't be filled in", start,
+			start + length);
+		return RAVE__EUFFD;
+	}
+
+	return RAVE__SUCCESS;
+}
+
+int rave_uffd_get_stats(struct rave_uffd *self, struct rave_uffd_stats *stats)
+{
+	uint64_t latency_max;
+
+	if (NULL == self || NULL == stats) {
+		return RAVE__EINVAL;
+	}
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (size_t i = 0; NULL != self->stats && i < self->nr_workers; i++) {
+#define LOAD(field) __atomic_load_n(&self->stats[i].c.field, __ATOMIC_RELAXED)
+		stats->faults += LOAD(faults);
+		stats->copies += LOAD(copies);
+		stats->zeropages += LOAD(zeropages);
+		stats->pages += LOAD(pages);
+		stats->errors += LOAD(errors);
+		stats->latency_total_ns += LOAD(latency_total_ns);
+		latency_max = LOAD(latency_max_ns);
+		stats->latency_max_ns = max(stats->latency_max_ns, latency_max);
+		for (size_t b = 0; b < RAVE_UFFD_LATENCY_BUCKETS; b++) {
+			stats->latency_us[b] += LOAD(latency_us[b]);
+		}
+#undef LOAD
+	}
+
+	return RAVE__SUCCESS;
+}
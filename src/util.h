@@ -10,10 +10,18 @@
 #ifndef __UTIL_H_
 #define __UTIL_H_
 
+#include <stdint.h>
+#include <time.h>
+
 #define PAGESZ 4096
 #define PAGE_DOWN(addr) ((addr) & ~(PAGESZ - 1))
 #define PAGE_UP(addr) PAGE_DOWN((addr) + (PAGESZ - 1))
 
+/* Transparent huge pages (x86-64 PMD size) */
+#define HPAGESZ (2UL << 20)
+#define HPAGE_DOWN(addr) ((addr) & ~(HPAGESZ - 1))
+#define HPAGE_UP(addr) HPAGE_DOWN((addr) + (HPAGESZ - 1))
+
 /* Offset a pointer by certain number of bytes */
 #define OFFSET(ptr, off) (__typeof__ (ptr))((uintptr_t)(ptr) + (off))
 #define PTR(val) (void *)(val)
@@ -34,5 +42,14 @@
 	void *__mptr = (void *)(ptr); \
 	((type *)(__mptr - offsetof(type, member))); })
 
+/* Monotonic clock in nanoseconds, for timing things */
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 #endif /* __UTIL_H_ */
 
@@ -0,0 +1,81 @@
+#include <pthread.h>
+#include <unistd.h>
+
+#include "workers.h"
+#include "rave/errno.h"
+#include "memory.h"
+#include "log.h"
+
+/* Enough for most machines without having to allocate */
+#define WORKERS_ON_STACK 64
+
+struct worker {
+	pthread_t thread;
+	worker_fn fn;
+	void *arg;
+	size_t id;
+};
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+
+	w->fn(w->arg, w->id);
+	return NULL;
+}
+
+size_t workers_default(void)
+{
+	long nr = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return nr > 0 ? (size_t)nr : 1;
+}
+
+int workers_run(size_t nr_workers, worker_fn fn, void *arg)
+{
+	struct worker local[WORKERS_ON_STACK], *workers = local;
+	size_t started;
+
+	if (NULL == fn) {
+		return RAVE__EINVAL;
+	}
+
+	if (nr_workers <= 1) {
+		fn(arg, 0);
+		return RAVE__SUCCESS;
+	}
+
+	if (nr_workers > WORKERS_ON_STACK) {
+		workers = rave_calloc(nr_workers, sizeof(*workers));
+		if (NULL == workers) {
+			return RAVE__ENOMEM;
+		}
+	}
+
+	/* Worker 0 is this thread */
+	for (started = 1; started < nr_workers; started++) {
+		workers[started].fn = fn;
+		workers[started].arg = arg;
+		workers[started].id = started;
+
+		if (pthread_create(&workers[started].thread, NULL, worker_main,
+			&workers[started]) != 0)
+		{
+			/* The work is shared dynamically, so fewer workers is fine */
+			WARN("Could only start %zu of %zu workers", started, nr_workers);
+			break;
+		}
+	}
+
+	fn(arg, 0);
+
+	for (size_t i = 1; i < started; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	if (workers != local) {
+		rave_free(workers);
+	}
+
+	return RAVE__SUCCESS;
+}
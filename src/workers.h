@@ -0,0 +1,27 @@
+/**
+ * Workers
+ *
+ * Minimal fork/join helper for spreading work across threads. The calling
+ * thread always takes part as worker 0, so running with a single worker never
+ * spawns a thread.
+ *
+ * Author: Christopher Blackburn <krizboy@vt.edu>
+ * Date: 1/1/1977
+ */
+
+#ifndef __WORKERS_H_
+#define __WORKERS_H_
+
+#include <stddef.h>
+
+typedef void (*worker_fn)(void *arg, size_t id);
+
+/* Number of workers to use when the user asks for 0 (one per online cpu) */
+size_t workers_default(void);
+
+/* Run fn on nr_workers threads and wait for all of them to finish. If threads
+ * can't be started, fewer workers run, so work must be handed out dynamically
+ * (e.g. through an atomic counter) rather than split up by id. */
+int workers_run(size_t nr_workers, worker_fn fn, void *arg);
+
+#endif /* __WORKERS_H_ */
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <rave.h>
+
+#define ITERATIONS 16
+
+/* Everything rave allocates goes through here */
+static size_t nr_allocs, nr_live;
+
+static void *count_malloc(size_t size, void *ctx)
+{
+	void *ptr = malloc(size);
+
+	(void)ctx;
+	if (ptr) {
+		nr_allocs++;
+		nr_live++;
+	}
+	return ptr;
+}
+
+static void *count_realloc(void *ptr, size_t size, void *ctx)
+{
+	void *new = realloc(ptr, size);
+
+	(void)ctx;
+	if (new) {
+		nr_allocs++;
+		nr_live += ptr ? 0 : 1;
+	}
+	return new;
+}
+
+static void count_free(void *ptr, void *ctx)
+{
+	(void)ctx;
+	if (ptr) {
+		nr_live--;
+	}
+	free(ptr);
+}
+
+static const struct rave_allocator counting = {
+	.malloc = count_malloc,
+	.realloc = count_realloc,
+	.free = count_free,
+};
+
+/* Tests that randomizing never allocates once the handle is initialized, and
+ * that closing the handle gives everything back */
+int main(int argc, char **argv) {
+	const char *binary = argc > 1 ? argv[1] : argv[0];
+	rave_handle_t rh;
+	size_t before;
+	int rc;
+
+	if (rave_set_allocator(&counting) != 0) {
+		fprintf(stderr, "Could not set allocator\n");
+		return EXIT_FAILURE;
+	}
+
+	rh = rave_create();
+	rc = rave_init(rh, binary);
+	if (rc != 0) {
+		fprintf(stderr, "Init failed\n");
+		goto err;
+	}
+
+	before = nr_allocs;
+	for (int i = 0; i < ITERATIONS; i++) {
+		rc = rave_randomize(rh);
+		if (rc != 0) {
+			fprintf(stderr, "randomization failed\n");
+			goto err;
+		}
+	}
+
+	if (nr_allocs != before) {
+		fprintf(stderr, "Randomizing made %zu allocations\n",
+			nr_allocs - before);
+		goto err;
+	}
+
+	rave_close(rh);
+	rave_destroy(rh);
+
+	if (nr_live != 0) {
+		fprintf(stderr, "%zu allocations leaked\n", nr_live);
+		return EXIT_FAILURE;
+	}
+
+	printf("Success!\n");
+	return EXIT_SUCCESS;
+err:
+	rave_close(rh);
+	rave_destroy(rh);
+	return EXIT_FAILURE;
+}
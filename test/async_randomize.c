@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <rave.h>
+
+#include "common.h"
+
+#define PAGESZ 4096
+
+/* Build the layout in the background and publish it, with a page from the
+ * current layout pinned. The page has to survive the swap. */
+static int randomize_async(rave_handle_t rh, void *arg)
+{
+	char before[PAGESZ];
+	void *page;
+	int rc;
+
+	(void)arg;
+	page = rave_get_page(rh, rave_get_text_offset(rh));
+	if (NULL == page) {
+		fprintf(stderr, "Could not pin a page\n");
+		return -1;
+	}
+	memcpy(before, page, PAGESZ);
+
+	rc = rave_randomize_async(rh);
+	rc = rc ? rc : rave_randomize_wait(rh);
+	rc = rc ? rc : rave_publish(rh);
+	if (rc != 0) {
+		fprintf(stderr, "async randomization failed\n");
+	} else if (memcmp(before, page, PAGESZ) != 0) {
+		fprintf(stderr, "Pinned page changed under us\n");
+		rc = -1;
+	}
+
+	rave_put_page(rh, page);
+	return rc;
+}
+
+/* Tests that building a layout in the background and publishing it gives the
+ * same layout as randomizing in place */
+int main(int argc, char **argv) {
+	const char *binary = argc > 1 ? argv[1] : argv[0];
+	void *direct, *async;
+	size_t direct_length, async_length;
+	int rc;
+
+	direct = randomize_text(binary, NULL, NULL, NULL, &direct_length);
+	async = randomize_text(binary, NULL, randomize_async, NULL,
+		&async_length);
+
+	rc = check_layouts(binary, direct, direct_length, async, async_length,
+		"Published");
+	free(direct);
+	free(async);
+	if (rc != 0) {
+		return EXIT_FAILURE;
+	}
+
+	printf("Success!\n");
+	return EXIT_SUCCESS;
+}
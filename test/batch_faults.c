@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <rave.h>
+
+#define SEED 0x5eed
+#define PAGESZ 4096UL
+
+/* Resolves every page of the text (twice over, shuffled, with an address
+ * nowhere near the code thrown in) in one batch, and checks the runs against
+ * faulting the pages one at a time */
+int main(int argc, char **argv) {
+	const char *binary = argc > 1 ? argv[1] : argv[0];
+	rave_handle_t rh = rave_create();
+	struct rave_page_run *runs = NULL, *pinned = NULL;
+	uintptr_t *addresses = NULL, start, tmp;
+	struct rave_stats stats;
+	size_t length, nr_pages, nr = 0, nr_runs, covered = 0, served = 0;
+	int rc, ret = EXIT_FAILURE;
+
+	rc = rave_init(rh, binary);
+	if (rc != 0) {
+		fprintf(stderr, "Init failed\n");
+		goto out;
+	}
+
+	rave_set_seed(rh, SEED);
+	rc = rave_randomize(rh);
+	if (rc != 0) {
+		fprintf(stderr, "randomization failed\n");
+		goto out;
+	}
+
+	if (NULL == rave_get_text(rh, &length)) {
+		fprintf(stderr, "Error getting text\n");
+		goto out;
+	}
+	start = rave_get_text_offset(rh) & ~(PAGESZ - 1);
+	nr_pages = (rave_get_text_offset(rh) + length - start + PAGESZ - 1) /
+		PAGESZ;
+
+	addresses = malloc((2 * nr_pages + 1) * sizeof(*addresses));
+	runs = malloc((2 * nr_pages + 1) * sizeof(*runs));
+	pinned = malloc((2 * nr_pages + 1) * sizeof(*pinned));
+	if (NULL == addresses || NULL == runs || NULL == pinned) {
+		fprintf(stderr, "no mem\n");
+		goto out;
+	}
+
+	for (size_t i = 0; i < nr_pages; i++) {
+		addresses[nr++] = start + i * PAGESZ;
+		addresses[nr++] = start + i * PAGESZ + (i % PAGESZ);
+	}
+	addresses[nr++] = UINTPTR_MAX;
+
+	srand(SEED);
+	for (size_t i = nr - 1; i > 0; i--) {
+		size_t j = rand() % (i + 1);
+		tmp = addresses[i];
+		addresses[i] = addresses[j];
+		addresses[j] = tmp;
+	}
+
+	nr_runs = rave_handle_faults(rh, addresses, nr, runs);
+	for (size_t i = 0; i < nr_runs; i++) {
+		served += NULL != runs[i].data;
+	}
+
+	/* Before the single faults below add to them */
+	rc = rave_get_stats(rh, &stats);
+	if (rc != 0 || stats.faults != served || stats.fault_pages != nr_pages) {
+		fprintf(stderr, "Stats off: %lu faults, %lu pages\n",
+			(unsigned long)stats.faults, (unsigned long)stats.fault_pages);
+		goto out;
+	}
+
+	for (size_t i = 0; i < nr_runs; i++) {
+		if (i > 0 && runs[i].address < runs[i - 1].address +
+			runs[i - 1].length)
+		{
+			fprintf(stderr, "Runs out of order\n");
+			goto out;
+		}
+
+		if (NULL == runs[i].data) {
+			continue;
+		}
+
+		for (size_t off = 0; off < runs[i].length; off += PAGESZ) {
+			if ((char *)runs[i].data + off !=
+				rave_handle_fault(rh, runs[i].address + off))
+			{
+				fprintf(stderr, "Run doesn't match the fault @ 0x%lx\n",
+					(unsigned long)(runs[i].address + off));
+				goto out;
+			}
+		}
+		covered += runs[i].length;
+	}
+
+	if (covered != nr_pages * PAGESZ) {
+		fprintf(stderr, "Expected %zu pages, got %zu\n", nr_pages,
+			covered / PAGESZ);
+		goto out;
+	}
+
+	/* The pinned batch hands out the same runs */
+	if (rave_get_faults(rh, addresses, nr, pinned) != nr_runs) {
+		fprintf(stderr, "Pinned batch has a different number of runs\n");
+		goto out;
+	}
+	for (size_t i = 0; i < nr_runs; i++) {
+		if (pinned[i].address != runs[i].address ||
+			pinned[i].length != runs[i].length ||
+			pinned[i].data != runs[i].data)
+		{
+			fprintf(stderr, "Pinned run doesn't match @ 0x%lx\n",
+				(unsigned long)runs[i].address);
+			goto out;
+		}
+		rave_put_page(rh, pinned[i].data);
+	}
+
+	printf("%zu addresses in %zu runs\n", nr, nr_runs);
+	ret = EXIT_SUCCESS;
+
+out:
+	free(addresses);
+	free(runs);
+	free(pinned);
+	rave_close(rh);
+	rave_destroy(rh);
+	return ret;
+}
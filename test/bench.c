@@ -0,0 +1,458 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <rave.h>
+
+#define PAGESZ 4096UL
+
+enum phase {
+	PHASE_INIT,
+	PHASE_RANDOMIZE,
+	PHASE_FAULT,
+	NR_PHASES,
+};
+
+static const char *phase_names[NR_PHASES] = {
+	[PHASE_INIT] = "init",
+	[PHASE_RANDOMIZE] = "randomize",
+	[PHASE_FAULT] = "fault",
+};
+
+static const char *metadata_names[] = {
+	[RAVE_METADATA_DWARF] = "dwarf",
+	[RAVE_METADATA_EHFRAME] = "ehframe",
+	[RAVE_METADATA_SYMTAB] = "symtab",
+};
+
+struct options {
+	int iterations, warmup;
+	int csv;
+	long metadata, workers, randomize_workers, lazy, cow, fault_around, hugepages;
+};
+
+/* One run of one phase */
+struct sample {
+	uint64_t wall_ns, cpu_ns;
+	size_t allocs, alloc_bytes;
+};
+
+/* Everything rave allocates goes through here, from the init and randomize
+ * workers too */
+static size_t nr_allocs, nr_alloc_bytes;
+
+static void count(size_t size)
+{
+	__atomic_fetch_add(&nr_allocs, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&nr_alloc_bytes, size, __ATOMIC_RELAXED);
+}
+
+static void *count_malloc(size_t size, void *ctx)
+{
+	(void)ctx;
+	count(size);
+	return malloc(size);
+}
+
+static void *count_realloc(void *ptr, size_t size, void *ctx)
+{
+	(void)ctx;
+	count(size);
+	return realloc(ptr, size);
+}
+
+static void count_free(void *ptr, void *ctx)
+{
+	(void)ctx;
+	free(ptr);
+}
+
+static const struct rave_allocator counting = {
+	.malloc = count_malloc,
+	.realloc = count_realloc,
+	.free = count_free,
+};
+
+static uint64_t now(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* High water mark of the whole process, in KiB */
+static long peak_rss(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+static void sample_start(struct sample *s)
+{
+	s->allocs = __atomic_load_n(&nr_allocs, __ATOMIC_RELAXED);
+	s->alloc_bytes = __atomic_load_n(&nr_alloc_bytes, __ATOMIC_RELAXED);
+	s->cpu_ns = now(CLOCK_PROCESS_CPUTIME_ID);
+	s->wall_ns = now(CLOCK_MONOTONIC);
+}
+
+static void sample_stop(struct sample *s)
+{
+	s->wall_ns = now(CLOCK_MONOTONIC) - s->wall_ns;
+	s->cpu_ns = now(CLOCK_PROCESS_CPUTIME_ID) - s->cpu_ns;
+	s->allocs = __atomic_load_n(&nr_allocs, __ATOMIC_RELAXED) - s->allocs;
+	s->alloc_bytes = __atomic_load_n(&nr_alloc_bytes, __ATOMIC_RELAXED) -
+		s->alloc_bytes;
+}
+
+/* Fault in every page of the text, front to back like a cold start does.
+ * With fault-around, each fault covers as many pages as the handle hands out,
+ * so the time is until all of the text is in. */
+static int fault_text(rave_handle_t rh)
+{
+	struct rave_range run;
+	uintptr_t start, addr;
+	size_t length;
+
+	if (NULL == rave_get_text(rh, &length)) {
+		return -1;
+	}
+
+	start = rave_get_text_offset(rh);
+	for (addr = start & ~(PAGESZ - 1); addr < start + length;
+		addr += run.length)
+	{
+		if (NULL == rave_handle_fault_around(rh, addr, &run)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* One full create/init/randomize/fault/destroy cycle */
+static int run_once(const char *binary, const struct options *opts,
+	struct sample samples[NR_PHASES])
+{
+	rave_handle_t rh;
+	int rc = -1;
+
+	rh = rave_create();
+	if (NULL == rh) {
+		fprintf(stderr, "Could not create a handle\n");
+		return -1;
+	}
+
+	if (rave_set_option(rh, RAVE_OPT_METADATA, opts->metadata) != 0 ||
+		rave_set_option(rh, RAVE_OPT_WORKERS, opts->workers) != 0 ||
+		rave_set_option(rh, RAVE_OPT_RANDOMIZE_WORKERS,
+			opts->randomize_workers) != 0 ||
+		rave_set_option(rh, RAVE_OPT_LAZY, opts->lazy) != 0 ||
+		rave_set_option(rh, RAVE_OPT_COW, opts->cow) != 0 ||
+		rave_set_option(rh, RAVE_OPT_FAULT_AROUND, opts->fault_around) != 0 ||
+		rave_set_option(rh, RAVE_OPT_HUGEPAGES, opts->hugepages) != 0)
+	{
+		fprintf(stderr, "Could not set options\n");
+		goto out;
+	}
+
+	sample_start(&samples[PHASE_INIT]);
+	if (rave_init(rh, binary) != 0) {
+		fprintf(stderr, "Init of %s failed\n", binary);
+		goto out;
+	}
+	sample_stop(&samples[PHASE_INIT]);
+
+	sample_start(&samples[PHASE_RANDOMIZE]);
+	if (rave_randomize(rh) != 0) {
+		fprintf(stderr, "Randomizing %s failed\n", binary);
+		goto out;
+	}
+	sample_stop(&samples[PHASE_RANDOMIZE]);
+
+	sample_start(&samples[PHASE_FAULT]);
+	if (fault_text(rh) != 0) {
+		fprintf(stderr, "Faulting in %s failed\n", binary);
+		goto out;
+	}
+	sample_stop(&samples[PHASE_FAULT]);
+
+	rc = 0;
+out:
+	rave_close(rh);
+	rave_destroy(rh);
+	return rc;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t ua = *(const uint64_t *)a, ub = *(const uint64_t *)b;
+
+	return ua < ub ? -1 : ua > ub;
+}
+
+struct summary {
+	uint64_t min, median, mean;
+};
+
+static void summarize(uint64_t *values, int nr, struct summary *out)
+{
+	uint64_t total = 0;
+
+	qsort(values, nr, sizeof(*values), compare_u64);
+	for (int i = 0; i < nr; i++) {
+		total += values[i];
+	}
+
+	out->min = values[0];
+	out->median = values[nr / 2];
+	out->mean = total / nr;
+}
+
+static void print_header(const struct options *opts)
+{
+	if (opts->csv) {
+		printf("binary,phase,iterations,wall_min_ns,wall_median_ns,"
+			"wall_mean_ns,cpu_min_ns,cpu_median_ns,cpu_mean_ns,allocs,"
+			"alloc_bytes,peak_rss_kb\n");
+	} else {
+		printf("{\n\t\"metadata\": \"%s\",\n\t\"workers\": %ld,\n"
+			"\t\"randomize_workers\": %ld,\n\t\"lazy\": %ld,\n\t\"cow\": %ld,\n"
+			"\t\"fault_around\": %ld,\n\t\"hugepages\": %ld,\n"
+			"\t\"warmup\": %d,\n\t\"iterations\": %d,\n"
+			"\t\"results\": [",
+			metadata_names[opts->metadata], opts->workers,
+			opts->randomize_workers, opts->lazy, opts->cow,
+			opts->fault_around, opts->hugepages, opts->warmup,
+			opts->iterations);
+	}
+}
+
+static void print_footer(const struct options *opts)
+{
+	if (!opts->csv) {
+		printf("\n\t]\n}\n");
+	}
+}
+
+/* Binaries are paths, so they can have anything in them */
+static void print_json_string(const char *str)
+{
+	putchar('"');
+	for (; *str; str++) {
+		if ('"' == *str || '\\' == *str) {
+			printf("\\%c", *str);
+		} else if ((unsigned char)*str < 0x20) {
+			printf("\\u%04x", (unsigned char)*str);
+		} else {
+			putchar(*str);
+		}
+	}
+	putchar('"');
+}
+
+static void print_csv_string(const char *str)
+{
+	if (NULL == strpbrk(str, ",\"\r\n")) {
+		fputs(str, stdout);
+		return;
+	}
+
+	putchar('"');
+	for (; *str; str++) {
+		if ('"' == *str) {
+			putchar('"');
+		}
+		putchar(*str);
+	}
+	putchar('"');
+}
+
+/* Print one phase. Allocations are the same every iteration, so they come
+ * from the last one. */
+static void print_phase(const struct options *opts, const char *binary,
+	enum phase phase, struct sample *samples, long rss, int first)
+{
+	uint64_t values[opts->iterations];
+	struct summary wall, cpu;
+	struct sample *last = &samples[(opts->iterations - 1) * NR_PHASES + phase];
+
+	for (int i = 0; i < opts->iterations; i++) {
+		values[i] = samples[i * NR_PHASES + phase].wall_ns;
+	}
+	summarize(values, opts->iterations, &wall);
+
+	for (int i = 0; i < opts->iterations; i++) {
+		values[i] = samples[i * NR_PHASES + phase].cpu_ns;
+	}
+	summarize(values, opts->iterations, &cpu);
+
+	if (opts->csv) {
+		print_csv_string(binary);
+		printf(",%s,%d,%llu,%llu,%llu,%llu,%llu,%llu,%zu,%zu,%ld\n",
+			phase_names[phase], opts->iterations,
+			(unsigned long long)wall.min, (unsigned long long)wall.median,
+			(unsigned long long)wall.mean, (unsigned long long)cpu.min,
+			(unsigned long long)cpu.median, (unsigned long long)cpu.mean,
+			last->allocs, last->alloc_bytes, rss);
+	} else {
+		printf("%s\n\t\t{\"binary\": ", first ? "" : ",");
+		print_json_string(binary);
+		printf(", \"phase\": \"%s\", "
+			"\"wall_ns\": {\"min\": %llu, \"median\": %llu, \"mean\": %llu}, "
+			"\"cpu_ns\": {\"min\": %llu, \"median\": %llu, \"mean\": %llu}, "
+			"\"allocs\": %zu, \"alloc_bytes\": %zu, \"peak_rss_kb\": %ld}",
+			phase_names[phase],
+			(unsigned long long)wall.min, (unsigned long long)wall.median,
+			(unsigned long long)wall.mean, (unsigned long long)cpu.min,
+			(unsigned long long)cpu.median, (unsigned long long)cpu.mean,
+			last->allocs, last->alloc_bytes, rss);
+	}
+}
+
+static int bench(const char *binary, const struct options *opts, int first)
+{
+	struct sample scratch[NR_PHASES], *samples;
+	long rss;
+
+	for (int i = 0; i < opts->warmup; i++) {
+		if (run_once(binary, opts, scratch) != 0) {
+			return -1;
+		}
+	}
+
+	samples = calloc(opts->iterations * NR_PHASES, sizeof(*samples));
+	if (NULL == samples) {
+		fprintf(stderr, "no mem\n");
+		return -1;
+	}
+
+	for (int i = 0; i < opts->iterations; i++) {
+		if (run_once(binary, opts, &samples[i * NR_PHASES]) != 0) {
+			free(samples);
+			return -1;
+		}
+	}
+
+	/* The RSS high water mark only goes up, so it covers every binary
+	 * benchmarked so far. Run one binary per process for exact numbers. */
+	rss = peak_rss();
+	for (int phase = 0; phase < NR_PHASES; phase++) {
+		print_phase(opts, binary, phase, samples, rss, first && phase == 0);
+	}
+
+	free(samples);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options] binary...\n"
+		"\t-n N       measured iterations (default 10)\n"
+		"\t-w N       warmup iterations (default 2)\n"
+		"\t-f FORMAT  json or csv (default json)\n"
+		"\t-m BACKEND dwarf, ehframe or symtab (default dwarf)\n"
+		"\t-j N       init workers, 0 for one per cpu (default 1)\n"
+		"\t-r N       randomize workers, 0 for one per cpu (default 1)\n"
+		"\t-l         lazy randomization\n"
+		"\t-c         copy-on-write code mapping\n"
+		"\t-a N       most pages per fault (default 1)\n"
+		"\t-H         huge page backed code\n",
+		prog);
+}
+
+static long parse_metadata(const char *name)
+{
+	for (long i = 0; i < RAVE_METADATA_MAX; i++) {
+		if (0 == strcasecmp(name, metadata_names[i])) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/* Benchmarks init, randomize and faulting in the text of each binary. Every
+ * iteration gets a fresh handle. */
+int main(int argc, char **argv) {
+	struct options opts = {
+		.iterations = 10,
+		.warmup = 2,
+		.metadata = RAVE_METADATA_DWARF,
+		.workers = 1,
+		.randomize_workers = 1,
+		.fault_around = 1,
+	};
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:w:f:m:j:r:lca:Hh")) != -1) {
+		switch (opt) {
+		case 'n':
+			opts.iterations = atoi(optarg);
+			break;
+		case 'w':
+			opts.warmup = atoi(optarg);
+			break;
+		case 'f':
+			if (0 == strcasecmp(optarg, "csv")) {
+				opts.csv = 1;
+			} else if (0 != strcasecmp(optarg, "json")) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'm':
+			opts.metadata = parse_metadata(optarg);
+			break;
+		case 'j':
+			opts.workers = atol(optarg);
+			break;
+		case 'r':
+			opts.randomize_workers = atol(optarg);
+			break;
+		case 'l':
+			opts.lazy = 1;
+			break;
+		case 'c':
+			opts.cow = 1;
+			break;
+		case 'a':
+			opts.fault_around = atol(optarg);
+			break;
+		case 'H':
+			opts.hugepages = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	if (optind >= argc || opts.iterations < 1 || opts.warmup < 0 ||
+		opts.metadata < 0)
+	{
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (rave_set_allocator(&counting) != 0) {
+		fprintf(stderr, "Could not set allocator\n");
+		return EXIT_FAILURE;
+	}
+
+	print_header(&opts);
+	for (int i = optind; i < argc; i++) {
+		if (bench(argv[i], &opts, i == optind) != 0) {
+			return EXIT_FAILURE;
+		}
+	}
+	print_footer(&opts);
+
+	return EXIT_SUCCESS;
+}
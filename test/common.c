@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+void *randomize_text(const char *binary, randomize_cb setup,
+	randomize_cb randomize, void *arg, size_t *length)
+{
+	rave_handle_t rh = rave_create();
+	void *text, *copy = NULL;
+	int rc;
+
+	if (NULL != setup && setup(rh, arg) != 0) {
+		fprintf(stderr, "Setup failed\n");
+		goto out;
+	}
+
+	rc = rave_init(rh, binary);
+	if (rc != 0) {
+		fprintf(stderr, "Init failed\n");
+		goto out;
+	}
+
+	rave_set_seed(rh, SEED);
+	rc = NULL != randomize ? randomize(rh, arg) : rave_randomize(rh);
+	if (rc != 0) {
+		fprintf(stderr, "randomization failed\n");
+		goto out;
+	}
+
+	text = rave_get_text(rh, length);
+	if (NULL == text) {
+		fprintf(stderr, "Error getting text\n");
+		goto out;
+	}
+
+	copy = malloc(*length);
+	if (NULL == copy) {
+		fprintf(stderr, "no mem\n");
+		goto out;
+	}
+	memcpy(copy, text, *length);
+
+out:
+	rave_close(rh);
+	rave_destroy(rh);
+	return copy;
+}
+
+/* Same as the binary as long as nothing has been randomized */
+static int differs_from_binary(const char *binary, const void *text,
+	size_t length)
+{
+	rave_handle_t rh = rave_create();
+	void *original;
+	size_t original_length;
+	int differs = 0;
+
+	if (rave_init(rh, binary) != 0) {
+		fprintf(stderr, "Init failed\n");
+		goto out;
+	}
+
+	original = rave_get_text(rh, &original_length);
+	if (NULL == original) {
+		fprintf(stderr, "Error getting text\n");
+		goto out;
+	}
+
+	differs = original_length != length ||
+		memcmp(original, text, length) != 0;
+
+out:
+	rave_close(rh);
+	rave_destroy(rh);
+	return differs;
+}
+
+int check_layouts(const char *binary, const void *expected,
+	size_t expected_length, const void *text, size_t length,
+	const char *what)
+{
+	if (NULL == expected || NULL == text) {
+		return -1;
+	}
+
+	if (!differs_from_binary(binary, expected, expected_length)) {
+		fprintf(stderr, "Nothing was randomized in %s\n", binary);
+		return -1;
+	}
+
+	if (expected_length != length || memcmp(expected, text, length) != 0) {
+		fprintf(stderr, "%s layout differs\n", what);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,29 @@
+/**
+ * Helpers shared by the tests which randomize a binary a couple of different
+ * ways and check that the layouts come out the same.
+ */
+
+#ifndef __TEST_COMMON_H_
+#define __TEST_COMMON_H_
+
+#include <stddef.h>
+#include <rave.h>
+
+#define SEED 0x5eed
+
+typedef int (*randomize_cb)(rave_handle_t rh, void *arg);
+
+/* Randomize binary with SEED and hand back a copy of the resulting text (to be
+ * freed), or NULL on failure. setup, if given, runs before rave_init (e.g. to
+ * set options). randomize does the randomizing, rave_randomize if NULL. */
+void *randomize_text(const char *binary, randomize_cb setup,
+	randomize_cb randomize, void *arg, size_t *length);
+
+/* Compare the layouts from two ways of randomizing binary. They have to be
+ * the same, and actually randomized, so that a test can't pass when nothing
+ * was done at all. Returns 0 if so, what names the second way in errors. */
+int check_layouts(const char *binary, const void *expected,
+	size_t expected_length, const void *text, size_t length,
+	const char *what);
+
+#endif /* __TEST_COMMON_H_ */
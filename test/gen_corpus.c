@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* Callee saved registers a function can be made to save (never rbp, rave
+ * doesn't touch it) */
+static const char *callee_saved[] = {
+	"rbx", "r12", "r13", "r14", "r15",
+};
+#define NR_CALLEE_SAVED (sizeof(callee_saved) / sizeof(callee_saved[0]))
+
+struct options {
+	const char *dir;
+	unsigned long nr_functions, per_file;
+	unsigned int min_regs, max_regs;
+	unsigned int epilogues;
+	const char *opt;
+	int dwarf, eh_frame, build;
+	unsigned long seed;
+};
+
+/* Same seed, same corpus */
+static unsigned long next_random(unsigned long *state)
+{
+	*state = *state * 6364136223846793005UL + 1442695040888963407UL;
+	return *state >> 33;
+}
+
+static FILE *open_file(const char *dir, const char *name)
+{
+	char path[4096];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	f = fopen(path, "w");
+	if (NULL == f) {
+		fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+	}
+
+	return f;
+}
+
+/* One function. The empty asm clobbering callee saved registers forces the
+ * prologue to save them, and each early return is a separate exit, which the
+ * compiler (mostly) gives its own epilogue at -O1 and above. */
+static void emit_function(FILE *f, const struct options *opts,
+	unsigned long n, unsigned long *state)
+{
+	unsigned int nr_regs, first;
+
+	nr_regs = opts->min_regs +
+		next_random(state) % (opts->max_regs - opts->min_regs + 1);
+	first = next_random(state) % NR_CALLEE_SAVED;
+
+	fprintf(f, "__attribute__((noinline)) long f%lu(long x)\n{\n", n);
+
+	if (nr_regs > 0) {
+		fprintf(f, "\t__asm__ volatile (\"\" ::: ");
+		for (unsigned int i = 0; i < nr_regs; i++) {
+			fprintf(f, "%s\"%s\"", i ? ", " : "",
+				callee_saved[(first + i) % NR_CALLEE_SAVED]);
+		}
+		fprintf(f, ");\n");
+	}
+
+	for (unsigned int i = 1; i < opts->epilogues; i++) {
+		fprintf(f, "\tif (x == %u) {\n\t\tsink = x * %lu;\n"
+			"\t\treturn sink;\n\t}\n", i, n + i);
+	}
+
+	fprintf(f, "\treturn x + %lu;\n}\n\n", n);
+}
+
+static int emit_sources(const struct options *opts, unsigned long *nr_files)
+{
+	unsigned long state = opts->seed, n = 0, file = 0;
+	char name[64];
+	FILE *f;
+
+	for (file = 0; n < opts->nr_functions; file++) {
+		snprintf(name, sizeof(name), "f%lu.c", file);
+		f = open_file(opts->dir, name);
+		if (NULL == f) {
+			return -1;
+		}
+
+		fprintf(f, "/* Generated by gen_corpus, do not edit */\n\n"
+			"extern volatile long sink;\n\n");
+		for (unsigned long i = 0; i < opts->per_file &&
+			n < opts->nr_functions; i++, n++)
+		{
+			emit_function(f, opts, n, &state);
+		}
+
+		fclose(f);
+	}
+
+	/* The functions are all global, so the linker keeps every one of them
+	 * even though only the first is called */
+	f = open_file(opts->dir, "main.c");
+	if (NULL == f) {
+		return -1;
+	}
+
+	fprintf(f, "/* Generated by gen_corpus, do not edit */\n\n"
+		"volatile long sink;\n\nlong f0(long x);\n\n"
+		"int main(int argc, char **argv)\n{\n"
+		"\t(void)argv;\n\treturn (int)f0(argc);\n}\n");
+	fclose(f);
+
+	*nr_files = file;
+	return 0;
+}
+
+static int emit_makefile(const struct options *opts, unsigned long nr_files)
+{
+	FILE *f;
+
+	f = open_file(opts->dir, "Makefile");
+	if (NULL == f) {
+		return -1;
+	}
+
+	fprintf(f, "# Generated by gen_corpus, do not edit\n\n"
+		"CC ?= cc\n"
+		"CFLAGS = %s %s %s -fno-inline "
+		"-fno-optimize-sibling-calls\n\n",
+		opts->opt, opts->dwarf ? "-g" : "-g0",
+		opts->eh_frame ? "-fasynchronous-unwind-tables" :
+			"-fno-asynchronous-unwind-tables -fno-unwind-tables");
+
+	fprintf(f, "OBJS = main.o");
+	for (unsigned long i = 0; i < nr_files; i++) {
+		fprintf(f, " \\\n\tf%lu.o", i);
+	}
+
+	fprintf(f, "\n\ncorpus: $(OBJS)\n\t$(CC) $(CFLAGS) -o $@ $(OBJS)\n\n"
+		"%%.o: %%.c\n\t$(CC) $(CFLAGS) -c -o $@ $<\n\n"
+		"clean:\n\trm -f corpus $(OBJS)\n\n"
+		".PHONY: clean\n");
+
+	fclose(f);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options] dir\n"
+		"\t-n N      functions (default 1000)\n"
+		"\t-p N      functions per source file (default 1000)\n"
+		"\t-r MIN[:MAX] callee saved registers per function, 0-5 (default 2:5)\n"
+		"\t-e N      returns per function (default 2)\n"
+		"\t-O FLAGS  optimization flags (default -O2)\n"
+		"\t-g        keep DWARF (.debug_info)\n"
+		"\t-u        drop unwind tables (.eh_frame)\n"
+		"\t-s SEED   seed for the register choices (default 1)\n"
+		"\t-b        build the corpus (runs make in dir)\n",
+		prog);
+}
+
+/* Generates a C program with a controlled number and shape of functions,
+ * along with a Makefile for it, for measuring how rave scales */
+int main(int argc, char **argv) {
+	struct options opts = {
+		.nr_functions = 1000,
+		.per_file = 1000,
+		.min_regs = 2,
+		.max_regs = 5,
+		.epilogues = 2,
+		.opt = "-O2",
+		.eh_frame = 1,
+		.seed = 1,
+	};
+	unsigned long nr_files;
+	char command[4096];
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:p:r:e:O:gus:bh")) != -1) {
+		switch (opt) {
+		case 'n':
+			opts.nr_functions = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			opts.per_file = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			if (sscanf(optarg, "%u:%u", &opts.min_regs, &opts.max_regs) == 1) {
+				opts.max_regs = opts.min_regs;
+			}
+			break;
+		case 'e':
+			opts.epilogues = strtoul(optarg, NULL, 0);
+			break;
+		case 'O':
+			opts.opt = optarg;
+			break;
+		case 'g':
+			opts.dwarf = 1;
+			break;
+		case 'u':
+			opts.eh_frame = 0;
+			break;
+		case 's':
+			opts.seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			opts.build = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc - 1 || opts.nr_functions == 0 || opts.per_file == 0 ||
+		opts.min_regs > opts.max_regs || opts.max_regs > NR_CALLEE_SAVED ||
+		opts.epilogues == 0)
+	{
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	opts.dir = argv[optind];
+
+	if (mkdir(opts.dir, 0755) != 0 && errno != EEXIST) {
+		fprintf(stderr, "Could not create %s: %s\n", opts.dir,
+			strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (emit_sources(&opts, &nr_files) != 0 ||
+		emit_makefile(&opts, nr_files) != 0)
+	{
+		return EXIT_FAILURE;
+	}
+
+	printf("%lu functions in %lu files written to %s\n", opts.nr_functions,
+		nr_files, opts.dir);
+
+	if (opts.build) {
+		snprintf(command, sizeof(command), "make -s -C '%s' -j%ld corpus",
+			opts.dir, sysconf(_SC_NPROCESSORS_ONLN));
+		if (system(command) != 0) {
+			fprintf(stderr, "Building the corpus failed\n");
+			return EXIT_FAILURE;
+		}
+		printf("Built %s/corpus\n", opts.dir);
+	}
+
+	return EXIT_SUCCESS;
+}
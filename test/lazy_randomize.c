@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <rave.h>
+
+#include "common.h"
+
+#define PAGESZ 4096UL
+
+static int set_lazy(rave_handle_t rh, void *arg)
+{
+	return rave_set_option(rh, RAVE_OPT_LAZY, *(int *)arg);
+}
+
+/* In lazy mode, every page of the text has to be faulted in to be randomized */
+static int fault_all(rave_handle_t rh, void *arg)
+{
+	uintptr_t start, addr;
+	size_t length;
+	int rc;
+
+	(void)arg;
+	rc = rave_randomize(rh);
+	if (rc != 0 || NULL == rave_get_text(rh, &length)) {
+		return -1;
+	}
+
+	start = rave_get_text_offset(rh);
+	for (addr = start & ~(PAGESZ - 1); addr < start + length; addr += PAGESZ) {
+		if (NULL == rave_handle_fault(rh, addr)) {
+			fprintf(stderr, "Fault @ 0x%lx failed\n", (unsigned long)addr);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Tests that faulting in every page lazily gives the same layout as eagerly
+ * randomizing with the same seed */
+int main(int argc, char **argv) {
+	const char *binary = argc > 1 ? argv[1] : argv[0];
+	int eager_mode = 0, lazy_mode = 1;
+	void *eager, *lazy;
+	size_t eager_length, lazy_length;
+	int rc;
+
+	eager = randomize_text(binary, set_lazy, NULL, &eager_mode,
+		&eager_length);
+	lazy = randomize_text(binary, set_lazy, fault_all, &lazy_mode,
+		&lazy_length);
+
+	rc = check_layouts(binary, eager, eager_length, lazy, lazy_length,
+		"Lazy");
+	free(eager);
+	free(lazy);
+	if (rc != 0) {
+		return EXIT_FAILURE;
+	}
+
+	printf("Success!\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <rave.h>
+
+#define SEED 0x5eed
+#define PAGESZ 4096UL
+
+/* The code as pages starting at base, like the hashes are. Anything outside
+ * of the code is zero. */
+static void *code_pages(rave_handle_t rh, uintptr_t base, size_t nr)
+{
+	char *pages;
+	void *code;
+	size_t length;
+
+	code = rave_get_code(rh, &length);
+	pages = calloc(nr, PAGESZ);
+	if (NULL == code || NULL == pages) {
+		free(pages);
+		return NULL;
+	}
+
+	memcpy(pages + (rave_get_code_address(rh) - base), code, length);
+	return pages;
+}
+
+/* Hashes of the code pages of a handle, and the pages themselves, before and
+ * after randomizing */
+static int hashes(const char *binary, uint64_t **before, uint64_t **after,
+	void **original, void **randomized, struct rave_range **dirty,
+	size_t *nr_dirty, uintptr_t *base)
+{
+	rave_handle_t rh = rave_create();
+	size_t nr;
+	int rc = -1;
+
+	if (rave_init(rh, binary) != 0) {
+		fprintf(stderr, "Init failed\n");
+		goto out;
+	}
+
+	nr = rave_get_page_hashes(rh, NULL, 0, base);
+	*before = calloc(nr, sizeof(uint64_t));
+	*after = calloc(nr, sizeof(uint64_t));
+	if (nr == 0 || NULL == *before || NULL == *after) {
+		fprintf(stderr, "No hashes\n");
+		goto out;
+	}
+	rave_get_page_hashes(rh, *before, nr, base);
+
+	/* Nothing is written yet, this is what is in the binary */
+	*original = code_pages(rh, *base, nr);
+
+	rave_set_seed(rh, SEED);
+	if (rave_randomize(rh) != 0) {
+		fprintf(stderr, "randomization failed\n");
+		goto out;
+	}
+	rave_get_page_hashes(rh, *after, nr, base);
+
+	*randomized = code_pages(rh, *base, nr);
+	if (NULL == *original || NULL == *randomized) {
+		fprintf(stderr, "Error getting code\n");
+		goto out;
+	}
+
+	*nr_dirty = rave_get_dirty_pages(rh, NULL, 0);
+	*dirty = calloc(*nr_dirty + 1, sizeof(**dirty));
+	if (NULL == *dirty) {
+		fprintf(stderr, "no mem\n");
+		goto out;
+	}
+	rave_get_dirty_pages(rh, *dirty, *nr_dirty);
+
+	rc = (int)nr;
+out:
+	rave_close(rh);
+	rave_destroy(rh);
+	return rc;
+}
+
+static int is_dirty(const struct rave_range *dirty, size_t nr_dirty,
+	uintptr_t address)
+{
+	for (size_t i = 0; i < nr_dirty; i++) {
+		if (address >= dirty[i].address &&
+			address < dirty[i].address + dirty[i].length)
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Tests that a page's hash changes exactly when its bytes differ from the
+ * binary, that only written pages change, and that the same layout hashes the
+ * same in another handle */
+int main(int argc, char **argv) {
+	const char *binary = argc > 1 ? argv[1] : argv[0];
+	uint64_t *before = NULL, *after = NULL, *before2 = NULL, *after2 = NULL;
+	void *original = NULL, *randomized = NULL, *original2 = NULL;
+	void *randomized2 = NULL;
+	struct rave_range *dirty = NULL, *dirty2 = NULL;
+	size_t nr_dirty, nr_dirty2, changed = 0;
+	uintptr_t base, base2;
+	int nr, nr2, differs, ret = EXIT_FAILURE;
+
+	nr = hashes(binary, &before, &after, &original, &randomized, &dirty,
+		&nr_dirty, &base);
+	nr2 = hashes(binary, &before2, &after2, &original2, &randomized2,
+		&dirty2, &nr_dirty2, &base2);
+	if (nr < 0 || nr != nr2 || base != base2) {
+		goto out;
+	}
+
+	for (int i = 0; i < nr; i++) {
+		differs = memcmp((char *)original + i * PAGESZ,
+			(char *)randomized + i * PAGESZ, PAGESZ) != 0;
+
+		if (differs != (before[i] != after[i])) {
+			fprintf(stderr, "Page %d %s\n", i, differs ?
+				"was rewritten but kept its hash" :
+				"changed hash but not bytes");
+			goto out;
+		}
+
+		if (differs) {
+			changed++;
+			if (!is_dirty(dirty, nr_dirty, base + i * PAGESZ)) {
+				fprintf(stderr, "Page %d changed without being written\n",
+					i);
+				goto out;
+			}
+		}
+	}
+
+	if (changed == 0) {
+		fprintf(stderr, "Nothing was randomized in %s\n", binary);
+		goto out;
+	}
+
+	if (memcmp(before, before2, nr * sizeof(*before)) != 0 ||
+		memcmp(after, after2, nr * sizeof(*after)) != 0)
+	{
+		fprintf(stderr, "Same layout hashed differently\n");
+		goto out;
+	}
+
+	printf("%zu of %d pages changed\n", changed, nr);
+	ret = EXIT_SUCCESS;
+
+out:
+	free(before);
+	free(after);
+	free(before2);
+	free(after2);
+	free(original);
+	free(randomized);
+	free(original2);
+	free(randomized2);
+	free(dirty);
+	free(dirty2);
+	return ret;
+}
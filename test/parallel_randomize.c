@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <rave.h>
+
+#include "common.h"
+
+static int set_workers(rave_handle_t rh, void *arg)
+{
+	return rave_set_option(rh, RAVE_OPT_RANDOMIZE_WORKERS, *(long *)arg);
+}
+
+/* Tests that the parallel randomization gives the same layout as the serial
+ * one for the same seed */
+int main(int argc, char **argv) {
+	const char *binary = argc > 1 ? argv[1] : argv[0];
+	long serial_workers = 1, nr_workers = argc > 2 ? atol(argv[2]) : 0;
+	void *serial, *parallel;
+	size_t serial_length, parallel_length;
+	int rc;
+
+	serial = randomize_text(binary, set_workers, NULL, &serial_workers,
+		&serial_length);
+	parallel = randomize_text(binary, set_workers, NULL, &nr_workers,
+		&parallel_length);
+
+	rc = check_layouts(binary, serial, serial_length, parallel,
+		parallel_length, "Parallel");
+	free(serial);
+	free(parallel);
+	if (rc != 0) {
+		return EXIT_FAILURE;
+	}
+
+	printf("Success!\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define X86_64
+#define LINUX
+#include <dr_api.h>
+
+#include "pushpop.h"
+
+/* Encode with DynamoRIO, the way rave used to */
+static int dr_encode(uint8_t reg, int pop, byte *target)
+{
+	opnd_t opnd = opnd_create_reg(DR_REG_RAX + reg);
+	instr_t *instr;
+	byte *end;
+
+	instr = pop ?
+		INSTR_CREATE_pop(GLOBAL_DCONTEXT, opnd) :
+		INSTR_CREATE_push(GLOBAL_DCONTEXT, opnd);
+	if (NULL == instr) {
+		return -1;
+	}
+
+	end = instr_encode_to_copy(GLOBAL_DCONTEXT, instr, target, target);
+	instr_destroy(GLOBAL_DCONTEXT, instr);
+
+	return end ? end - target : -1;
+}
+
+/* Tests that the push/pop templates match DynamoRIO byte for byte, for every
+ * register */
+int main(void) {
+	byte expected[16], actual[16];
+	int length, failed = 0;
+
+	if (!dr_set_isa_mode(GLOBAL_DCONTEXT, DR_ISA_AMD64, NULL)) {
+		fprintf(stderr, "Could not set isa mode\n");
+		return EXIT_FAILURE;
+	}
+
+	for (int pop = 0; pop < 2; pop++) {
+		for (uint8_t reg = 0; reg < PUSHPOP_NR_REGS; reg++) {
+			length = dr_encode(reg, pop, expected);
+			if (length < 0) {
+				fprintf(stderr, "DynamoRIO could not encode %s %u\n",
+					pop ? "pop" : "push", reg);
+				failed = 1;
+				continue;
+			}
+
+			memset(actual, 0, sizeof(actual));
+			if ((size_t)length != pushpop_length(reg) ||
+				pushpop_encode(actual, reg, pop) != actual + length ||
+				memcmp(expected, actual, length) != 0)
+			{
+				fprintf(stderr, "Encodings of %s %u differ\n",
+					pop ? "pop" : "push", reg);
+				failed = 1;
+			}
+		}
+	}
+
+	if (failed) {
+		return EXIT_FAILURE;
+	}
+
+	printf("Success!\n");
+	return EXIT_SUCCESS;
+}
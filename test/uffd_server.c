@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/userfaultfd.h>
+#include <rave.h>
+
+#define SEED 0x5eed
+#define PAGESZ 4096
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int send_fd(int sock, int fd)
+{
+	char data = 0, control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = &data, .iov_len = 1 };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	return sendmsg(sock, &msg, 0) == 1 ? 0 : -1;
+}
+
+static int recv_fd(int sock)
+{
+	char data, control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = &data, .iov_len = 1 };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg;
+	int fd;
+
+	if (recvmsg(sock, &msg, 0) != 1) {
+		return -1;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (NULL == cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+		return -1;
+	}
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+	return fd;
+}
+
+static int read_all(int fd, void *buf, size_t length)
+{
+	ssize_t nr;
+
+	for (size_t done = 0; done < length; done += nr) {
+		nr = read(fd, (char *)buf + done, length - done);
+		if (nr <= 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t length)
+{
+	ssize_t nr;
+
+	for (size_t done = 0; done < length; done += nr) {
+		nr = write(fd, (const char *)buf + done, length - done);
+		if (nr <= 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* The target: hands its userfaultfd over, waits for the region to be
+ * registered, then touches all of it front to back. Everything is copied out
+ * in user mode first, the kernel touching the region wouldn't be served. */
+static int child(int sock, const void *region, size_t length)
+{
+	struct uffdio_api api = { .api = UFFD_API };
+	uint64_t start, elapsed;
+	char go;
+	void *copy;
+	int uffd;
+
+	uffd = syscall(SYS_userfaultfd, O_CLOEXEC | UFFD_USER_MODE_ONLY);
+	if (uffd < 0) {
+		uffd = syscall(SYS_userfaultfd, O_CLOEXEC);
+	}
+	if (uffd < 0 || ioctl(uffd, UFFDIO_API, &api) != 0) {
+		perror("userfaultfd");
+		return EXIT_FAILURE;
+	}
+
+	copy = malloc(length);
+	if (NULL == copy || send_fd(sock, uffd) != 0 ||
+		read_all(sock, &go, 1) != 0)
+	{
+		return EXIT_FAILURE;
+	}
+
+	start = now_ns();
+	memcpy(copy, region, length);
+	elapsed = now_ns() - start;
+
+	if (write_all(sock, &elapsed, sizeof(elapsed)) != 0 ||
+		write_all(sock, copy, length) != 0)
+	{
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* Serves the code to a child process over its userfaultfd: the child maps an
+ * empty region the size of the code, and the server fills it in as it is
+ * touched. Every page is checked against the layout. The time it takes the
+ * child to get all of it in is printed, so different fault-around sizes (the
+ * second argument) can be compared. */
+int main(int argc, char **argv) {
+	const char *binary = argc > 1 ? argv[1] : argv[0];
+	long around = argc > 2 ? strtol(argv[2], NULL, 0) : 16;
+	rave_handle_t rh = rave_create();
+	rave_uffd_t server = rave_uffd_create();
+	struct rave_uffd_stats stats;
+	size_t length, mapped = 0;
+	uint64_t elapsed;
+	void *code, *served = NULL, *region = MAP_FAILED;
+	int socks[2] = { -1, -1 }, uffd = -1, status, rc, ret = EXIT_FAILURE;
+	pid_t pid = -1;
+
+	/* Touched front to back, so most pages should come in along with
+	 * another */
+	rc = rave_set_option(rh, RAVE_OPT_FAULT_AROUND, around);
+	rc = rc ? rc : rave_init(rh, binary);
+	if (rc != 0) {
+		fprintf(stderr, "Init failed\n");
+		goto out;
+	}
+
+	rave_set_seed(rh, SEED);
+	rc = rave_randomize(rh);
+	if (rc != 0) {
+		fprintf(stderr, "randomization failed\n");
+		goto out;
+	}
+
+	code = rave_get_code(rh, &length);
+	if (NULL == code) {
+		fprintf(stderr, "Error getting code\n");
+		goto out;
+	}
+
+	/* Mapped before forking so it is at the same address in the child, and
+	 * never touched here */
+	mapped = (length + PAGESZ - 1) & ~(size_t)(PAGESZ - 1);
+	region = mmap(NULL, mapped, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	served = malloc(length);
+	if (MAP_FAILED == region || NULL == served ||
+		socketpair(AF_UNIX, SOCK_STREAM, 0, socks) != 0)
+	{
+		perror("setup");
+		goto out;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		goto out;
+	} else if (pid == 0) {
+		close(socks[0]);
+		_exit(child(socks[1], region, length));
+	}
+	close(socks[1]);
+	socks[1] = -1;
+
+	uffd = recv_fd(socks[0]);
+	if (uffd < 0) {
+		fprintf(stderr, "Didn't get the child's userfaultfd\n");
+		goto out;
+	}
+
+	rc = rave_relocate(rh, (uintptr_t)region);
+	rc = rc ? rc : rave_uffd_init(server, rh, uffd, 2);
+	rc = rc ? rc : rave_uffd_register(server, (uintptr_t)region, mapped);
+	if (rc != 0) {
+		fprintf(stderr, "Could not start the server (%d)\n", rc);
+		goto out;
+	}
+
+	if (write_all(socks[0], "", 1) != 0 ||
+		read_all(socks[0], &elapsed, sizeof(elapsed)) != 0 ||
+		read_all(socks[0], served, length) != 0)
+	{
+		fprintf(stderr, "Child didn't get through the region\n");
+		goto out;
+	}
+
+	if (memcmp(served, code, length) != 0) {
+		fprintf(stderr, "Served pages don't match the layout\n");
+		goto out;
+	}
+
+	rave_uffd_get_stats(server, &stats);
+	if (stats.pages != mapped / PAGESZ || stats.faults > stats.pages ||
+		stats.errors != 0)
+	{
+		fprintf(stderr, "Expected %zu pages without errors, got %llu (%llu "
+			"errors)\n", mapped / PAGESZ, (unsigned long long)stats.pages,
+			(unsigned long long)stats.errors);
+		goto out;
+	}
+
+	printf("%llu pages in %llu faults (%llu copied, %llu zero), %llu ns max, "
+		"%llu ns in all\n",
+		(unsigned long long)stats.pages, (unsigned long long)stats.faults,
+		(unsigned long long)stats.copies,
+		(unsigned long long)stats.zeropages,
+		(unsigned long long)stats.latency_max_ns,
+		(unsigned long long)elapsed);
+	ret = EXIT_SUCCESS;
+
+out:
+	rave_uffd_close(server);
+	rave_uffd_destroy(server);
+	if (pid > 0) {
+		if (ret != EXIT_SUCCESS) kill(pid, SIGKILL);
+		if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+			WEXITSTATUS(status) != EXIT_SUCCESS)
+		{
+			ret = EXIT_FAILURE;
+		}
+	}
+	if (uffd >= 0) close(uffd);
+	if (socks[0] >= 0) close(socks[0]);
+	if (socks[1] >= 0) close(socks[1]);
+	if (MAP_FAILED != region) munmap(region, mapped);
+	free(served);
+	rave_close(rh);
+	rave_destroy(rh);
+	return ret;
+}